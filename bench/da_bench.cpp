@@ -0,0 +1,892 @@
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "best_effort_broadcast.hpp"
+#include "common.hpp"
+#include "fifo_broadcast.hpp"
+#include "lattice_agreement.hpp"
+#include "metrics.hpp"
+#include "perfect_link.hpp"
+#include "simulated_network.hpp"
+#include "uniform_reliable_broadcast.hpp"
+
+/// Drives a layer of the stack directly with a group of processes on the
+/// loopback interface, or on a simulated network, and reports its throughput,
+/// latency and CPU cost as JSON. Every sweep point runs in freshly forked
+/// processes, so that points do not share sockets, threads or allocator state.
+
+using Clock = std::chrono::steady_clock;
+
+enum class Layer : std::uint8_t {
+  PerfectLink = 0,
+  BestEffortBroadcast = 1,
+  UniformReliableBroadcast = 2,
+  FifoBroadcast = 3,
+  LatticeAgreement = 4,
+};
+
+static constexpr std::array<std::pair<std::string_view, Layer>, 5> LAYERS = {{
+    {"pl", Layer::PerfectLink},
+    {"beb", Layer::BestEffortBroadcast},
+    {"urb", Layer::UniformReliableBroadcast},
+    {"fifo", Layer::FifoBroadcast},
+    {"la", Layer::LatticeAgreement},
+}};
+
+enum class Mode : std::uint8_t {
+  /// @brief Every member of a group is a process of its own.
+  Processes = 0,
+  /// @brief All members of a group are threads of a single process.
+  Threads = 1,
+};
+
+enum class Network : std::uint8_t {
+  /// @brief UDP sockets on the loopback interface.
+  Sockets = 0,
+  /// @brief A `SimulatedNetwork` shared by all members, which are threads of
+  /// a single process. Times are virtual.
+  Simulated = 1,
+};
+
+/// @brief Every payload starts with the time it was sent at.
+static constexpr std::size_t TIMESTAMP_SIZE = sizeof(std::int64_t);
+
+/// @brief A single measurement.
+struct Point {
+  Layer layer;
+  Mode mode;
+  Network network;
+  /// @brief Only used by a simulated network.
+  NetworkConditions conditions;
+  UniformReliableBroadcast::RelayMode relay_mode;
+  std::size_t processes;
+  /// @brief Bytes per payload, or values per proposal of lattice agreements.
+  std::size_t payload;
+  /// @brief Payloads handed to the layer at once.
+  std::size_t batch;
+  std::uint16_t window;
+  /// @brief `LinkOptions::broadcast_fanout`, zero to broadcast directly.
+  std::uint8_t fanout;
+  /// @brief Multicast group all links join on the base port, empty to send
+  /// unicast only.
+  std::string multicast;
+  /// @brief `LinkOptions::coalesce_delay`, zero to send every message right
+  /// away.
+  std::chrono::microseconds coalesce_delay;
+  /// @brief Messages sent, or agreements proposed, by every member.
+  std::size_t messages;
+  Clock::duration timeout;
+  in_port_t base_port;
+};
+
+/// @brief What a member reports, sent over a pipe as raw bytes.
+struct MemberResult {
+  bool complete;
+  std::uint64_t delivered;
+  std::uint64_t elapsed_ns;
+  /// @brief CPU time of the whole process of the member. Set for a single
+  /// member of every process, zero for the others.
+  std::uint64_t cpu_ns;
+  /// @brief Retransmissions of the whole process, set like `cpu_ns`.
+  std::uint64_t retransmissions;
+  /// @brief Send to delivery latencies in nanoseconds.
+  Metrics::HistogramSnapshot latency;
+};
+static_assert(std::is_trivially_copyable_v<MemberResult>);
+
+/// @brief The network of the group of the current process, if simulated.
+static std::shared_ptr<SimulatedNetwork> simulated;
+
+/// @brief Time of the network, all latencies and durations are measured in it.
+static auto now() -> Clock::time_point {
+  return simulated != nullptr ? simulated->now() : Clock::now();
+}
+
+using Start = std::function<auto()->void>;
+/// @brief Reports the result of a member and never returns, the layers of the
+/// member stay alive until the process exits.
+using Finish = std::function<auto(const MemberResult& result)->void>;
+
+/// @brief Counts the deliveries of a member and records their latencies.
+/// Thread safe.
+class Deliveries {
+ public:
+  explicit Deliveries(const std::uint64_t expected) : _expected(expected) {}
+
+  auto deliver(const Clock::duration latency) -> void {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _latency.record(static_cast<std::uint64_t>(std::max<std::int64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count(),
+        0)));
+    _delivered += 1;
+    if (_delivered == _expected) {
+      _finished_at = now();
+      _cv.notify_all();
+    }
+  }
+
+  /// @brief Waits for all expected deliveries, at most until the deadline.
+  /// @param deadline On the wall clock, also for a simulated network.
+  auto result(const Clock::time_point started_at,
+              const Clock::time_point deadline) -> MemberResult {
+    std::unique_lock<std::mutex> lock(_mutex);
+    const auto complete = _cv.wait_until(
+        lock, deadline, [&] { return _delivered >= _expected; });
+    const auto finished_at = complete ? _finished_at : now();
+
+    MemberResult result{};
+    result.complete = complete;
+    result.delivered = _delivered;
+    result.elapsed_ns = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(finished_at -
+                                                             started_at)
+            .count());
+    result.latency = _latency;
+    return result;
+  }
+
+ private:
+  const std::uint64_t _expected;
+  std::uint64_t _delivered = 0;
+  Clock::time_point _finished_at;
+  Metrics::HistogramSnapshot _latency;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+};
+
+static auto stamp(std::uint8_t* payload) -> void {
+  const std::int64_t sent_at = now().time_since_epoch().count();
+  std::memcpy(payload, &sent_at, TIMESTAMP_SIZE);
+}
+
+/// @brief How long ago a payload was stamped. The steady clock is shared by
+/// all processes of the machine, a simulated network by all its members.
+static auto age(const Slice<std::uint8_t>& payload) -> Clock::duration {
+  std::int64_t sent_at;
+  auto [data, size] = payload.unsafe_raw();
+  assert(size >= TIMESTAMP_SIZE);
+  std::memcpy(&sent_at, data, TIMESTAMP_SIZE);
+  return now().time_since_epoch() - Clock::duration(sent_at);
+}
+
+static auto address_of(const Point& point, const std::size_t id)
+    -> BestEffortBroadcast::ProcessAddress {
+  return {inet_addr("127.0.0.1"),
+          htons(static_cast<in_port_t>(point.base_port + id))};
+}
+
+static auto processes_of(const Point& point)
+    -> BestEffortBroadcast::AvailableProcesses {
+  BestEffortBroadcast::AvailableProcesses processes;
+  for (std::size_t id = 1; id <= point.processes; id++) {
+    processes[static_cast<PerfectLink::ProcessIdType>(id)] =
+        address_of(point, id);
+  }
+  return processes;
+}
+
+/// @brief Payloads of a batch, stamped right before they are sent.
+class Batch {
+ public:
+  explicit Batch(const Point& point)
+      : _buffers(point.batch, std::vector<std::uint8_t>(point.payload)) {
+    for (const auto& buffer : _buffers) {
+      _slices.emplace_back(buffer.data(), buffer.size());
+    }
+  }
+
+  /// @brief The first `amount` payloads, stamped with the current time.
+  auto stamped(const std::size_t amount) -> PerfectLink::Payloads {
+    for (std::size_t i = 0; i < amount; i++) {
+      stamp(_buffers[i].data());
+    }
+    return {_slices.data(), amount};
+  }
+
+ private:
+  std::vector<std::vector<std::uint8_t>> _buffers;
+  std::vector<Slice<std::uint8_t>> _slices;
+};
+
+/// @brief Sends all batches of a member with a link call that packs as many
+/// leading payloads as fit and returns how many it took.
+template <typename Send>
+static auto send_batches(const Point& point, Send send) -> void {
+  Batch batch(point);
+  for (std::size_t sent = 0; sent < point.messages; sent += point.batch) {
+    auto payloads =
+        batch.stamped(std::min(point.batch, point.messages - sent));
+    for (std::size_t packed = 0; packed < payloads.size();) {
+      packed += send(packed == 0 ? payloads : payloads.subslice(packed));
+    }
+  }
+}
+
+/// @brief Runs a single member of a group: sets up its layer, waits for all
+/// members to be ready, sends and reports once it delivered everything.
+static auto run_member(const Point& point,
+                       const PerfectLink::ProcessIdType id,
+                       const Start& start,
+                       const Finish& finish) -> void {
+  LinkOptions options;
+  options.max_in_flight = point.window;
+  options.transport = simulated;
+  options.broadcast_fanout = point.fanout;
+  options.coalesce_delay = point.coalesce_delay;
+  if (!point.multicast.empty()) {
+    options.multicast_group = PerfectLink::make_address(
+        inet_addr(point.multicast.c_str()), htons(point.base_port));
+  }
+  const auto processes = processes_of(point);
+  const auto self = address_of(point, id);
+  const auto count = static_cast<std::uint64_t>(point.processes);
+  const auto messages = static_cast<std::uint64_t>(point.messages);
+  const Slice<std::uint8_t> no_metadata(nullptr, 0);
+
+  // the timeout is on the wall clock, so that a simulated run that makes no
+  // progress is still given up
+  Clock::time_point deadline;
+  const auto begin = [&] {
+    start();
+    deadline = Clock::now() + point.timeout;
+    return now();
+  };
+  const auto report = [&](Deliveries& deliveries,
+                           const Clock::time_point started_at) {
+    finish(deliveries.result(started_at, deadline));
+  };
+
+  switch (point.layer) {
+    case Layer::PerfectLink: {
+      // every member sends to the next one
+      Deliveries deliveries(messages);
+      PerfectLink link(id, point.processes, options);
+      link.bind(self.host, self.port);
+      std::thread([&] {
+        link.listen([&](auto, auto& data) { deliveries.deliver(age(data)); });
+      }).detach();
+
+      const auto next = address_of(
+          point, static_cast<std::size_t>(id) % point.processes + 1);
+      const auto started_at = begin();
+      send_batches(point, [&](auto payloads) {
+        return link.send(next.host, next.port, no_metadata, payloads);
+      });
+      report(deliveries, started_at);
+      break;
+    }
+
+    case Layer::BestEffortBroadcast: {
+      Deliveries deliveries(count * messages);
+      BestEffortBroadcast link(id, processes, options);
+      link.bind(self.host, self.port);
+      std::thread([&] {
+        link.listen([&](auto, auto& data) { deliveries.deliver(age(data)); });
+      }).detach();
+
+      const auto started_at = begin();
+      send_batches(point, [&](auto payloads) {
+        return link.broadcast(no_metadata, payloads);
+      });
+      report(deliveries, started_at);
+      break;
+    }
+
+    case Layer::UniformReliableBroadcast: {
+      Deliveries deliveries(count * messages);
+      UniformReliableBroadcast link(id, processes, options, point.relay_mode);
+      link.bind(self.host, self.port);
+      std::thread([&] {
+        link.listen(
+            [&](auto, auto, auto& data) { deliveries.deliver(age(data)); });
+      }).detach();
+
+      const auto started_at = begin();
+      send_batches(point, [&](auto payloads) {
+        link.broadcast(payloads);
+        return payloads.size();
+      });
+      report(deliveries, started_at);
+      break;
+    }
+
+    case Layer::FifoBroadcast: {
+      Deliveries deliveries(count * messages);
+      FifoBroadcast link(id, processes, options, point.relay_mode);
+      link.bind(self.host, self.port);
+      std::thread([&] {
+        link.listen([&](auto, auto& data) { deliveries.deliver(age(data)); });
+      }).detach();
+
+      const auto started_at = begin();
+      send_batches(point, [&](auto payloads) {
+        link.broadcast(payloads);
+        return payloads.size();
+      });
+      report(deliveries, started_at);
+      break;
+    }
+
+    case Layer::LatticeAgreement: {
+      // proposals overlap, so that agreements take more than a single round
+      const auto distinct = 3 * point.payload;
+      std::mt19937 random(id);
+      std::uniform_int_distribution<LatticeAgreement::AgreementType> values(
+          1, static_cast<LatticeAgreement::AgreementType>(distinct));
+
+      Deliveries deliveries(messages);
+      // decisions are delivered in the order of proposals
+      std::vector<Clock::time_point> proposed_at(point.messages);
+      std::size_t decided = 0;
+      LatticeAgreement agreement(
+          id, processes, distinct,
+          [&](auto&) {
+            deliveries.deliver(now() - proposed_at[decided++]);
+          },
+          options);
+      agreement.bind(self.host, self.port);
+      std::thread([&] { agreement.listen(); }).detach();
+
+      std::vector<LatticeAgreement::AgreementType> proposal(point.payload);
+      const auto started_at = begin();
+      for (std::size_t i = 0; i < point.messages; i++) {
+        for (auto& value : proposal) {
+          value = values(random);
+        }
+        proposed_at[i] = now();
+        agreement.propose(proposal);
+      }
+      report(deliveries, started_at);
+      break;
+    }
+
+    default:
+      // poor man's std::unreachable();
+      assert(false);
+      break;
+  }
+}
+
+static auto cpu_time() -> std::uint64_t {
+  rusage usage;
+  perror_check<int>([&]() noexcept { return getrusage(RUSAGE_SELF, &usage); },
+                    [](auto res) noexcept { return res < 0; },
+                    "failed to get resource usage", true);
+  const auto to_ns = [](const timeval& time) {
+    return static_cast<std::uint64_t>(time.tv_sec) * 1'000'000'000 +
+           static_cast<std::uint64_t>(time.tv_usec) * 1'000;
+  };
+  return to_ns(usage.ru_utime) + to_ns(usage.ru_stime);
+}
+
+static auto retransmissions() -> std::uint64_t {
+  return Metrics::snapshot().counters[static_cast<std::size_t>(
+      Metrics::Counter::LinkRetransmitted)];
+}
+
+static auto write_all(const int fd, const void* data, const std::size_t size)
+    -> bool {
+  std::size_t written = 0;
+  while (written < size) {
+    const auto res = perror_check<ssize_t>(
+        [&]() noexcept {
+          return write(fd, static_cast<const char*>(data) + written,
+                       size - written);
+        },
+        [](auto res) noexcept { return res < 0; }, "failed to write to pipe");
+    if (res < 0) {
+      return false;
+    }
+    written += static_cast<std::size_t>(res);
+  }
+  return true;
+}
+
+/// @return False if the pipe was closed before all data arrived.
+static auto read_all(const int fd, void* data, const std::size_t size)
+    -> bool {
+  std::size_t done = 0;
+  while (done < size) {
+    const auto res = perror_check<ssize_t>(
+        [&]() noexcept {
+          return read(fd, static_cast<char*>(data) + done, size - done);
+        },
+        [](auto res) noexcept { return res < 0; }, "failed to read from pipe");
+    if (res <= 0) {
+      return false;
+    }
+    done += static_cast<std::size_t>(res);
+  }
+  return true;
+}
+
+static auto make_pipe() -> std::array<int, 2> {
+  std::array<int, 2> fds;
+  perror_check<int>([&]() noexcept { return pipe(fds.data()); },
+                    [](auto res) noexcept { return res < 0; },
+                    "failed to create pipe", true);
+  return fds;
+}
+
+/// @brief A forked process running members of a group. It writes a byte to
+/// `reports` once its members are ready, waits for a byte on `control` to
+/// start, then writes a `MemberResult` per member to `reports`. It exits on a
+/// second byte on `control`: later children inherit the write end of the
+/// pipe, so it is not closed when the parent closes it.
+struct Child {
+  pid_t pid;
+  int control;
+  int reports;
+  std::size_t members;
+};
+
+template <typename Run>
+static auto fork_child(const std::size_t members, Run run) -> Child {
+  const auto control = make_pipe();
+  const auto reports = make_pipe();
+  const auto pid = perror_check<pid_t>(
+      []() noexcept { return fork(); },
+      [](auto res) noexcept { return res < 0; }, "failed to fork", true);
+  if (pid == 0) {
+    close(control[1]);
+    close(reports[0]);
+    run(control[0], reports[1]);
+    _exit(0);
+  }
+  close(control[0]);
+  close(reports[1]);
+  return {pid, control[1], reports[0], members};
+}
+
+/// @brief Runs a group where every member is a process.
+static auto fork_processes(const Point& point) -> std::vector<Child> {
+  std::vector<Child> children;
+  for (std::size_t id = 1; id <= point.processes; id++) {
+    children.push_back(fork_child(1, [&](int control, int reports) {
+      std::uint64_t cpu_at_start = 0;
+      std::uint64_t retransmissions_at_start = 0;
+      const Start start = [&] {
+        char byte = 'r';
+        write_all(reports, &byte, 1);
+        if (!read_all(control, &byte, 1)) {
+          _exit(1);
+        }
+        cpu_at_start = cpu_time();
+        retransmissions_at_start = retransmissions();
+      };
+      const Finish finish = [&](const MemberResult& result) {
+        auto reported = result;
+        reported.cpu_ns = cpu_time() - cpu_at_start;
+        reported.retransmissions = retransmissions() - retransmissions_at_start;
+        write_all(reports, &reported, sizeof(reported));
+        // keep acknowledging the others until the parent is done
+        char byte;
+        read_all(control, &byte, 1);
+        _exit(0);
+      };
+      run_member(point, static_cast<PerfectLink::ProcessIdType>(id), start,
+                 finish);
+    }));
+  }
+  return children;
+}
+
+/// @brief Runs a group where every member is a thread of a single process.
+static auto fork_threads(const Point& point) -> std::vector<Child> {
+  return {fork_child(point.processes, [&](int control, int reports) {
+    if (point.network == Network::Simulated) {
+      simulated = std::make_shared<SimulatedNetwork>(point.conditions);
+    }
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::size_t ready = 0;
+    bool started = false;
+    std::vector<MemberResult> results;
+
+    const Start start = [&] {
+      std::unique_lock<std::mutex> lock(mutex);
+      ready += 1;
+      cv.notify_all();
+      cv.wait(lock, [&] { return started; });
+    };
+    const Finish finish = [&](const MemberResult& result) {
+      std::unique_lock<std::mutex> lock(mutex);
+      results.push_back(result);
+      cv.notify_all();
+      // keep acknowledging the others until the process exits
+      cv.wait(lock, [] { return false; });
+    };
+
+    for (std::size_t id = 1; id <= point.processes; id++) {
+      std::thread([&, id] {
+        run_member(point, static_cast<PerfectLink::ProcessIdType>(id), start,
+                   finish);
+      }).detach();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return ready == point.processes; });
+    char byte = 'r';
+    write_all(reports, &byte, 1);
+    lock.unlock();
+    if (!read_all(control, &byte, 1)) {
+      _exit(1);
+    }
+    const auto cpu_at_start = cpu_time();
+    const auto retransmissions_at_start = retransmissions();
+    lock.lock();
+    started = true;
+    cv.notify_all();
+
+    cv.wait(lock, [&] { return results.size() == point.processes; });
+    results[0].cpu_ns = cpu_time() - cpu_at_start;
+    results[0].retransmissions = retransmissions() - retransmissions_at_start;
+    write_all(reports, results.data(), results.size() * sizeof(MemberResult));
+    lock.unlock();
+    read_all(control, &byte, 1);
+    _exit(0);
+  })};
+}
+
+static auto layer_name(const Layer layer) -> std::string_view {
+  for (const auto& [name, value] : LAYERS) {
+    if (value == layer) {
+      return name;
+    }
+  }
+  return "unknown";
+}
+
+/// @brief Runs a point and writes it as a JSON object.
+static auto measure(const Point& point, std::ostream& out) -> void {
+  auto children = point.mode == Mode::Processes ? fork_processes(point)
+                                                : fork_threads(point);
+  const auto is_simulated = point.network == Network::Simulated;
+
+  // start all members at once
+  bool failed = false;
+  for (const auto& child : children) {
+    char byte;
+    failed = failed || !read_all(child.reports, &byte, 1);
+  }
+  for (const auto& child : children) {
+    const char byte = 's';
+    failed = failed || !write_all(child.control, &byte, 1);
+  }
+
+  std::vector<MemberResult> results;
+  for (const auto& child : children) {
+    for (std::size_t i = 0; i < child.members && !failed; i++) {
+      MemberResult result;
+      failed = !read_all(child.reports, &result, sizeof(result));
+      results.push_back(result);
+    }
+  }
+
+  for (const auto& child : children) {
+    const char byte = 'x';
+    if (failed || !write_all(child.control, &byte, 1)) {
+      kill(child.pid, SIGKILL);
+    }
+  }
+  for (const auto& child : children) {
+    close(child.control);
+    close(child.reports);
+    perror_check<pid_t>(
+        [&]() noexcept { return waitpid(child.pid, nullptr, 0); },
+        [](auto res) noexcept { return res < 0; }, "failed to wait for child");
+  }
+
+  bool complete = !failed;
+  std::uint64_t delivered = 0;
+  std::uint64_t elapsed_ns = 0;
+  std::uint64_t cpu_ns = 0;
+  std::uint64_t retransmitted = 0;
+  Metrics::HistogramSnapshot latency;
+  for (const auto& result : results) {
+    complete = complete && result.complete;
+    delivered += result.delivered;
+    elapsed_ns = std::max(elapsed_ns, result.elapsed_ns);
+    cpu_ns += result.cpu_ns;
+    retransmitted += result.retransmissions;
+    latency.merge(result.latency);
+  }
+
+  const auto per = [](const double value, const std::uint64_t amount) {
+    return amount > 0 ? value / static_cast<double>(amount) : 0.0;
+  };
+  const auto elapsed_s = static_cast<double>(elapsed_ns) / 1e9;
+  const auto us = [](const std::uint64_t ns) {
+    return static_cast<double>(ns) / 1e3;
+  };
+
+  out << std::fixed << std::setprecision(3) << "{\"layer\": \""
+      << layer_name(point.layer) << "\", \"mode\": \""
+      << (point.mode == Mode::Processes ? "processes" : "threads")
+      << "\", \"network\": \"" << (is_simulated ? "sim" : "sockets")
+      << "\", \"loss\": " << (is_simulated ? point.conditions.loss : 0.0)
+      << ", \"relay\": \""
+      << (point.relay_mode == UniformReliableBroadcast::RelayMode::Payload
+              ? "payload"
+              : "signals")
+      << "\", \"processes\": " << point.processes
+      << ", \"payload\": " << point.payload << ", \"batch\": " << point.batch
+      << ", \"window\": " << point.window
+      << ", \"fanout\": " << +point.fanout << ", \"multicast\": "
+      << (point.multicast.empty() ? "null" : "\"" + point.multicast + "\"")
+      << ", \"coalesce_us\": " << point.coalesce_delay.count()
+      << ", \"messages\": " << point.messages
+      << ", \"complete\": " << (complete ? "true" : "false")
+      << ", \"delivered\": " << delivered << ", \"elapsed_s\": " << elapsed_s
+      << ", \"messages_per_s\": "
+      << (elapsed_s > 0 ? static_cast<double>(delivered) / elapsed_s : 0.0)
+      << ", \"latency_us\": {\"p50\": " << us(latency.quantile(0.5))
+      << ", \"p99\": " << us(latency.quantile(0.99))
+      << ", \"p999\": " << us(latency.quantile(0.999))
+      << ", \"max\": " << us(latency.quantile(1))
+      << "}, \"cpu_us_per_message\": "
+      << per(us(cpu_ns), delivered)
+      << ", \"retransmissions\": " << retransmitted << "}";
+}
+
+static auto split(const std::string& list) -> std::vector<std::string> {
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    items.push_back(item);
+  }
+  return items;
+}
+
+static auto parse_sizes(const std::string& list) -> std::vector<std::size_t> {
+  std::vector<std::size_t> sizes;
+  for (const auto& item : split(list)) {
+    sizes.push_back(std::stoul(item));
+    if (sizes.back() == 0) {
+      throw std::invalid_argument("Sizes have to be positive");
+    }
+  }
+  return sizes;
+}
+
+static auto parse_fractions(const std::string& list) -> std::vector<double> {
+  std::vector<double> fractions;
+  for (const auto& item : split(list)) {
+    fractions.push_back(std::stod(item));
+    if (fractions.back() < 0 || fractions.back() >= 1) {
+      throw std::invalid_argument("Fractions have to be in [0, 1)");
+    }
+  }
+  return fractions;
+}
+
+static constexpr std::string_view USAGE =
+    "usage: da_bench [--layers pl,beb,urb,fifo,la] [--processes LIST]\n"
+    "                [--payload LIST] [--batch LIST] [--window LIST]\n"
+    "                [--messages N] [--mode processes|threads]\n"
+    "                [--relay payload|signals] [--timeout SECONDS]\n"
+    "                [--base-port PORT] [--network sockets|sim]\n"
+    "                [--loss LIST] [--delay US] [--jitter US] [--seed N]\n"
+    "                [--fanout N] [--multicast GROUP] [--coalesce US]\n"
+    "\n"
+    "Runs every combination of the comma separated lists and prints a JSON\n"
+    "array with an object per combination. Every member sends --messages\n"
+    "messages of --payload bytes, handed to the layer --batch at a time. For\n"
+    "la, every member proposes --messages sets of --payload values and\n"
+    "--batch is ignored. --window is the link window of every peer.\n"
+    "\n"
+    "With --network sim all members are threads of one process exchanging\n"
+    "datagrams on a virtual clock, each lost with a probability of --loss and\n"
+    "delayed by --delay plus up to --jitter microseconds, which reorders\n"
+    "them. Durations and latencies are then in virtual time.\n"
+    "\n"
+    "With a non-zero --fanout, broadcasts travel a tree rooted at their\n"
+    "origin in which every member forwards to at most --fanout others.\n"
+    "\n"
+    "With --multicast, all links join the IPv4 multicast GROUP on\n"
+    "--base-port and transmit a message to many peers once, to the group.\n"
+    "\n"
+    "With a non-zero --coalesce, messages without metadata to the same peer,\n"
+    "such as the signals of --relay signals, are held for up to --coalesce\n"
+    "microseconds and sent together in a single datagram.\n";
+
+int main(int argc, char** argv) {
+  std::vector<Layer> layers;
+  for (const auto& [_, layer] : LAYERS) {
+    layers.push_back(layer);
+  }
+  std::vector<std::size_t> processes{3};
+  std::vector<std::size_t> payloads{16};
+  std::vector<std::size_t> batches{1};
+  std::vector<std::size_t> windows{64};
+  std::size_t messages = 10'000;
+  auto mode = Mode::Processes;
+  auto relay_mode = UniformReliableBroadcast::RelayMode::Payload;
+  std::chrono::seconds timeout(30);
+  in_port_t base_port = 11'000;
+  auto network = Network::Sockets;
+  std::vector<double> losses{0};
+  NetworkConditions conditions;
+  std::uint8_t fanout = 0;
+  std::string multicast;
+  std::chrono::microseconds coalesce_delay(0);
+
+  try {
+    for (int i = 1; i < argc; i += 2) {
+      const std::string_view flag = argv[i];
+      if (flag == "--help") {
+        std::cout << USAGE;
+        return 0;
+      }
+      if (i + 1 >= argc) {
+        throw std::invalid_argument("Missing value");
+      }
+      const std::string value = argv[i + 1];
+
+      if (flag == "--layers") {
+        layers.clear();
+        for (const auto& name : split(value)) {
+          const auto layer = std::find_if(
+              LAYERS.begin(), LAYERS.end(),
+              [&](const auto& entry) { return entry.first == name; });
+          if (layer == LAYERS.end()) {
+            throw std::invalid_argument("Unknown layer");
+          }
+          layers.push_back(layer->second);
+        }
+      } else if (flag == "--processes") {
+        processes = parse_sizes(value);
+      } else if (flag == "--payload") {
+        payloads = parse_sizes(value);
+      } else if (flag == "--batch") {
+        batches = parse_sizes(value);
+      } else if (flag == "--window") {
+        windows = parse_sizes(value);
+      } else if (flag == "--messages") {
+        messages = std::stoul(value);
+      } else if (flag == "--mode" &&
+                 (value == "processes" || value == "threads")) {
+        mode = value == "processes" ? Mode::Processes : Mode::Threads;
+      } else if (flag == "--relay" &&
+                 (value == "payload" || value == "signals")) {
+        relay_mode = value == "payload"
+                         ? UniformReliableBroadcast::RelayMode::Payload
+                         : UniformReliableBroadcast::RelayMode::Signals;
+      } else if (flag == "--timeout") {
+        timeout = std::chrono::seconds(std::stoul(value));
+      } else if (flag == "--base-port") {
+        base_port = static_cast<in_port_t>(std::stoul(value));
+      } else if (flag == "--network" &&
+                 (value == "sockets" || value == "sim")) {
+        network = value == "sockets" ? Network::Sockets : Network::Simulated;
+      } else if (flag == "--loss") {
+        losses = parse_fractions(value);
+      } else if (flag == "--delay") {
+        conditions.delay = std::chrono::microseconds(std::stoul(value));
+      } else if (flag == "--jitter") {
+        conditions.jitter = std::chrono::microseconds(std::stoul(value));
+      } else if (flag == "--seed") {
+        conditions.seed = std::stoull(value);
+      } else if (flag == "--fanout") {
+        fanout = static_cast<std::uint8_t>(std::min<unsigned long>(
+            std::stoul(value), std::numeric_limits<std::uint8_t>::max()));
+      } else if (flag == "--multicast") {
+        if (!is_multicast(inet_addr(value.c_str()))) {
+          throw std::invalid_argument("Not a multicast group");
+        }
+        multicast = value;
+      } else if (flag == "--coalesce") {
+        coalesce_delay = std::chrono::microseconds(std::stoul(value));
+      } else {
+        throw std::invalid_argument("Unknown argument");
+      }
+    }
+    for (const auto count : processes) {
+      if (count > PerfectLink::MAX_PROCESSES) {
+        throw std::invalid_argument("Too many processes");
+      }
+    }
+  } catch (const std::logic_error& error) {
+    std::cerr << error.what() << "\n\n" << USAGE;
+    return 1;
+  }
+
+  // a failed child closes its pipes, which must not kill the parent
+  perror_check<sig_t>([]() noexcept { return std::signal(SIGPIPE, SIG_IGN); },
+                      [](auto res) noexcept { return res == SIG_ERR; },
+                      "ignore SIGPIPE", true);
+
+  if (network == Network::Simulated) {
+    // a simulated network lives in the address space of its members
+    mode = Mode::Threads;
+  } else {
+    losses = {0};
+  }
+
+  std::cout << "[\n" << std::flush;
+  bool first = true;
+  for (const auto layer : layers) {
+    for (const auto count : processes) {
+      for (const auto payload : payloads) {
+        for (const auto batch : batches) {
+          for (const auto window : windows) {
+            for (const auto loss : losses) {
+              const auto is_agreement = layer == Layer::LatticeAgreement;
+              auto point_conditions = conditions;
+              point_conditions.loss = loss;
+              Point point{
+                  layer,
+                  mode,
+                  network,
+                  point_conditions,
+                  relay_mode,
+                  count,
+                  // every payload carries its timestamp
+                  is_agreement ? payload : std::max(payload, TIMESTAMP_SIZE),
+                  is_agreement ? 1 : batch,
+                  static_cast<std::uint16_t>(std::min<std::size_t>(
+                      window, std::numeric_limits<std::uint16_t>::max())),
+                  fanout,
+                  multicast,
+                  coalesce_delay,
+                  messages,
+                  timeout,
+                  base_port};
+
+              if (!first) {
+                std::cout << ",\n";
+              }
+              first = false;
+              std::cout << "  ";
+              measure(point, std::cout);
+              std::cout.flush();
+            }
+          }
+        }
+      }
+    }
+  }
+  std::cout << "\n]\n";
+
+  return 0;
+}
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <array>
 #include <optional>
+#include <stdexcept>
 #include <tuple>
 #include <vector>
 #include "perfect_link.hpp"
@@ -11,6 +13,14 @@
 /// 	 is eventually delivered to pj
 /// 2. No duplication - no message is delivered more than once
 /// 3. No creation - no message is delivered unless it was broadcast
+///
+/// With `LinkOptions::broadcast_fanout` set, a broadcast travels a tree rooted
+/// at its origin instead: processes are ordered by their distance from the
+/// origin, and the i-th one forwards every message it receives to the
+/// (fanout * i + 1)-th up to the (fanout * i + fanout)-th. The sending load of
+/// a broadcast is spread over the whole group, but validity only holds as long
+/// as the forwarding processes are correct. The origin travels in front of the
+/// metadata, which keeps the link from coalescing broadcasts.
 class BestEffortBroadcast {
  public:
   struct ProcessAddress {
@@ -22,15 +32,16 @@ class BestEffortBroadcast {
       std::unordered_map<PerfectLink::ProcessIdType, ProcessAddress>;
 
   BestEffortBroadcast(const PerfectLink::ProcessIdType id,
-                      const AvailableProcesses processes);
+                      const AvailableProcesses processes,
+                      const LinkOptions options = {});
 
   /// @brief Binds this broadcast link to a host and port. Once done cannot be
   /// done again.
   auto bind(const in_addr_t host, const in_port_t port) -> void;
 
   /// @brief Starts listening to incoming broadcast messages. Sends ACKs for new
-  /// messages. Receives ACKs and resends messages with missing ACKs. Thread
-  /// safe.
+  /// messages. Receives ACKs and resends messages with missing ACKs. Has to be
+  /// called by a single thread.
   /// @param callback Function that will be called when a message is delivered.
   auto listen(PerfectLink::ListenCallback callback) -> void;
 
@@ -49,6 +60,13 @@ class BestEffortBroadcast {
   auto broadcast(const std::optional<PerfectLink::MessageData> metadata,
                  Data... datas) -> void;
 
+  /// @brief Broadcasts a runtime sized list of payloads to all processes. Packs
+  /// as many leading payloads as fit into a single packet. Thread safe.
+  /// @return Amount of packed payloads, the rest has to be broadcast with
+  /// another call.
+  auto broadcast(const Slice<std::uint8_t> metadata,
+                 const PerfectLink::Payloads datas) -> std::size_t;
+
   /// @brief Sending a message to a single host.
   template <typename... Data,
             class = std::enable_if_t<
@@ -60,24 +78,87 @@ class BestEffortBroadcast {
             const std::optional<PerfectLink::MessageData> metadata,
             Data... datas) -> void;
 
+  /// @brief Sends a runtime sized list of payloads to a single host. Packs as
+  /// many leading payloads as fit into a single packet. Thread safe.
+  /// @return Amount of packed payloads, the rest has to be sent with another
+  /// call.
+  auto send(const in_addr_t host,
+            const in_port_t port,
+            const Slice<std::uint8_t> metadata,
+            const PerfectLink::Payloads datas) -> std::size_t;
+
   /// @brief A list of processes this broadcast link knowns.
   auto processes() const -> const AvailableProcesses&;
 
   /// @brief Id of this process.
   inline auto id() const -> PerfectLink::ProcessIdType { return _link.id(); }
 
+  /// @brief See `PerfectLink::is_member`.
+  inline auto is_member(const PerfectLink::ProcessIdType process_id) const
+      -> bool {
+    return _link.is_member(process_id);
+  }
+
  private:
+  /// @brief Size of the origin in front of the metadata of messages in tree
+  /// mode. An origin of zero marks a message to a single process, which is not
+  /// forwarded. Messages without metadata carry no origin and are never
+  /// forwarded either, so that signals sent to a single process can still be
+  /// coalesced.
+  static constexpr std::size_t ORIGIN_SIZE =
+      sizeof(PerfectLink::ProcessIdType);
+
+  /// @brief Children of this process in the tree of every origin, indexed by
+  /// `origin - 1`. The tree of this process also lists this process itself.
+  static auto _make_children(const PerfectLink::ProcessIdType id,
+                             const AvailableProcesses& processes,
+                             const std::size_t fanout)
+      -> std::vector<std::vector<sockaddr_in>>;
+
+  /// @brief Encodes an origin in front of metadata.
+  static auto _with_origin(const PerfectLink::ProcessIdType origin,
+                           const Slice<std::uint8_t> metadata)
+      -> std::vector<std::uint8_t>;
+
+  /// @brief Delivers a message received by the link in tree mode, forwarding
+  /// it to the children of this process in the tree of its origin first.
+  auto _receive(const PerfectLink::ProcessIdType process_id,
+                OwnedSlice<std::uint8_t>& metadata,
+                std::vector<Slice<std::uint8_t>>& datas,
+                PerfectLink::ListenBatchCallback& callback) -> void;
+
+  inline auto _is_tree() const -> bool { return !_children.empty(); }
+
   PerfectLink _link;
   const AvailableProcesses _processes;
+  /// @brief Socket addresses of `_processes`, used to fan out a broadcast in a
+  /// single batch.
+  const std::vector<sockaddr_in> _addresses;
+  /// @brief Empty unless broadcasts travel trees.
+  const std::vector<std::vector<sockaddr_in>> _children;
 };
 
 template <typename... Data, class, class>
 auto BestEffortBroadcast::broadcast(
     const std::optional<PerfectLink::MessageData> metadata,
     Data... datas) -> void {
-  for (const auto& [_, address] : _processes) {
-    _link.send(address.host, address.port, metadata, datas...);
+  if (!_is_tree()) {
+    _link.send_batch(_addresses, metadata, datas...);
+    return;
+  }
+
+  const std::array<Slice<std::uint8_t>, sizeof...(Data)> payloads = {
+      Slice<std::uint8_t>(std::get<0>(datas), std::get<1>(datas))...};
+  const PerfectLink::Payloads all(payloads.data(), payloads.size());
+  const auto [metadata_data, metadata_size] =
+      metadata.value_or(std::make_tuple(nullptr, 0));
+
+  // a compile time known message is broadcast whole or not at all
+  if (PerfectLink::packable(ORIGIN_SIZE + metadata_size, all) <
+      payloads.size()) {
+    throw std::runtime_error("Message is too large");
   }
+  broadcast(Slice<std::uint8_t>(metadata_data, metadata_size), all);
 }
 
 template <typename... Data, class, class>
@@ -86,5 +167,14 @@ auto BestEffortBroadcast::send(
     const in_port_t port,
     const std::optional<PerfectLink::MessageData> metadata,
     Data... datas) -> void {
-  _link.send(host, port, metadata, datas...);
+  if (!_is_tree() || !metadata.has_value()) {
+    _link.send(host, port, metadata, datas...);
+    return;
+  }
+
+  const auto [metadata_data, metadata_size] = metadata.value();
+  auto prefixed =
+      _with_origin(0, Slice<std::uint8_t>(metadata_data, metadata_size));
+  _link.send(host, port, std::make_tuple(prefixed.data(), prefixed.size()),
+             datas...);
 }
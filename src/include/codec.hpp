@@ -0,0 +1,218 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+/// @brief Encoding of integers on the wire. Every layer writes little-endian
+/// fixed-width integers through here, at unaligned positions of a datagram.
+namespace codec {
+
+/// @brief Whether the host stores integers in wire order, then loads and
+/// stores are plain copies.
+inline constexpr bool IS_LITTLE_ENDIAN =
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+
+/// @brief Reverses the bytes of an unsigned integer.
+template <typename T>
+inline auto byte_swap(const T value) -> T {
+  static_assert(std::is_unsigned_v<T>, "Only unsigned integers are encoded");
+  if constexpr (sizeof(T) == 1) {
+    return value;
+  } else if constexpr (sizeof(T) == 2) {
+    return __builtin_bswap16(value);
+  } else if constexpr (sizeof(T) == 4) {
+    return __builtin_bswap32(value);
+  } else {
+    static_assert(sizeof(T) == 8, "Unsupported integer size");
+    return __builtin_bswap64(value);
+  }
+}
+
+/// @brief Stores the lowest `Size` bytes of `value` into `data`, least
+/// significant byte first. `data` does not need to be aligned.
+template <typename T, std::size_t Size = sizeof(T)>
+inline auto store_le(std::uint8_t* data, T value) -> void {
+  static_assert(Size <= sizeof(T));
+  if constexpr (!IS_LITTLE_ENDIAN) {
+    value = byte_swap(value);
+  }
+  std::memcpy(data, &value, Size);
+}
+
+/// @brief Loads an integer stored by `store_le`, the bytes above `Size` are
+/// zero.
+template <typename T, std::size_t Size = sizeof(T)>
+inline auto load_le(const std::uint8_t* data) -> T {
+  static_assert(std::is_unsigned_v<T> && Size <= sizeof(T));
+  T value = 0;
+  std::memcpy(&value, data, Size);
+  if constexpr (!IS_LITTLE_ENDIAN) {
+    value = byte_swap(value);
+  }
+  return value;
+}
+
+/// @brief A packet layout of consecutive fixed-width integers, without
+/// padding. Offsets and the total size are known at compile time, so storing
+/// or loading all fields compiles to a few unaligned moves.
+/// @tparam Fields Unsigned integer types of the fields, in wire order.
+template <typename... Fields>
+class Layout {
+ public:
+  using Values = std::tuple<Fields...>;
+
+  static constexpr std::size_t SIZE = (std::size_t(0) + ... + sizeof(Fields));
+
+  /// @brief Offset of the field at `index` from the start of the layout.
+  static constexpr std::array<std::size_t, sizeof...(Fields)> OFFSETS = [] {
+    const std::array<std::size_t, sizeof...(Fields)> sizes{sizeof(Fields)...};
+    std::array<std::size_t, sizeof...(Fields)> offsets{};
+    std::size_t offset = 0;
+    for (std::size_t i = 0; i < sizes.size(); i++) {
+      offsets[i] = offset;
+      offset += sizes[i];
+    }
+    return offsets;
+  }();
+
+  /// @brief Stores all fields into `data`, which has to hold `SIZE` bytes.
+  static inline auto store(std::uint8_t* data, const Fields... values)
+      -> void {
+    _store(data, std::index_sequence_for<Fields...>{}, values...);
+  }
+
+  /// @brief Loads all fields from `data`, which has to hold `SIZE` bytes.
+  static inline auto load(const std::uint8_t* data) -> Values {
+    return _load(data, std::index_sequence_for<Fields...>{});
+  }
+
+ private:
+  template <std::size_t... Indices>
+  static inline auto _store(std::uint8_t* data,
+                            std::index_sequence<Indices...>,
+                            const Fields... values) -> void {
+    (store_le<Fields>(data + OFFSETS[Indices], values), ...);
+  }
+
+  template <std::size_t... Indices>
+  static inline auto _load(const std::uint8_t* data,
+                           std::index_sequence<Indices...>) -> Values {
+    return Values(load_le<Fields>(data + OFFSETS[Indices])...);
+  }
+};
+
+/// @brief Most bytes a LEB128 varint of a 32 bit value takes.
+inline constexpr std::size_t MAX_VARINT_SIZE = 5;
+
+/// @brief Continuation bit of every byte of a word of LEB128 bytes.
+inline constexpr std::uint64_t CONTINUATION_BITS = 0x8080808080808080;
+
+/// @brief Encodes sorted unique values as the LEB128 varints of the gaps
+/// between them, the first gap is taken from zero. Runs of eight gaps that
+/// each fit into a byte, the usual case for dense sets, are stored as a
+/// single word.
+/// @return Amount of written bytes.
+/// @throws std::runtime_error If the varints do not fit into `capacity`.
+inline auto encode_gaps(const std::uint32_t* values,
+                        const std::size_t count,
+                        std::uint8_t* data,
+                        const std::size_t capacity) -> std::size_t {
+  std::size_t size = 0;
+  std::uint32_t previous = 0;
+  std::size_t index = 0;
+  while (index < count) {
+    if (index + 8 <= count && size + 8 <= capacity) {
+      std::uint64_t word = 0;
+      std::uint32_t gaps = 0;
+      auto last = previous;
+      for (std::size_t i = 0; i < 8; i++) {
+        const auto gap = values[index + i] - last;
+        gaps |= gap;
+        word |= static_cast<std::uint64_t>(gap) << (8 * i);
+        last = values[index + i];
+      }
+      if (gaps < 0x80) {
+        store_le(data + size, word);
+        size += 8;
+        index += 8;
+        previous = last;
+        continue;
+      }
+    }
+
+    // values are unique, so every gap but the first one is positive
+    auto gap = values[index] - previous;
+    previous = values[index];
+    index += 1;
+
+    // make sure we can fit the message
+    std::size_t length = 1;
+    for (auto rest = gap >> 7; rest > 0; rest >>= 7) {
+      length += 1;
+    }
+    if (size + length > capacity) {
+      throw std::runtime_error("Too many values to encode");
+    }
+
+    while (gap >= 0x80) {
+      data[size++] = static_cast<std::uint8_t>((gap & 0x7f) | 0x80);
+      gap >>= 7;
+    }
+    data[size++] = static_cast<std::uint8_t>(gap);
+  }
+  return size;
+}
+
+/// @brief Decodes values encoded by `encode_gaps` into `values`, which has to
+/// hold `size` values: every value takes at least a byte. Words of eight
+/// single byte gaps are decoded at once. The input comes off the network, a
+/// truncated varint or one that does not fit into 32 bits fails the decoding.
+/// @return Amount of decoded values, none if the encoding is malformed.
+inline auto decode_gaps(const std::uint8_t* data,
+                        const std::size_t size,
+                        std::uint32_t* values) -> std::optional<std::size_t> {
+  std::size_t count = 0;
+  std::size_t offset = 0;
+  std::uint32_t previous = 0;
+  while (offset < size) {
+    if (offset + 8 <= size) {
+      const auto word = load_le<std::uint64_t>(data + offset);
+      if ((word & CONTINUATION_BITS) == 0) {
+        for (std::size_t i = 0; i < 8; i++) {
+          previous += static_cast<std::uint32_t>((word >> (8 * i)) & 0xff);
+          values[count++] = previous;
+        }
+        offset += 8;
+        continue;
+      }
+    }
+
+    std::uint32_t gap = 0;
+    for (std::size_t shift = 0;; shift += 7) {
+      if (offset == size) {
+        return std::nullopt;
+      }
+      const auto byte = data[offset++];
+      // the last byte has room for 4 bits
+      if (shift == 7 * (MAX_VARINT_SIZE - 1) && byte > 0x0f) {
+        return std::nullopt;
+      }
+      gap |= static_cast<std::uint32_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        break;
+      }
+    }
+    previous += gap;
+    values[count++] = previous;
+  }
+  return count;
+}
+
+}  // namespace codec
@@ -2,14 +2,13 @@
 
 #include <cassert>
 #include <cerrno>
-#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <functional>
-#include <iostream>
-#include <mutex>
 #include <stdexcept>
 #include <string_view>
+#include <tuple>
 #include <type_traits>
-#include <unordered_map>
 #include <vector>
 
 /// @brief A helper for calling syscalls. Syscalls can be interrupted, and such
@@ -49,43 +48,6 @@ inline auto perror_check(const std::function<auto()->T> syscall,
 template <typename T, typename... U>
 using are_equal = std::conjunction<std::is_same<T, U>...>;
 
-class Perf {
- public:
-  Perf() {}
-
-  template <class clock_t = std::chrono::steady_clock,
-            class duration_t = std::chrono::nanoseconds>
-  inline auto mark() -> std::chrono::time_point<clock_t, duration_t> {
-    return clock_t::now();
-  }
-
-  template <class result_t = std::chrono::milliseconds,
-            class clock_t = std::chrono::steady_clock,
-            class duration_t = std::chrono::nanoseconds>
-  inline auto since(std::string name,
-                    std::chrono::time_point<clock_t, duration_t> const& start)
-      -> void {
-    auto end = clock_t::now();
-    auto res = std::chrono::duration_cast<result_t>(end - start).count();
-
-    std::lock_guard<std::mutex> guard(_lock);
-
-    if (_cums.find(name) == _cums.end()) {
-      _cums.insert({name, {0.0, 0.0}});
-    }
-    const auto [total, amount] = _cums[name];
-    const auto new_total = total + static_cast<double>(res);
-    const auto new_amount = amount + 1.0;
-    _cums[name] = {new_total, new_amount};
-
-    std::cout << name << "(avg): " << new_total / new_amount << std::endl;
-  }
-
- private:
-  std::mutex _lock;
-  std::unordered_map<std::string, std::tuple<double, double>> _cums;
-};
-
 /// @brief Convenience type storing a pointer and size.
 /// @tparam T
 template <typename T>
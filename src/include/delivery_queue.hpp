@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "mpsc_queue.hpp"
+
+/// @brief Decouples delivery callbacks from the threads producing the
+/// deliveries. Producers hand events over through a lock-free `MpscQueue`, a
+/// consumer thread owned by this queue drains it in batches and runs the
+/// callback for every event, in the order they were pushed. The consumer sleeps
+/// when there is nothing to do, producers take a lock only to wake it up.
+/// @tparam T Default constructible and move assignable type of the events.
+template <typename T>
+class DeliveryQueue {
+ public:
+  using Callback = std::function<auto(T& event)->void>;
+
+  /// @brief Counters telling how well the consumer keeps up.
+  struct Stats {
+    /// @brief Amount of pushed events.
+    std::uint64_t pushed;
+    /// @brief Amount of events the callback was called with.
+    std::uint64_t delivered;
+    /// @brief How many times a producer found the queue full and had to wait
+    /// for the consumer.
+    std::uint64_t full_stalls;
+    /// @brief Amount of drained batches.
+    std::uint64_t batches;
+  };
+
+  /// @brief Starts the consumer thread.
+  /// @param capacity Amount of events that can wait for the consumer before
+  /// producers are stalled.
+  DeliveryQueue(const std::size_t capacity, Callback callback)
+      : _queue(capacity),
+        _callback(std::move(callback)),
+        _consumer([this] { _consume(); }) {}
+
+  /// @brief Delivers all pushed events and stops the consumer thread. No
+  /// producer is allowed to push anymore.
+  ~DeliveryQueue() {
+    _done = true;
+    _wake();
+    _consumer.join();
+  }
+
+  DeliveryQueue(const DeliveryQueue&) = delete;
+  DeliveryQueue& operator=(const DeliveryQueue&) = delete;
+
+  /// @brief Hands an event over to the consumer. If the queue is full, waits
+  /// until the consumer makes room. Thread safe.
+  auto push(T&& event) -> void {
+    while (!_queue.try_push(std::move(event))) {
+      _full_stalls.fetch_add(1, std::memory_order_relaxed);
+      _wake();
+      std::this_thread::yield();
+    }
+    _pushed.fetch_add(1, std::memory_order_relaxed);
+
+    // pairs with the fence of the consumer announcing it is about to sleep
+    // and checking the queue afterwards: either it sees the event or we see it
+    // waiting. The queue publishes with release and reads with acquire, which
+    // alone does not order its store before our later load
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_consumer_waiting.load(std::memory_order_relaxed)) {
+      _wake();
+    }
+  }
+
+  /// @brief A snapshot of the counters. Thread safe.
+  auto stats() const -> Stats {
+    return {_pushed.load(std::memory_order_relaxed),
+            _delivered.load(std::memory_order_relaxed),
+            _full_stalls.load(std::memory_order_relaxed),
+            _batches.load(std::memory_order_relaxed)};
+  }
+
+ private:
+  /// @brief Upper bound of a sleep of the consumer, a backstop: wake ups are
+  /// not lost.
+  static constexpr std::chrono::milliseconds MAX_SLEEP{1};
+
+  auto _consume() -> void {
+    T event;
+    while (true) {
+      std::uint64_t batch = 0;
+      while (_queue.try_pop(event)) {
+        _callback(event);
+        batch += 1;
+      }
+      if (batch > 0) {
+        _delivered.fetch_add(batch, std::memory_order_relaxed);
+        _batches.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+
+      if (_done) {
+        return;
+      }
+
+      std::unique_lock<std::mutex> lock(_mutex);
+      _consumer_waiting.store(true, std::memory_order_relaxed);
+      // see `push`
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (_queue.empty() && !_done) {
+        _cv.wait_for(lock, MAX_SLEEP);
+      }
+      _consumer_waiting.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  auto _wake() -> void {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _cv.notify_one();
+  }
+
+  MpscQueue<T> _queue;
+  Callback _callback;
+
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::atomic_bool _consumer_waiting = false;
+  std::atomic_bool _done = false;
+
+  std::atomic_uint64_t _pushed = 0;
+  std::atomic_uint64_t _delivered = 0;
+  std::atomic_uint64_t _full_stalls = 0;
+  std::atomic_uint64_t _batches = 0;
+
+  /// @brief Started last, once everything it uses is initialized.
+  std::thread _consumer;
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include "transport.hpp"
+
+/// @brief A reactor on `epoll`. Endpoints are watched through their file
+/// descriptors, every timer is a `timerfd` on `CLOCK_MONOTONIC`, which is the
+/// clock of `std::chrono::steady_clock`, and an `eventfd` wakes the loop to
+/// stop it. Readiness is level triggered, so a handler may leave datagrams to
+/// receive for later and other handlers get their turn first.
+class EpollReactor : public Reactor {
+ public:
+  EpollReactor();
+
+  /// @brief Closes all file descriptors of the reactor, but not those of the
+  /// watched endpoints.
+  ~EpollReactor() override;
+
+  EpollReactor(const EpollReactor&) = delete;
+  EpollReactor& operator=(const EpollReactor&) = delete;
+
+  /// @brief The endpoint has to have a file descriptor.
+  auto watch(Endpoint& endpoint, Handler on_readable) -> void override;
+
+  auto add_timer(Handler on_expiry) -> Timer override;
+
+  auto arm(const Timer timer, const Clock::time_point deadline)
+      -> void override;
+
+  auto run() -> void override;
+
+  auto stop() -> void override;
+
+ private:
+  /// @brief Maximum amount of events taken with a single `epoll_wait`.
+  static constexpr std::size_t MAX_EVENTS = 32;
+
+  /// @brief A watched file descriptor. Its index is the data of its event.
+  struct Source {
+    int fd;
+    /// @brief Whether the descriptor is a `timerfd` owned by the reactor.
+    bool is_timer;
+    Handler handler;
+  };
+
+  /// @brief Adds a file descriptor to the epoll set.
+  auto _add(const int fd, const bool is_timer, Handler handler) -> std::size_t;
+
+  const int _epoll_fd;
+  /// @brief Becomes readable once the reactor is stopped.
+  const int _stop_fd;
+  std::vector<Source> _sources;
+  std::atomic_bool _stopped = false;
+};
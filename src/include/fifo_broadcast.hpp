@@ -1,19 +1,30 @@
-#include <queue>
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <vector>
 #include "best_effort_broadcast.hpp"
 #include "perfect_link.hpp"
 #include "uniform_reliable_broadcast.hpp"
 
-/// Filters delivers to make sure they are FIFO. Specialized for the data we use
-/// to save needless allocations.
+/// Filters delivers to make sure they are FIFO. Payloads are opaque bytes, out
+/// of order ones are copied into a reorder buffer whose slots keep their
+/// allocations, so in a steady state delivering does not allocate.
 struct FifoBroadcast {
   FifoBroadcast(const PerfectLink::ProcessIdType id,
-                const BestEffortBroadcast::AvailableProcesses processes)
-      : _link(id, processes) {}
-
-  using SendType = std::uint32_t;
+                const BestEffortBroadcast::AvailableProcesses processes,
+                const LinkOptions options = {},
+                const UniformReliableBroadcast::RelayMode relay_mode =
+                    UniformReliableBroadcast::RelayMode::Payload)
+      : _link(id, processes, options, relay_mode),
+        _buffered(processes.size()) {}
 
-  using ListenCallback = std::function<
-      auto(PerfectLink::ProcessIdType process_id, SendType msg)->void>;
+  using ListenCallback =
+      std::function<auto(PerfectLink::ProcessIdType process_id,
+                         OwnedSlice<std::uint8_t>& data)
+                        ->void>;
 
   auto bind(const in_addr_t host, const in_port_t port) -> void {
     _link.bind(host, port);
@@ -28,54 +39,105 @@ struct FifoBroadcast {
     _link.broadcast(datas...);
   }
 
-  /// @brief NOT thread safe.
+  auto broadcast(const PerfectLink::Payloads datas) -> void {
+    _link.broadcast(datas);
+  }
+
+  /// @brief Has to be called by a single thread. With more than one receive
+  /// shard the callback is called from all of their threads: messages of a
+  /// single sender are delivered one at a time and in order, messages of
+  /// different senders concurrently.
   auto listen(ListenCallback callback) -> void {
     _link.listen([&](auto process_id, auto seq_nr, auto& data) {
-      SendType msg = 0;
-      for (size_t i = 0; i < sizeof(SendType); i++) {
-        msg |= static_cast<SendType>(data[i]) << (i * 8);
-      }
-
       auto& buffer = _buffered[process_id - 1];
+      std::lock_guard<std::mutex> lock(buffer.mutex);
+
+      if (buffer.next_seq_nr != seq_nr) {
+        buffer.store(seq_nr, data);
+        return;
+      }
 
-      if (buffer.next_seq_nr == seq_nr) {
-        callback(process_id, msg);
-        buffer.next_seq_nr += 1;
-        // deliver all next messages
-        for (; !buffer.buffer.empty(); buffer.buffer.pop()) {
-          auto [top_seq_nr, top_msg] = buffer.buffer.top();
-          if (top_seq_nr != buffer.next_seq_nr) {
-            break;
-          }
-          callback(process_id, top_msg);
-          buffer.next_seq_nr += 1;
-        }
-      } else {
-        buffer.buffer.emplace(seq_nr, msg);
+      callback(process_id, data);
+      buffer.advance();
+      // deliver the run of buffered messages that follows
+      while (buffer.is_next_stored()) {
+        auto& slot = buffer.slots[buffer.head];
+        OwnedSlice<std::uint8_t> stored(slot.data(), slot.size());
+        callback(process_id, stored);
+        buffer.occupied[buffer.head] = false;
+        buffer.advance();
       }
     });
   }
 
  private:
+  /// @brief Messages of a sender that arrived before their predecessors. Their
+  /// seq_nrs are dense, so a message is stored in a ring at its distance from
+  /// the next expected seq_nr. The ring grows when a message does not fit.
   struct BufferedMessages {
-    struct BufferedMessage {
-      BufferedMessage(const PerfectLink::MessageIdType seq_nr,
-                      const SendType msg)
-          : seq_nr(seq_nr), msg(msg) {}
-      PerfectLink::MessageIdType seq_nr;
-      SendType msg;
-
-      friend auto operator<(BufferedMessage const& left,
-                            BufferedMessage const& right) -> bool {
-        return left.seq_nr > right.seq_nr;
-      }
-    };
+    /// @brief Capacity of the ring once the first message is stored.
+    static constexpr std::size_t INITIAL_CAPACITY = 64;
 
-    // min heap
-    std::priority_queue<BufferedMessage> buffer;
+    std::mutex mutex;
     PerfectLink::MessageIdType next_seq_nr =
         UniformReliableBroadcast::INITIAL_SEQ_NR;
+    /// @brief Ring of payloads, its size is zero or a power of two.
+    std::vector<std::vector<std::uint8_t>> slots;
+    /// @brief Which slots hold a message.
+    std::vector<bool> occupied;
+    /// @brief Slot of `next_seq_nr`.
+    std::size_t head = 0;
+
+    inline auto is_next_stored() const -> bool {
+      return !occupied.empty() && occupied[head];
+    }
+
+    /// @brief Moves on to the next seq_nr once `next_seq_nr` was delivered.
+    inline auto advance() -> void {
+      next_seq_nr += 1;
+      if (!slots.empty()) {
+        head = (head + 1) & (slots.size() - 1);
+      }
+    }
+
+    /// @brief Copies a message that arrived before `next_seq_nr`.
+    auto store(const PerfectLink::MessageIdType seq_nr,
+               const Slice<std::uint8_t> data) -> void {
+      const auto distance = static_cast<std::size_t>(seq_nr - next_seq_nr);
+      if (distance >= slots.size()) {
+        grow(distance + 1);
+      }
+      const auto index = (head + distance) & (slots.size() - 1);
+      auto& slot = slots[index];
+      slot.resize(data.size());
+      if (data.size() > 0) {
+        std::memcpy(slot.data(), &data[0], data.size());
+      }
+      occupied[index] = true;
+    }
+
+    /// @brief Resizes the ring to hold at least `capacity` messages, moving the
+    /// head to the first slot.
+    auto grow(const std::size_t capacity) -> void {
+      auto size = std::max(slots.size(), INITIAL_CAPACITY);
+      while (size < capacity) {
+        size *= 2;
+      }
+
+      std::vector<std::vector<std::uint8_t>> grown_slots(size);
+      std::vector<bool> grown_occupied(size, false);
+      for (std::size_t i = 0; i < slots.size(); i++) {
+        const auto index = (head + i) & (slots.size() - 1);
+        grown_slots[i] = std::move(slots[index]);
+        grown_occupied[i] = occupied[index];
+      }
+      slots = std::move(grown_slots);
+      occupied = std::move(grown_occupied);
+      head = 0;
+    }
   };
+
   UniformReliableBroadcast _link;
-  std::array<BufferedMessages, PerfectLink::MAX_PROCESSES> _buffered;
+  /// @brief Indexed by `process_id - 1`.
+  std::vector<BufferedMessages> _buffered;
 };
@@ -1,13 +1,19 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <limits>
 #include <mutex>
-#include <unordered_map>
-#include <unordered_set>
+#include <optional>
 #include <vector>
 #include "best_effort_broadcast.hpp"
+#include "codec.hpp"
+#include "delivery_queue.hpp"
 #include "perfect_link.hpp"
 #include "semaphore.hpp"
+#include "value_set.hpp"
 
 /// Enforces 3 properties for agreement:
 /// 1. Validity - let a process Pi decide the set Oi. Then:
@@ -18,14 +24,27 @@
 class LatticeAgreement {
  public:
   using AgreementType = std::uint32_t;
+  static_assert(std::is_same_v<AgreementType, std::uint32_t>,
+                "Values are encoded as gaps of 32 bit integers");
+  using DecidedSet = ValueSet<AgreementType>;
 
-  using ListenCallback =
-      std::function<auto(const std::unordered_set<AgreementType>& data)->void>;
+  using ListenCallback = std::function<auto(const DecidedSet& data)->void>;
 
+  /// With `LinkOptions::state` set, the agreements this process accepted in
+  /// and its proposal rounds are kept in the state file as well. A restarted
+  /// process does not answer proposals of agreements it might have answered
+  /// before, the other processes decide them. The callback owner stores the
+  /// decided sets, see `resume` and `persisted`.
+  /// @param delivery_queue_capacity If non-zero, decided sets are handed over
+  /// to a delivery thread through a lock-free queue of this capacity instead
+  /// of calling the callback from the network thread. Sets are still delivered
+  /// in the order they were decided.
   LatticeAgreement(const PerfectLink::ProcessIdType id,
                    const BestEffortBroadcast::AvailableProcesses processes,
                    const std::size_t max_unique_values,
-                   ListenCallback callback);
+                   ListenCallback callback,
+                   const LinkOptions options = {},
+                   const std::size_t delivery_queue_capacity = 0);
 
   /// @brief Binds this agreement link to a host and port. Once done cannot be
   /// done again.
@@ -35,28 +54,142 @@ class LatticeAgreement {
   /// messages. Receives ACKs and resends messages with missing ACKs.
   auto listen() -> void;
 
-  /// @brief Starts a new agreement with the proposed values. Assumes given
-  /// values are unique.
-  auto propose(const std::vector<AgreementType>& values) -> void;
+  /// @brief Starts a new agreement with the proposed values. Up to
+  /// `MAX_IN_FLIGHT` agreements run concurrently, blocks until a slot is
+  /// free. Decided sets are delivered in the order of proposals.
+  auto propose(const Slice<AgreementType> values) -> void;
+
+  /// @brief Same as `propose` but with values in a vector.
+  inline auto propose(const std::vector<AgreementType>& values) -> void {
+    propose(Slice<AgreementType>(values.data(), values.size()));
+  }
 
   /// @brief Id of this process.
   inline auto id() const -> PerfectLink::ProcessIdType { return _link.id(); }
 
+  /// @brief Continues a previous run of this process whose callback stored
+  /// the first `delivered` decided sets. The next `propose` starts the
+  /// agreement `delivered`. Has to be called before `bind`.
+  auto resume(const PerfectLink::MessageIdType delivered) -> void;
+
+  /// @brief Tells that the callback owner stored the first `delivered`
+  /// decided sets for good. With a state file only those are announced as
+  /// decided to the other processes, which keep what a restarted process
+  /// needs to decide the rest again. Lock free, so it can be called from a
+  /// signal handler.
+  inline auto persisted(const PerfectLink::MessageIdType delivered) -> void {
+    _persisted.store(delivered, std::memory_order_relaxed);
+  }
+
+  /// @brief Counters of the delivery queue. None if decided sets are delivered
+  /// without one.
+  auto delivery_stats() const
+      -> std::optional<DeliveryQueue<DecidedSet>::Stats>;
+
+  /// @brief Amount of agreements whose acceptor state is kept. Stays bounded
+  /// as long as all processes keep deciding. Thread safe.
+  auto live_agreements() -> std::size_t;
+
  private:
   /// @brief Type used to encode individual proposal rounds in a single
   /// agreement.
   using ProposalNumberType = std::uint32_t;
 
+  enum class MessageKind : std::uint8_t {
+    Proposal = 0,
+    Ack = 1,
+    Nack = 2,
+    /// @brief The sender decided all agreements below the agreement number.
+    Watermark = 3,
+    /// @brief A set decided in the agreement, proposers whose proposal it
+    /// includes can decide it too.
+    Decision = 4,
+    /// @brief Response to a proposal included in a set decided in the
+    /// agreement, which it carries. If the proposal grew meanwhile, it counts
+    /// as a NACK with the decided values.
+    DecisionResponse = 5,
+  };
+
+  /// @brief Layout preceding the values of every message: its kind, the
+  /// agreement number and the proposal number.
+  using MessageHeader = codec::Layout<std::uint8_t,
+                                      PerfectLink::MessageIdType,
+                                      ProposalNumberType>;
+
+  /// @brief Proposer state of an agreement started by this process.
   struct Agreement {
+    /// @brief Whether this slot holds an agreement that was not yet delivered.
+    bool in_flight = false;
+    PerfectLink::MessageIdType agreement_nr = 0;
+
     PerfectLink::ProcessIdType ack_count = 0;
     PerfectLink::ProcessIdType nack_count = 0;
-    std::unordered_set<AgreementType> proposed_value;
-    std::unordered_set<AgreementType> accepted_value;
+    ValueSet<AgreementType> proposed_value;
 
     ProposalNumberType proposal_nr = 0;
+    /// @brief Proposal number of the first round. Above the rounds of a
+    /// previous run after a restart.
+    ProposalNumberType first_proposal_nr = 0;
     bool has_decided = false;
   };
 
+  /// @brief Amount of in-flight agreements of this process.
+  static constexpr std::size_t MAX_IN_FLIGHT = 32;
+
+  /// @brief Acceptor state of an agreement.
+  struct Acceptor {
+    /// @brief All values this process accepted.
+    ValueSet<AgreementType> accepted;
+    /// @brief A set decided in the agreement, by this process or another one.
+    /// Proposals it includes are answered with it right away.
+    std::optional<ValueSet<AgreementType>> decided;
+  };
+
+  /// @brief Identifies the proposal round an agreement waits for responses
+  /// of.
+  using RoundKey = std::uint64_t;
+  /// @brief Round key of a slot without an undecided agreement.
+  static constexpr RoundKey NO_ROUND = std::numeric_limits<RoundKey>::max();
+
+  static inline auto _round_key(const PerfectLink::MessageIdType agreement_nr,
+                                const ProposalNumberType proposal_nr)
+      -> RoundKey {
+    return (static_cast<RoundKey>(agreement_nr) << 32) | proposal_nr;
+  }
+
+  /// @brief Record of the state file, written before what it describes is
+  /// visible to other processes.
+  struct AgreementState {
+    /// @brief Agreements below might have acceptor state, a restarted process
+    /// does not answer their proposals: it could contradict itself.
+    std::atomic<PerfectLink::MessageIdType> acceptors_end = 0;
+    /// @brief Highest proposal number this process used. A restarted process
+    /// starts all agreements above it, so that responses to the rounds of a
+    /// previous run are stale.
+    std::atomic<ProposalNumberType> max_proposal_nr = 0;
+  };
+
+  /// @brief Encodes values of a proposal or NACK. The set is sorted, so the
+  /// first value and then the gaps between consecutive values are written as
+  /// LEB128 varints, which for dense sets takes a byte per value. See
+  /// `codec::encode_gaps`.
+  /// @return Amount of bytes written to `data`. Throws if they do not fit into
+  /// `capacity` bytes.
+  static auto _encode_values(const ValueSet<AgreementType>& values,
+                             std::uint8_t* data,
+                             const std::size_t capacity) -> std::size_t;
+
+  /// @brief A buffer of the calling thread that holds a message of `count`
+  /// encoded values, or as much of it as a message can carry. Reused by the
+  /// next call on the thread.
+  static auto _message_buffer(const std::size_t count)
+      -> std::vector<std::uint8_t>&;
+
+  /// @brief Reads values encoded in a proposal or NACK. None if the encoding
+  /// is malformed, the message is then dropped.
+  static auto _decode_values(const OwnedSlice<std::uint8_t>& message)
+      -> std::optional<ValueSet<AgreementType>>;
+
   /// @brief Handles incoming proposals.
   auto _handle_proposal(const PerfectLink::ProcessIdType process_id,
                         const PerfectLink::MessageIdType agreement_nr,
@@ -72,24 +205,87 @@ class LatticeAgreement {
                     const ProposalNumberType proposal_nr,
                     const OwnedSlice<std::uint8_t>& data) -> void;
 
+  /// @brief The in-flight agreement with the given number. Null if it was
+  /// already delivered, then responses to it are stale.
+  auto _in_flight(const PerfectLink::MessageIdType agreement_nr) -> Agreement*;
+
+  /// @brief Whether responses to a proposal round are awaited, without taking
+  /// the lock. False for decided agreements and for rounds that were
+  /// superseded. Responses it lets through are checked again under the lock.
+  inline auto _is_awaited(const PerfectLink::MessageIdType agreement_nr,
+                          const ProposalNumberType proposal_nr) const -> bool {
+    return _rounds[agreement_nr % MAX_IN_FLIGHT].load(
+               std::memory_order_acquire) ==
+           _round_key(agreement_nr, proposal_nr);
+  }
+
+  /// @brief Publishes the round of an agreement, or `NO_ROUND` once it was
+  /// decided. Has to be called with `_agreements_mutex` held.
+  inline auto _publish_round(const Agreement& agreement) -> void {
+    if (_state != nullptr && agreement.proposal_nr >
+                                 _state->max_proposal_nr.load(
+                                     std::memory_order_relaxed)) {
+      _state->max_proposal_nr.store(agreement.proposal_nr,
+                                    std::memory_order_relaxed);
+    }
+    _rounds[agreement.agreement_nr % MAX_IN_FLIGHT].store(
+        agreement.has_decided
+            ? NO_ROUND
+            : _round_key(agreement.agreement_nr, agreement.proposal_nr),
+        std::memory_order_release);
+  }
+
+  /// @brief Handles incoming decisions of other processes: remembers them to
+  /// answer proposals with, and adopts them if they include our proposal.
+  /// @param response_to The proposal round the decision responds to, if any.
+  auto _handle_decision(const PerfectLink::MessageIdType agreement_nr,
+                        const std::optional<ProposalNumberType> response_to,
+                        const OwnedSlice<std::uint8_t>& data) -> void;
+
+  /// @brief Handles incoming decided watermarks, frees acceptor state of
+  /// agreements every process has decided. `process_id` has to be a member.
+  auto _handle_watermark(const PerfectLink::ProcessIdType process_id,
+                         const PerfectLink::MessageIdType watermark) -> void;
+
+  /// @brief Acceptor state of an agreement. Null if the agreement was decided
+  /// by every process and its state was freed.
+  auto _acceptor(const PerfectLink::MessageIdType agreement_nr) -> Acceptor*;
+
+  /// @brief Remembers a decided set of an agreement, keeping the largest one
+  /// known. Decided sets are ordered by inclusion, so it includes the others.
+  auto _remember_decision(const PerfectLink::MessageIdType agreement_nr,
+                          const ValueSet<AgreementType>& decision) -> void;
+
+  /// @brief Counts a NACK of the current round of an agreement, adding its
+  /// values to the proposal.
+  auto _count_nack(Agreement& agreement, const ValueSet<AgreementType>& values)
+      -> void;
+
   /// @brief Check if the accumulated acks/nacks warrant a new proposal.
-  /// @return
-  auto _check_nacks(Agreement& agreement,
-                    const PerfectLink::MessageIdType agreement_nr) -> void;
+  auto _check_nacks(Agreement& agreement) -> void;
 
-  auto _broadcast_proposal(Agreement& agreement,
-                           PerfectLink::MessageIdType agreement_nr) -> void;
+  /// @brief Broadcasts the proposed value of an agreement, as a proposal or
+  /// as its decision.
+  auto _broadcast_values(const MessageKind kind, const Agreement& agreement)
+      -> void;
 
-  auto _decide(Agreement& agreement) -> void;
+  /// @param announce Whether to tell the other processes about the decision.
+  auto _decide(Agreement& agreement, const bool announce = true) -> void;
 
-  /// @brief Amount of in-flight agreements of this process.
-  static constexpr std::size_t MAX_IN_FLIGHT = 1;
+  /// @brief Delivers decided agreements in order, freeing their slots.
+  auto _deliver_decided() -> void;
 
-  enum class MessageKind : std::uint8_t {
-    Proposal = 0,
-    Ack = 1,
-    Nack = 2,
-  };
+  /// @brief Tells every process up to which agreement this one has decided.
+  auto _broadcast_watermark() -> void;
+
+  /// @brief A decided watermark is broadcast after delivering this many
+  /// agreements.
+  static constexpr PerfectLink::MessageIdType WATERMARK_INTERVAL = 256;
+
+  /// @brief Decisions that took at least this many proposal rounds are
+  /// broadcast. The broadcast costs a message per process, with fewer rounds
+  /// the others decide about as fast without it.
+  static constexpr ProposalNumberType ANNOUNCED_ROUNDS = 3;
 
   const std::size_t _max_unique_values;
   BestEffortBroadcast _link;
@@ -101,7 +297,30 @@ class LatticeAgreement {
 
   Semaphore _send_semaphore{MAX_IN_FLIGHT};
 
-  // TODO: consider storing it in a dense representation (vector)
-  std::unordered_map<PerfectLink::MessageIdType, Agreement> _agreements;
+  /// @brief Ring of in-flight agreements of this process, the agreement
+  /// `agreement_nr` lives in the slot `agreement_nr % MAX_IN_FLIGHT`.
+  std::array<Agreement, MAX_IN_FLIGHT> _agreements;
+  /// @brief Round key of every slot of `_agreements`, written with
+  /// `_agreements_mutex` held and read without it.
+  std::array<std::atomic<RoundKey>, MAX_IN_FLIGHT> _rounds;
+  /// @brief The next agreement to be delivered.
+  PerfectLink::MessageIdType _next_delivery = 0;
+  /// @brief Acceptor state of agreements from `_acceptors_base` on, indexed by
+  /// agreement number minus the base.
+  std::deque<Acceptor> _acceptors;
+  PerfectLink::MessageIdType _acceptors_base = 0;
+  /// @brief Latest decided watermark of every process, indexed by
+  /// `process_id - 1`. Agreements below the minimum are decided everywhere.
+  std::vector<PerfectLink::MessageIdType> _watermarks;
   std::mutex _agreements_mutex;
+  /// @brief Null without a state file.
+  AgreementState* _state = nullptr;
+  /// @brief Proposal number of the first round of every agreement.
+  ProposalNumberType _first_proposal_nr = 0;
+  /// @brief Decided sets the callback owner stored, see `persisted`.
+  std::atomic<PerfectLink::MessageIdType> _persisted = 0;
+
+  /// @brief Declared last, so that it delivers the remaining sets while the
+  /// rest is still alive.
+  std::optional<DeliveryQueue<DecidedSet>> _delivery;
 };
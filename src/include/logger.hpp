@@ -0,0 +1,133 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "lattice_agreement.hpp"
+
+/// @brief Writes decided sets to the output file, one line per set. Decided
+/// sets are appended as framed records (the amount of values followed by the
+/// values) to one of two staging buffers. Once a buffer is full, a background
+/// thread formats and writes it while deliveries continue into the other one.
+/// On termination `flush_from_signal` writes the records that were not yet
+/// written, which is bounded by the size of the two buffers.
+class Logger {
+ public:
+  using ValueType = LatticeAgreement::AgreementType;
+
+  /// @brief Called with the amount of sets the file holds once they were
+  /// written, from the flusher thread or the signal handler.
+  using WrittenCallback = std::function<auto(std::size_t written)->void>;
+
+  /// @param buffer_capacity Amount of values and record lengths a staging
+  /// buffer holds.
+  explicit Logger(const std::size_t buffer_capacity);
+
+  /// @brief Stops the flusher thread, writes everything and closes the file.
+  ~Logger();
+
+  Logger(const Logger&) = delete;
+  Logger& operator=(const Logger&) = delete;
+
+  /// @brief Creates the output file and starts the flusher thread. The thread
+  /// blocks all signals, so termination signals are handled by other threads.
+  /// @param append Whether to keep what the file holds, for a process that
+  /// continues a previous run. A partial last line, cut short by a crash, is
+  /// removed.
+  /// @return Amount of sets the file holds.
+  auto open(const std::string& path,
+            const bool append = false,
+            WrittenCallback on_written = nullptr) -> std::size_t;
+
+  /// @brief Appends a decided set. Blocks only if the flusher did not yet
+  /// write the other buffer when this one fills up. Thread safe.
+  auto decide(const LatticeAgreement::DecidedSet& set) -> void;
+
+  /// @brief Stops accepting decided sets and writes all staged ones. Only
+  /// calls async-signal-safe functions, meant to be called once from a signal
+  /// handler. Records that were being appended when the signal arrived are
+  /// dropped whole.
+  auto flush_from_signal() -> void;
+
+ private:
+  enum class BufferState : std::uint8_t {
+    /// @brief Nothing to write, decided sets might be appended.
+    Filling = 0,
+    /// @brief Waits to be written by the flusher.
+    Full = 1,
+  };
+
+  enum class FlusherState : std::uint8_t {
+    /// @brief Waits for a full buffer.
+    Idle = 0,
+    /// @brief Writes a buffer.
+    Busy = 1,
+    /// @brief Taken over by the signal handler, will not write anymore.
+    Stopped = 2,
+  };
+
+  struct Buffer {
+    std::unique_ptr<ValueType[]> records;
+    /// @brief Amount of values of fully appended records. Published after a
+    /// record is complete, so that a signal handler never sees a partial one.
+    std::atomic_size_t committed = 0;
+    std::atomic<BufferState> state = BufferState::Filling;
+  };
+
+  /// @brief Size of the text staged before a write.
+  static constexpr std::size_t TEXT_BUFFER_SIZE = 1 << 16;
+  /// @brief Longest text of a single value, with its separator.
+  static constexpr std::size_t MAX_VALUE_TEXT_SIZE = 11;
+
+  /// @brief Counts the complete lines of the file and removes what follows
+  /// them.
+  auto _count_lines() -> std::size_t;
+
+  auto _flush_loop() -> void;
+
+  /// @brief Formats all records of a buffer and writes them to the file, then
+  /// empties it. Async-signal-safe.
+  auto _write_records(Buffer& buffer) -> void;
+
+  /// @brief Writes the whole text staged so far. Async-signal-safe.
+  auto _write_text() -> void;
+
+  /// @brief Formats a value in decimal into `text`.
+  /// @return Amount of written characters.
+  static auto _format(ValueType value, char* text) -> std::size_t;
+
+  const std::size_t _buffer_capacity;
+  std::array<Buffer, 2> _buffers;
+  /// @brief Index of the buffer decided sets are appended to.
+  std::atomic_size_t _active = 0;
+
+  /// @brief Serializes producers.
+  std::mutex _mutex;
+  /// @brief Signals a full buffer to the flusher and a written one to
+  /// producers.
+  std::condition_variable _cv;
+  /// @brief Handed over from the flusher to the signal handler with a CAS.
+  std::atomic<FlusherState> _flusher = FlusherState::Idle;
+  std::atomic_bool _closing = false;
+
+  /// @brief Set by the signal handler, no more sets are accepted afterwards.
+  std::atomic_bool _stopped = false;
+  /// @brief Whether a producer is appending. The signal handler waits for
+  /// producers of other threads to finish.
+  std::atomic_bool _appending = false;
+
+  int _fd = -1;
+  /// @brief Amount of sets in the file, written by whoever writes records.
+  std::size_t _written = 0;
+  WrittenCallback _on_written;
+  std::unique_ptr<char[]> _text;
+  std::size_t _text_size = 0;
+  std::thread _flusher_thread;
+};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/// @brief Process wide counters and latency histograms. Every thread records
+/// into its own slot with plain relaxed loads and stores, so recording takes
+/// no lock and shares no cache line. A snapshot sums up the slots of all
+/// threads, so it is only eventually consistent with what was recorded.
+class Metrics {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  enum class Counter : std::uint8_t {
+    /// @brief Packets transmitted by perfect links for the first time.
+    LinkSent = 0,
+    /// @brief Packets retransmitted after their RTO expired.
+    LinkRetransmitted = 1,
+    /// @brief Packets delivered by perfect links.
+    LinkDelivered = 2,
+    /// @brief Messages delivered by uniform reliable broadcasts.
+    UrbDelivered = 3,
+    /// @brief Agreements decided by lattice agreements.
+    Decisions = 4,
+    /// @brief Datagrams sent by perfect links to their multicast group. Each
+    /// also counts once in `LinkSent` for every peer it was meant for.
+    LinkMulticast = 5,
+  };
+  static constexpr std::size_t COUNTER_COUNT = 6;
+
+  enum class Histogram : std::uint8_t {
+    /// @brief Time from sending a packet to its ACK, in nanoseconds. Only
+    /// packets that were sent once are sampled.
+    AckRtt = 0,
+    /// @brief Time from broadcasting a message to a majority having it, in
+    /// nanoseconds. Only messages of this process are sampled.
+    UrbTimeToMajority = 1,
+    /// @brief Proposal rounds an agreement took to be decided.
+    LatticeRounds = 2,
+  };
+  static constexpr std::size_t HISTOGRAM_COUNT = 3;
+
+  /// @brief Histograms are log-linear: values below `SUB_BUCKETS` get a bucket
+  /// each, every power of two above is split into `SUB_BUCKETS` equal
+  /// buckets. A value is thus known with a relative error of at most 1/16.
+  static constexpr std::size_t SUB_BUCKET_BITS = 4;
+  static constexpr std::size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static constexpr std::size_t BUCKETS =
+      SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+  struct HistogramSnapshot {
+    std::array<std::uint64_t, BUCKETS> buckets{};
+    std::uint64_t count = 0;
+    std::uint64_t sum = 0;
+
+    /// @brief The largest value of the bucket holding the given quantile.
+    /// Zero if nothing was recorded.
+    auto quantile(const double q) const -> std::uint64_t;
+
+    /// @brief Records a value, for histograms kept outside of the registry.
+    /// Not thread safe.
+    inline auto record(const std::uint64_t value) -> void {
+      buckets[_bucket(value)] += 1;
+      count += 1;
+      sum += value;
+    }
+
+    /// @brief Adds all values recorded in another histogram.
+    auto merge(const HistogramSnapshot& other) -> void;
+  };
+
+  struct Snapshot {
+    Clock::time_point taken_at;
+    std::array<std::uint64_t, COUNTER_COUNT> counters{};
+    std::array<HistogramSnapshot, HISTOGRAM_COUNT> histograms;
+  };
+
+  /// @brief Adds to a counter. Thread safe.
+  static inline auto increment(const Counter counter,
+                               const std::uint64_t amount = 1) -> void {
+    auto& slot = _thread_slot();
+    _add(slot, slot.counters[static_cast<std::size_t>(counter)], amount);
+  }
+
+  /// @brief Records a value in a histogram. Thread safe.
+  static inline auto record(const Histogram histogram,
+                            const std::uint64_t value) -> void {
+    auto& slot = _thread_slot();
+    auto& buckets = slot.histograms[static_cast<std::size_t>(histogram)];
+    _add(slot, buckets.buckets[_bucket(value)], 1);
+    _add(slot, buckets.sum, value);
+  }
+
+  /// @brief Records a duration in nanoseconds. Thread safe.
+  static inline auto record(const Histogram histogram,
+                            const Clock::duration duration) -> void {
+    const auto nanoseconds =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+    record(histogram, static_cast<std::uint64_t>(std::max<std::int64_t>(
+                          nanoseconds, 0)));
+  }
+
+  /// @brief Sums up what all threads recorded so far. Thread safe.
+  static auto snapshot() -> Snapshot;
+
+  /// @brief Periodically, and whenever the process gets a SIGUSR1, writes a
+  /// snapshot to stderr. Rates are relative to the previous dump.
+  class Reporter {
+   public:
+    /// @brief A live value that is read at every dump, like the size of a
+    /// queue.
+    using Gauge = std::function<auto()->std::uint64_t>;
+
+    /// @brief Starts the reporting thread. SIGUSR1 has to be blocked in all
+    /// threads, see `block_signal`.
+    /// @param interval If set, a snapshot is also dumped this often.
+    Reporter(const std::optional<Clock::duration> interval,
+             std::vector<std::pair<std::string, Gauge>> gauges = {});
+
+    /// @brief Stops the reporting thread.
+    ~Reporter();
+
+    Reporter(const Reporter&) = delete;
+    Reporter& operator=(const Reporter&) = delete;
+
+    /// @brief Blocks SIGUSR1 in the calling thread and the threads it starts
+    /// afterwards, so that only the reporter receives it. Has to be called
+    /// before any thread is started.
+    static auto block_signal() -> void;
+
+   private:
+    /// @brief Upper bound of a wait for the signal, to notice being stopped.
+    static constexpr std::chrono::milliseconds MAX_WAIT{100};
+
+    auto _report() -> void;
+
+    /// @brief Formats and writes a snapshot in a single write.
+    auto _dump(const Snapshot& snapshot) -> void;
+
+    const std::optional<Clock::duration> _interval;
+    const std::vector<std::pair<std::string, Gauge>> _gauges;
+    const Clock::time_point _started_at = Clock::now();
+    std::optional<Snapshot> _previous;
+    std::atomic_bool _done = false;
+
+    /// @brief Started last, once everything it uses is initialized.
+    std::thread _thread;
+  };
+
+ private:
+  /// @brief Index of the bucket holding a value.
+  static inline auto _bucket(const std::uint64_t value) -> std::size_t {
+    if (value < SUB_BUCKETS) {
+      return static_cast<std::size_t>(value);
+    }
+    const auto exponent =
+        static_cast<std::size_t>(63 - __builtin_clzll(value));
+    const auto shift = exponent - SUB_BUCKET_BITS;
+    const auto sub_bucket =
+        static_cast<std::size_t>(value >> shift) & (SUB_BUCKETS - 1);
+    return SUB_BUCKETS + shift * SUB_BUCKETS + sub_bucket;
+  }
+
+  /// @brief The largest value a bucket holds.
+  static auto _bucket_max(const std::size_t bucket) -> std::uint64_t;
+
+  struct HistogramBuckets {
+    std::array<std::atomic_uint64_t, BUCKETS> buckets{};
+    std::atomic_uint64_t sum{};
+  };
+
+  struct ThreadSlot {
+    explicit ThreadSlot(const bool shared) : shared(shared) {}
+
+    std::array<std::atomic_uint64_t, COUNTER_COUNT> counters{};
+    std::array<HistogramBuckets, HISTOGRAM_COUNT> histograms{};
+    /// @brief Whether more than one thread records into this slot.
+    const bool shared;
+  };
+
+  /// @brief Amount of threads that get a slot of their own. Threads started
+  /// later share a single slot.
+  static constexpr std::size_t MAX_THREADS = 128;
+
+  static inline auto _add(ThreadSlot& slot,
+                          std::atomic_uint64_t& value,
+                          const std::uint64_t amount) -> void {
+    if (slot.shared) {
+      value.fetch_add(amount, std::memory_order_relaxed);
+    } else {
+      // only this thread writes, there is no need for a locked add
+      value.store(value.load(std::memory_order_relaxed) + amount,
+                  std::memory_order_relaxed);
+    }
+  }
+
+  static inline auto _thread_slot() -> ThreadSlot& {
+    if (_slot == nullptr) {
+      _slot = _register();
+    }
+    return *_slot;
+  }
+
+  /// @brief Gives the calling thread a slot. Slots are never freed, so that
+  /// what exited threads recorded stays in snapshots.
+  static auto _register() -> ThreadSlot*;
+
+  /// @brief The slot shared by threads that did not get their own.
+  static auto _overflow_slot() -> ThreadSlot&;
+
+  static inline thread_local ThreadSlot* _slot = nullptr;
+  /// @brief Slots of the threads that registered, in order of registration.
+  static inline std::array<std::atomic<ThreadSlot*>, MAX_THREADS> _slots{};
+  static inline std::atomic_size_t _registered = 0;
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/// @brief A binary min-heap in a vector. Works like a `std::priority_queue`
+/// with `std::greater`, but sifts with unsigned indices: the signed distances
+/// of the standard heap algorithms fail `-Wstrict-overflow` once inlined.
+/// @tparam T Move assignable type of the values, ordered by `operator<`.
+template <typename T>
+class MinHeap {
+ public:
+  inline auto empty() const -> bool { return _values.empty(); }
+
+  inline auto size() const -> std::size_t { return _values.size(); }
+
+  /// @brief The smallest value. The heap must not be empty.
+  inline auto top() const -> const T& { return _values.front(); }
+
+  template <typename... Args>
+  auto emplace(Args&&... args) -> void {
+    _values.emplace_back(std::forward<Args>(args)...);
+    auto index = _values.size() - 1;
+    while (index > 0) {
+      const auto parent = (index - 1) / 2;
+      if (!(_values[index] < _values[parent])) {
+        break;
+      }
+      std::swap(_values[index], _values[parent]);
+      index = parent;
+    }
+  }
+
+  /// @brief Removes the smallest value. The heap must not be empty.
+  auto pop() -> void {
+    _values.front() = std::move(_values.back());
+    _values.pop_back();
+    const auto size = _values.size();
+    std::size_t index = 0;
+    while (true) {
+      const auto left = 2 * index + 1;
+      if (left >= size) {
+        break;
+      }
+      const auto right = left + 1;
+      const auto child =
+          right < size && _values[right] < _values[left] ? right : left;
+      if (!(_values[child] < _values[index])) {
+        break;
+      }
+      std::swap(_values[index], _values[child]);
+      index = child;
+    }
+  }
+
+ private:
+  std::vector<T> _values;
+};
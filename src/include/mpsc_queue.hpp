@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/// @brief A lock-free bounded queue with many producers and a single consumer.
+/// Every cell of the ring carries a sequence number telling whether it is free
+/// for the producer at a position or holds a value for the consumer
+/// (D. Vyukov's bounded queue). Producers claim positions with a CAS, the
+/// consumer needs no atomic read-modify-write at all.
+/// @tparam T Default constructible and move assignable type of the values.
+template <typename T>
+class MpscQueue {
+ public:
+  /// @param capacity Rounded up to a power of two.
+  explicit MpscQueue(const std::size_t capacity)
+      : _mask(_round_up(capacity) - 1), _cells(new Cell[_mask + 1]) {
+    for (std::size_t i = 0; i <= _mask; i++) {
+      _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+
+  /// @brief Enqueues a value if there is space. Thread safe.
+  /// @return False if the queue is full, then `value` is left untouched.
+  auto try_push(T&& value) -> bool {
+    auto position = _enqueue_position.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &_cells[position & _mask];
+      const auto sequence = cell->sequence.load(std::memory_order_acquire);
+      const auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+      if (difference == 0) {
+        // the cell is free, claim the position
+        if (_enqueue_position.compare_exchange_weak(
+                position, position + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        // the consumer did not yet free the cell of the previous lap
+        return false;
+      } else {
+        // another producer claimed the position first
+        position = _enqueue_position.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->value = std::move(value);
+    cell->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// @brief Dequeues the oldest value if there is one. Only the consumer is
+  /// allowed to call it.
+  /// @return False if the queue is empty.
+  auto try_pop(T& value) -> bool {
+    auto& cell = _cells[_dequeue_position & _mask];
+    if (cell.sequence.load(std::memory_order_acquire) !=
+        _dequeue_position + 1) {
+      return false;
+    }
+
+    value = std::move(cell.value);
+    // free the cell for the producer of the next lap
+    cell.sequence.store(_dequeue_position + _mask + 1,
+                        std::memory_order_release);
+    _dequeue_position += 1;
+    return true;
+  }
+
+  /// @brief Whether there is nothing to dequeue. Only the consumer is allowed
+  /// to call it.
+  auto empty() const -> bool {
+    return _cells[_dequeue_position & _mask].sequence.load(
+               std::memory_order_acquire) != _dequeue_position + 1;
+  }
+
+  inline auto capacity() const -> std::size_t { return _mask + 1; }
+
+ private:
+  /// @brief Positions are kept on separate cache lines, so that producers and
+  /// the consumer do not invalidate each other.
+  static constexpr std::size_t CACHE_LINE_SIZE = 64;
+
+  struct Cell {
+    std::atomic<std::size_t> sequence;
+    T value;
+  };
+
+  static auto _round_up(const std::size_t capacity) -> std::size_t {
+    std::size_t result = 1;
+    while (result < capacity) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  const std::size_t _mask;
+  const std::unique_ptr<Cell[]> _cells;
+  alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> _enqueue_position = 0;
+  alignas(CACHE_LINE_SIZE) std::size_t _dequeue_position = 0;
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/// @brief A pool of packet buffers in a few fixed size classes. Buffers are
+/// carved out of large slabs and returned to a per-class free list once
+/// released, so in a steady state acquiring a buffer does not allocate. A
+/// buffer can be shared by many handles, it is released once the last one is
+/// destroyed. Not thread safe, the owner has to synchronize access (including
+/// releases done by destroying a `Buffer`).
+class PacketPool {
+ public:
+  /// @brief Capacities of the size classes, in bytes.
+  static constexpr std::array<std::size_t, 5> SIZE_CLASSES = {
+      64, 256, 1'024, 8'192, 65'536};
+  static constexpr std::size_t MAX_BUFFER_SIZE = SIZE_CLASSES.back();
+
+  /// @brief Owning handle to a pooled buffer of the smallest size class that
+  /// fits the requested size. Returns the buffer to its pool when the last
+  /// handle to it is destroyed. Move only, use `share` for another handle.
+  class Buffer {
+   public:
+    Buffer() = default;
+    ~Buffer();
+
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+    Buffer(Buffer&& other) noexcept;
+    Buffer& operator=(Buffer&& other) noexcept;
+
+    inline auto data() -> std::uint8_t* { return _data; }
+    inline auto data() const -> const std::uint8_t* { return _data; }
+
+    /// @brief The size that was requested, at most the class capacity.
+    inline auto size() const -> std::size_t { return _size; }
+
+    /// @brief Shrinks the size of the buffer, the capacity stays the same.
+    inline auto truncate(const std::size_t size) -> void {
+      assert(size <= _size);
+      _size = size;
+    }
+
+    /// @brief Creates another handle to the same buffer.
+    auto share() const -> Buffer;
+
+   private:
+    friend class PacketPool;
+
+    Buffer(PacketPool* pool,
+           std::uint8_t* data,
+           const std::size_t size,
+           const std::uint8_t size_class)
+        : _pool(pool), _data(data), _size(size), _size_class(size_class) {}
+
+    PacketPool* _pool = nullptr;
+    std::uint8_t* _data = nullptr;
+    std::size_t _size = 0;
+    std::uint8_t _size_class = 0;
+  };
+
+  PacketPool() = default;
+
+  PacketPool(const PacketPool&) = delete;
+  PacketPool& operator=(const PacketPool&) = delete;
+
+  /// @brief Acquires a buffer that can hold `size` bytes. `size` has to be at
+  /// most `MAX_BUFFER_SIZE`.
+  auto acquire(const std::size_t size) -> Buffer;
+
+ private:
+  /// @brief Every buffer is preceded by its reference count, padded so that
+  /// buffers stay aligned.
+  using RefCountType = std::uint32_t;
+  static constexpr std::size_t BUFFER_HEADER_SIZE = alignof(std::max_align_t);
+  static_assert(sizeof(RefCountType) <= BUFFER_HEADER_SIZE);
+
+  /// @brief Amount of bytes allocated at once for a size class. Classes too
+  /// large for it get a slab per buffer.
+  static constexpr std::size_t SLAB_SIZE = 128 * 1'024;
+
+  static inline auto _ref_count(std::uint8_t* data) -> RefCountType& {
+    return *reinterpret_cast<RefCountType*>(data - BUFFER_HEADER_SIZE);
+  }
+
+  auto _release(std::uint8_t* data, const std::uint8_t size_class) -> void;
+
+  /// @brief Free buffers of every size class.
+  std::array<std::vector<std::uint8_t*>, SIZE_CLASSES.size()> _free;
+  /// @brief Memory backing all buffers, never freed before the pool.
+  std::vector<std::unique_ptr<std::uint8_t[]>> _slabs;
+};
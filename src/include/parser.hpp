@@ -18,7 +18,11 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 
@@ -32,14 +36,14 @@ class Parser {
 
   bool parsed;
 
-  uint8_t id_;
+  uint16_t id_;
   std::string hostsPath_;
   std::string outputPath_;
   std::string configPath_;
 
  public:
   struct Host {
-    Host(uint8_t id, std::string& ip_or_hostname, unsigned short port)
+    Host(uint16_t id, std::string& ip_or_hostname, unsigned short port)
         : id{id}, port{htons(port)} {
       if (isValidIpAddress(ip_or_hostname.c_str())) {
         ip = inet_addr(ip_or_hostname.c_str());
@@ -56,7 +60,7 @@ class Parser {
 
     unsigned short portReadable() const { return ntohs(port); }
 
-    uint8_t id;
+    uint16_t id;
     in_addr_t ip;
     in_port_t port;
 
@@ -207,48 +211,182 @@ class Parser {
     return m;
   }
 
+  /// @brief Streams proposals out of a memory mapped config file. Proposals
+  /// are parsed in batches into a reused arena and handed out as spans into
+  /// it, the kernel is asked to read ahead of the parsed part of the file.
   struct LatticeAgreementConfig {
-    LatticeAgreementConfig(std::string config_path) : config_file(config_path) {
-      config_file.unsetf(std::ios_base::skipws);
+    /// @brief Values of a single proposal. Valid until the next call to
+    /// `next_proposal`.
+    struct Proposal {
+      const std::uint32_t* data;
+      std::size_t size;
+
+      auto begin() const -> const std::uint32_t* { return data; }
+      auto end() const -> const std::uint32_t* { return data + size; }
+    };
+
+    explicit LatticeAgreementConfig(const std::string& config_path) {
+      fd_ = open(config_path.c_str(), O_RDONLY);
+      if (fd_ < 0) {
+        std::ostringstream os;
+        os << "`" << config_path << "` does not exist.";
+        throw std::invalid_argument(os.str());
+      }
 
-      size_t p = 0;
-      size_t vs = 0;
-      size_t ds = 0;
-      char ws;
+      struct stat info;
+      if (fstat(fd_, &info) < 0) {
+        close(fd_);
+        throw std::runtime_error("Could not stat the config file");
+      }
+      size_ = static_cast<std::size_t>(info.st_size);
 
-      config_file >> p >> ws >> vs >> ws >> ds >> ws;
+      if (size_ > 0) {
+        void* mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (mapped == MAP_FAILED) {
+          close(fd_);
+          throw std::runtime_error("Could not map the config file");
+        }
+        begin_ = static_cast<const char*>(mapped);
+        // read only once, front to back
+        madvise(mapped, size_, MADV_SEQUENTIAL);
+      }
+      cursor_ = begin_;
+      end_ = begin_ + size_;
+
+      agreements_count = parse_value();
+      max_proposed = parse_value();
+      unique_proposals = parse_value();
+      skip_line();
+    }
 
-      max_proposed = vs;
-      unique_proposals = ds;
-      agreements_count = p;
+    ~LatticeAgreementConfig() {
+      if (begin_ != nullptr) {
+        munmap(const_cast<char*>(begin_), size_);
+      }
+      close(fd_);
     }
 
+    LatticeAgreementConfig(const LatticeAgreementConfig&) = delete;
+    LatticeAgreementConfig& operator=(const LatticeAgreementConfig&) = delete;
+
     std::size_t max_proposed;
     std::size_t unique_proposals;
 
    private:
-    std::ifstream config_file;
+    /// @brief Amount of proposals parsed at once.
+    static constexpr std::size_t BATCH_SIZE = 1'024;
+    /// @brief How far ahead of the parsed part the file is read ahead.
+    static constexpr std::size_t PREFETCH_SIZE = 1 << 20;
+
+    int fd_ = -1;
+    std::size_t size_ = 0;
+    const char* begin_ = nullptr;
+    const char* cursor_ = nullptr;
+    const char* end_ = nullptr;
+
     std::size_t agreements_count;
     std::size_t proposal_index = 0;
-    std::array<std::vector<std::uint32_t>, 100> proposals;
+    /// @brief Values of the current batch, back to back.
+    std::vector<std::uint32_t> arena;
+    /// @brief Where every proposal of the current batch starts in `arena`, and
+    /// where the last one ends.
+    std::vector<std::size_t> offsets;
+
+    static inline auto is_digit(const char c) -> bool {
+      return static_cast<unsigned char>(c - '0') < 10;
+    }
+
+    /// @brief Parses 8 digits at once (SWAR), if the next 8 bytes are digits.
+    /// Works on little endian machines only.
+    static inline auto parse_eight_digits(const char* text,
+                                          std::uint64_t& value) -> bool {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      std::uint64_t chunk;
+      std::memcpy(&chunk, text, sizeof(chunk));
+      // every byte is in '0'..'9' if its high nibble is 3 and adding 6 does
+      // not carry into the high nibble
+      if (((chunk & 0xF0F0F0F0F0F0F0F0) |
+           (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) !=
+          0x3333333333333333) {
+        return false;
+      }
+      // combine pairs, then quadruples, then the two halves of digits
+      chunk -= 0x3030303030303030;
+      chunk = (chunk * 10) + (chunk >> 8);
+      constexpr std::uint64_t mask = 0x000000FF000000FF;
+      constexpr std::uint64_t high = 100 + (1000000ULL << 32);
+      constexpr std::uint64_t low = 1 + (10000ULL << 32);
+      chunk = (((chunk & mask) * high) + (((chunk >> 16) & mask) * low)) >> 32;
+      value = value * 100000000 + (chunk & 0xFFFFFFFF);
+      return true;
+#else
+      (void)text;
+      (void)value;
+      return false;
+#endif
+    }
 
-    auto read_proposals_batch() -> void {
-      char ws;
+    /// @brief Skips spaces and parses the unsigned integer that follows.
+    auto parse_value() -> std::uint64_t {
+      while (cursor_ != end_ && (*cursor_ == ' ' || *cursor_ == '\t')) {
+        cursor_++;
+      }
+      if (cursor_ == end_ || !is_digit(*cursor_)) {
+        throw std::runtime_error("Malformed config file");
+      }
 
-      for (std::size_t i = 0; i < proposals.size(); i++) {
-        if (i + proposal_index >= agreements_count) {
-          break;
-        }
-        proposals[i].clear();
+      std::uint64_t value = 0;
+      while (end_ - cursor_ >= 8 && parse_eight_digits(cursor_, value)) {
+        cursor_ += 8;
+      }
+      while (cursor_ != end_ && is_digit(*cursor_)) {
+        value = value * 10 + static_cast<std::uint64_t>(*cursor_ - '0');
+        cursor_++;
+      }
+      return value;
+    }
 
-        for (std::size_t j = 0; j < max_proposed; j++) {
-          std::uint32_t val;
-          config_file >> val >> ws;
-          proposals[i].push_back(val);
-          if (ws == '\n') {
-            break;
-          }
+    /// @brief Whether the current line has no more values, skipping spaces.
+    auto is_line_end() -> bool {
+      while (cursor_ != end_ &&
+             (*cursor_ == ' ' || *cursor_ == '\t' || *cursor_ == '\r')) {
+        cursor_++;
+      }
+      return cursor_ == end_ || *cursor_ == '\n';
+    }
+
+    auto skip_line() -> void {
+      while (cursor_ != end_ && *cursor_ != '\n') {
+        cursor_++;
+      }
+      if (cursor_ != end_) {
+        cursor_++;
+      }
+    }
+
+    auto read_proposals_batch() -> void {
+      arena.clear();
+      offsets.clear();
+
+      const auto count =
+          std::min(BATCH_SIZE, agreements_count - proposal_index);
+      for (std::size_t i = 0; i < count; i++) {
+        offsets.push_back(arena.size());
+        for (std::size_t j = 0; j < max_proposed && !is_line_end(); j++) {
+          arena.push_back(static_cast<std::uint32_t>(parse_value()));
         }
+        skip_line();
+      }
+      offsets.push_back(arena.size());
+
+      // start reading the next batch from disk while this one is proposed
+      const auto page = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+      const auto ahead =
+          reinterpret_cast<std::uintptr_t>(cursor_) & ~(page - 1);
+      const auto last = std::min(reinterpret_cast<std::uintptr_t>(end_),
+                                 ahead + PREFETCH_SIZE);
+      if (ahead < last) {
+        madvise(reinterpret_cast<void*>(ahead), last - ahead, MADV_WILLNEED);
       }
     }
 
@@ -257,12 +395,15 @@ class Parser {
       return proposal_index != agreements_count;
     }
 
-    auto next_proposal() -> std::vector<std::uint32_t>& {
-      if (proposal_index % proposals.size() == 0) {
+    auto next_proposal() -> Proposal {
+      const auto index = proposal_index % BATCH_SIZE;
+      if (index == 0) {
         read_proposals_batch();
       }
+      proposal_index++;
 
-      return proposals[proposal_index++ % proposals.size()];
+      return {arena.data() + offsets[index],
+              offsets[index + 1] - offsets[index]};
     }
   };
 
@@ -296,13 +437,14 @@ class Parser {
       std::string ip;
       unsigned short port;
 
-      if (!(iss >> id >> ip >> port)) {
+      if (!(iss >> id >> ip >> port) || id < 1 ||
+          id > std::numeric_limits<uint16_t>::max()) {
         std::ostringstream os;
         os << "Parsing for `" << hostsPath() << "` failed at line " << lineNum;
         throw std::invalid_argument(os.str());
       }
 
-      hosts.push_back(Host(static_cast<uint8_t>(id), ip, port));
+      hosts.push_back(Host(static_cast<uint16_t>(id), ip, port));
     }
 
     if (hosts.size() < 2UL) {
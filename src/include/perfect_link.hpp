@@ -4,18 +4,68 @@
 #include <sys/socket.h>
 #include <array>
 #include <atomic>
+#include <bitset>
 #include <chrono>
 #include <condition_variable>
 #include <cstddef>
 #include <cstring>
 #include <functional>
 #include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
+#include <string_view>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
+#include "codec.hpp"
 #include "common.hpp"
+#include "min_heap.hpp"
+#include "packet_pool.hpp"
+#include "state_file.hpp"
+#include "transport.hpp"
+
+/// @brief Tunables of a `PerfectLink`.
+struct LinkOptions {
+  /// @brief Upper bound of the congestion window of every peer: the maximum
+  /// amount of messages sent to a peer that were not yet acknowledged.
+  std::uint16_t max_in_flight = 64;
+  /// @brief If non-zero, messages without metadata are not sent right away but
+  /// coalesced with other such messages to the same destination into a single
+  /// packet. The packet is sent once it is full or at most this long after its
+  /// first message was queued.
+  std::chrono::microseconds coalesce_delay = std::chrono::microseconds::zero();
+  /// @brief Amount of `SO_REUSEPORT` sockets bound to the same port, each
+  /// served by its own receiving thread. The kernel spreads incoming datagrams
+  /// over them by the sender address, so all messages of a sender are handled
+  /// by the same thread.
+  std::uint8_t receive_shards = 1;
+  /// @brief Where the endpoints of the link come from and whose clock its
+  /// timers run on. UDP sockets on the wall clock if not set.
+  std::shared_ptr<Transport> transport;
+  /// @brief Used by `BestEffortBroadcast`. If non-zero, broadcasts travel a
+  /// spanning tree rooted at their origin, in which every process forwards a
+  /// message to at most this many others, instead of being sent by the origin
+  /// to every process.
+  std::uint8_t broadcast_fanout = 0;
+  /// @brief If set, the link joins this multicast group, and a message sent
+  /// to many peers at once is first transmitted as a single datagram to the
+  /// group instead of a copy to each of them. It names the sequence number of
+  /// every peer, which acknowledges it like any other message, retransmissions
+  /// go to the peers alone. All processes have to join the same group.
+  /// Requires a single receive shard.
+  std::optional<sockaddr_in> multicast_group;
+  /// @brief If set, the link keeps its sequence numbers and what it
+  /// acknowledged in this file. A link created again on the same file, after
+  /// a restart of the process, continues where the previous one stopped: it
+  /// tells the peers it sent to to skip the messages that were lost with it,
+  /// and acknowledges what was delivered, so that the peers drop those from
+  /// their pending messages instead of resending them. Only one link of a
+  /// process can use the file.
+  std::shared_ptr<StateFile> state;
+};
 
 /// Enforces 3 properties for point-to-point communication:
 /// 1. Validity - if p1 and p2 are correct, every message sent by p1 is
@@ -25,21 +75,35 @@
 class PerfectLink {
  public:
   /// @brief The type used to store ID of a process.
-  using ProcessIdType = std::uint8_t;
+  using ProcessIdType = std::uint16_t;
 
   /// @brief The type used to store ID of a message.
   using MessageIdType = std::uint32_t;
 
   using MessageData = std::tuple<std::uint8_t*, std::size_t>;
+  /// @brief A runtime sized list of payloads.
+  using Payloads = Slice<Slice<std::uint8_t>>;
 
   static constexpr std::uint8_t MAX_MESSAGE_COUNT_IN_PACKET = 8;
-  static constexpr ProcessIdType MAX_PROCESSES = 128;
+  /// @brief Upper bound of the amount of processes, ids go from 1 up to it.
+  static constexpr std::size_t MAX_PROCESSES =
+      std::numeric_limits<ProcessIdType>::max();
+  /// @brief Maximum size of a single datagram.
   static constexpr std::size_t MAX_MESSAGE_SIZE = 6'400;
-
-  PerfectLink(const ProcessIdType id);
-
-  /// @brief If the link was bound to a socket, destructor will close the
-  /// socket.
+  static_assert(MAX_MESSAGE_SIZE <= PacketPool::MAX_BUFFER_SIZE);
+  /// @brief Maximum size of an encoded message. Messages that do not fit into
+  /// a datagram are split into fragments and reassembled by the receiver.
+  static constexpr std::size_t MAX_FRAGMENTED_SIZE =
+      PacketPool::MAX_BUFFER_SIZE;
+
+  /// @param processes Amount of processes that may send to this link, their
+  /// ids go from 1 up to it. The receiving state is sized for exactly them,
+  /// messages of other ids are dropped.
+  PerfectLink(const ProcessIdType id,
+              const std::size_t processes,
+              const LinkOptions options = {});
+
+  /// @brief If the link was bound, destructor will close its endpoints.
   ~PerfectLink();
 
   /// @brief Binds this link to a host and port. Once done cannot be done again.
@@ -54,7 +118,13 @@ class PerfectLink {
                         ->void>;
 
   /// @brief Starts listening to incoming messages. Sends ACKs for new messages.
-  /// Receives ACKs and resends messages with missing ACKs. Thread safe.
+  /// Receives ACKs and resends messages with missing ACKs. Has to be called by
+  /// a single thread, the delivered messages are tracked without locks. With
+  /// more than one receive shard, a thread per additional shard is started and
+  /// the callback is called concurrently from all of them. Messages of a
+  /// single sender are still delivered by a single thread. Returns once the
+  /// link is stopped. A link is listened to or served once, throws if it
+  /// already was.
   /// @param callback Function that will be called when a message is delivered.
   auto listen(ListenCallback callback) -> void;
 
@@ -62,10 +132,24 @@ class PerfectLink {
   /// batched. This will also recover metadata.
   auto listen_batch(ListenBatchCallback callback) -> void;
 
+  /// @brief Same as `listen_batch` but registers the endpoints and timers of
+  /// all shards with a reactor of the transport of the link instead, so that
+  /// a single thread running it can serve many links. Returns right away, the
+  /// callback is called while the reactor runs.
+  auto serve(Reactor& reactor, ListenBatchCallback callback) -> void;
+
+  /// @brief Makes `listen` return once the messages being delivered now were
+  /// delivered. A reactor given to `serve` has to be stopped by its owner.
+  /// Thread safe.
+  auto stop() -> void;
+
   /// @brief Sends a message from this link to a chosen host and port. The
   /// data has to be smaller than about 64KiB. Sending is possible only
   /// after performing a bind. At most 8 messages can be packed in
-  /// a single packet. Thread safe.
+  /// a single packet. A single message too large for a datagram is sent in
+  /// fragments, each of them acknowledged and retransmitted on its own. Never
+  /// blocks: if the window of the destination is full, the message is queued
+  /// until ACKs open it. Thread safe.
   template <typename... Data,
             class = std::enable_if_t<are_equal<MessageData, Data...>::value>,
             class = std::enable_if_t<(sizeof...(Data) <=
@@ -75,152 +159,672 @@ class PerfectLink {
             const std::optional<MessageData> metadata,
             Data... datas) -> void;
 
+  /// @brief Same as `send` but sends the same message to many hosts at once.
+  /// All datagrams are flushed with a single `sendmmsg`. Thread safe.
+  template <typename... Data,
+            class = std::enable_if_t<are_equal<MessageData, Data...>::value>,
+            class = std::enable_if_t<(sizeof...(Data) <=
+                                      MAX_MESSAGE_COUNT_IN_PACKET)>>
+  auto send_batch(const std::vector<sockaddr_in>& addrs,
+                  const std::optional<MessageData> metadata,
+                  Data... datas) -> void;
+
+  /// @brief Sends a runtime sized list of payloads from this link to a chosen
+  /// host and port. Packs as many leading payloads as fit into a single packet.
+  /// Thread safe.
+  /// @return Amount of packed payloads, the rest has to be sent with another
+  /// call.
+  auto send(const in_addr_t host,
+            const in_port_t port,
+            const Slice<std::uint8_t> metadata,
+            const Payloads datas) -> std::size_t;
+
+  /// @brief Same as the runtime sized `send` but sends the same message to
+  /// many hosts at once. The message is encoded once and shared by all
+  /// destinations, only the sequence numbers are kept per destination and
+  /// gathered with the shared part by `sendmmsg`. Thread safe.
+  /// @return Amount of packed payloads, the rest has to be sent with another
+  /// call.
+  auto send_batch(const std::vector<sockaddr_in>& addrs,
+                  const Slice<std::uint8_t> metadata,
+                  const Payloads datas) -> std::size_t;
+
+  /// @brief Amount of leading payloads that fit into a single packet together
+  /// with metadata of the given size. If not even the first one fits, it is
+  /// sent alone in fragments and this is 1.
+  static auto packable(const std::size_t metadata_size, const Payloads datas)
+      -> std::size_t;
+
+  /// @brief Creates an IPv4 socket address from a host and port.
+  static inline auto make_address(const in_addr_t host, const in_port_t port)
+      -> sockaddr_in {
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = host;
+    addr.sin_port = port;
+    return addr;
+  }
+
   /// @brief Id of this process.
   inline auto id() const -> ProcessIdType { return _id; }
 
+  /// @brief Whether a process id read from the network names a member. Ids
+  /// are dense, from 1 to the amount of processes.
+  inline auto is_member(const ProcessIdType process_id) const -> bool {
+    return process_id != 0 && process_id <= _sources.size();
+  }
+
  private:
   /// @brief The type used to store the size of data.
   using MessageSizeType = std::uint16_t;
 
-  static constexpr timeval RESEND_TIMEOUT = {0, 200000};
-  static constexpr std::uint16_t MAX_IN_FLIGHT = 64;
+  using Clock = std::chrono::steady_clock;
+
+  /// @brief The retransmission timer of a shard is armed at least this far
+  /// ahead. Timers of acknowledged messages are only dropped once they are
+  /// due, so that a stream of them does not wake the thread for each one.
+  static constexpr Clock::duration TIMER_SLACK = std::chrono::milliseconds(1);
+  /// @brief Retransmission timeout of a peer without any RTT samples.
+  static constexpr Clock::duration INITIAL_RTO = std::chrono::milliseconds(200);
+  static constexpr Clock::duration MIN_RTO = std::chrono::milliseconds(10);
+  static constexpr Clock::duration MAX_RTO = std::chrono::seconds(1);
+  /// @brief Congestion window of a peer before any ACKs arrive.
+  static constexpr std::uint16_t INITIAL_WINDOW = 4;
+  /// @brief Maximum amount of datagrams received with a single `recvmmsg`.
+  static constexpr std::size_t RECV_BATCH_SIZE = 32;
+  /// @brief Maximum amount of batches received whenever an endpoint is
+  /// readable, the rest is received after the other events of the reactor.
+  static constexpr std::size_t MAX_BATCHES_PER_EVENT = 4;
+
+  /// @brief Amount of sequence numbers after a cumulative ACK that are
+  /// selectively acknowledged in the SACK bitmap of an ACK.
+  using SackType = std::uint64_t;
+  static constexpr MessageIdType SACK_WINDOW = 8 * sizeof(SackType);
+  /// @brief Layout of the part of a message that differs between destinations:
+  /// the flags and the sequence number.
+  using Header = codec::Layout<std::uint8_t, MessageIdType>;
+  static constexpr std::size_t HEADER_SIZE = Header::SIZE;
+  /// @brief Bits of the flags of a message.
+  static constexpr std::uint8_t ACK_FLAG = 1 << 0;
+  static constexpr std::uint8_t FRAGMENT_FLAG = 1 << 1;
+  static constexpr std::uint8_t MULTICAST_FLAG = 1 << 2;
+  /// @brief Marks the first message of a restarted link to a peer. The
+  /// messages with lower sequence numbers were lost with the previous run, the
+  /// receiver treats them as delivered. It carries no payloads.
+  static constexpr std::uint8_t RESTART_FLAG = 1 << 3;
+
+  /// @brief Layout of the part of a datagram to the multicast group preceding
+  /// its table: the flags and the amount of entries. It takes the place of the
+  /// header of a message.
+  using MulticastHeader = codec::Layout<std::uint8_t, ProcessIdType>;
+  static constexpr std::size_t MULTICAST_HEADER_SIZE = MulticastHeader::SIZE;
+  /// @brief Bytes of an `_address_key` on the wire, the address and the port.
+  static constexpr std::size_t ADDRESS_KEY_SIZE =
+      sizeof(in_addr_t) + sizeof(in_port_t);
+  /// @brief Size of an entry of the table of a datagram to the multicast
+  /// group: the `_address_key` of a peer and its sequence number.
+  static constexpr std::size_t MULTICAST_ENTRY_SIZE =
+      ADDRESS_KEY_SIZE + sizeof(MessageIdType);
+
+  /// @brief The type used to number fragments of a message.
+  using FragmentIndexType = std::uint16_t;
+  /// @brief Layout of the part of a fragment preceding its chunk of the body:
+  /// the process id, the index of the fragment and the amount of fragments.
+  using FragmentHeader =
+      codec::Layout<ProcessIdType, FragmentIndexType, FragmentIndexType>;
+  static constexpr std::size_t FRAGMENT_HEADER_SIZE = FragmentHeader::SIZE;
+  /// @brief Size of the chunk of the body carried by every fragment but the
+  /// last one.
+  static constexpr std::size_t FRAGMENT_SIZE =
+      MAX_MESSAGE_SIZE - HEADER_SIZE - FRAGMENT_HEADER_SIZE;
+  static_assert((MAX_FRAGMENTED_SIZE + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE <=
+                std::numeric_limits<FragmentIndexType>::max());
+  /// @brief Size of an encoded ACK: a header with the cumulative seq_nr and the
+  /// SACK bitmap as metadata.
+  static constexpr std::size_t ACK_MESSAGE_SIZE =
+      HEADER_SIZE + sizeof(ProcessIdType) + sizeof(MessageSizeType) +
+      sizeof(SackType);
 
   /// @brief Data structure to hold temporary data of a message that was sent
   /// but where no ACK for it was yet received.
   struct PendingMessage {
-    PendingMessage(const sockaddr_in addr,
-                   const std::array<uint8_t, MAX_MESSAGE_SIZE> message,
-                   const std::size_t message_size)
-        : addr(addr), message(message), message_size(message_size) {}
-    const struct sockaddr_in addr;
-    const std::array<uint8_t, MAX_MESSAGE_SIZE> message;
-    const std::size_t message_size;
+    PendingMessage(const MessageIdType seq_nr,
+                   PacketPool::Buffer&& body,
+                   const std::uint8_t flags = 0)
+        : body(std::move(body)) {
+      Header::store(header.data(), flags, seq_nr);
+    }
+    /// @brief The encoded header of this destination.
+    std::array<std::uint8_t, HEADER_SIZE> header;
+    /// @brief The encoded rest of the message, shared among all destinations
+    /// of a `send_batch`. For a fragment, its chunk of the body.
+    const PacketPool::Buffer body;
+    /// @brief Time of the first transmission.
+    Clock::time_point sent_at;
+    /// @brief When this message will be retransmitted if not acknowledged.
+    Clock::time_point deadline;
+    /// @brief Retransmitted messages give ambiguous RTT samples (Karn's
+    /// algorithm), so they are not used for the estimation.
+    bool retransmitted = false;
   };
 
-  /// @brief Id of this process.
-  const ProcessIdType _id;
+  /// @brief Record of the state file of a destination, found by its
+  /// `_address_key`. Written before a new sequence number leaves, so a
+  /// restarted link never reuses one. Zero if the slot is free.
+  struct SentState {
+    std::atomic<std::uint64_t> peer_key = 0;
+    /// @brief The first sequence number not transmitted yet.
+    std::atomic<MessageIdType> seq_nr = 0;
+  };
+  static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+
+  /// @brief Record of the state file of a source, indexed by
+  /// `process_id - 1`. Holds the last ACK sent to it, written before the ACK
+  /// leaves. A restarted link thus never forgets what its peers were told was
+  /// delivered.
+  struct AckedState {
+    struct Ack {
+      MessageIdType watermark;
+      SackType sack;
+    };
+    /// @brief The ACK `current` points to is complete, the other one is
+    /// written next.
+    std::array<Ack, 2> acks{};
+    std::atomic<std::uint32_t> current = 0;
+    /// @brief Where the source sends from, zero if it never sent.
+    std::atomic<std::uint64_t> source_key = 0;
+  };
 
-  /// @brief Hash function for `_delivered`.
-  struct hash_delivered {
-    inline size_t operator()(
-        const std::tuple<ProcessIdType, MessageIdType>& arg) const noexcept {
-      return std::get<0>(arg) ^ std::get<1>(arg);
+  /// @brief Sending state of a single destination. Every destination has its
+  /// own sequence numbers, so that it can acknowledge them cumulatively.
+  struct Peer {
+    Peer(const sockaddr_in addr, const std::uint16_t max_window)
+        : addr(addr), window_threshold(max_window), max_window(max_window) {}
+    const sockaddr_in addr;
+    /// @brief Sequence number of the next message sent to this peer.
+    MessageIdType seq_nr = 1;
+    /// @brief Sequence number of the next message to transmit. Messages from
+    /// this one up to `seq_nr` wait for the window to open.
+    MessageIdType transmit_seq_nr = 1;
+    /// @brief Messages that have not yet sent back an ACK, including the ones
+    /// waiting to be transmitted. Ordered so that a cumulative ACK can drop a
+    /// whole range at once.
+    std::map<MessageIdType, PendingMessage> pending_for_ack;
+    /// @brief Congestion window: the maximum amount of transmitted messages
+    /// without an ACK. Grows additively and shrinks multiplicatively on
+    /// timeouts (AIMD), with a slow start below `window_threshold`.
+    std::uint16_t window = INITIAL_WINDOW;
+    std::uint16_t window_threshold;
+    /// @brief ACKed messages since the window was last grown.
+    std::uint16_t window_acked = 0;
+    const std::uint16_t max_window;
+    /// @brief Smoothed round trip time, zero until the first sample.
+    Clock::duration srtt = Clock::duration::zero();
+    /// @brief Round trip time variation.
+    Clock::duration rttvar = Clock::duration::zero();
+    /// @brief Retransmission timeout, doubled on every expiry until a new RTT
+    /// sample arrives.
+    Clock::duration rto = INITIAL_RTO;
+    /// @brief Body of the next message, collecting coalesced payloads. Only
+    /// allocated if `outbox_size` is not zero.
+    PacketPool::Buffer outbox;
+    std::size_t outbox_size = 0;
+    /// @brief Its record in the state file, if there is one.
+    SentState* sent_state = nullptr;
+
+    /// @brief Updates the RTT estimate (RFC 6298) and recomputes the RTO.
+    auto sample_rtt(const Clock::duration rtt) -> void;
+
+    /// @brief Grows the window after `acked` messages were acknowledged.
+    auto grow_window(const std::size_t acked) -> void;
+
+    /// @brief Halves the window after a retransmission timeout.
+    auto shrink_window() -> void;
+
+    /// @brief Amount of transmitted messages without an ACK.
+    inline auto in_flight() const -> std::size_t {
+      return pending_for_ack.size() - (seq_nr - transmit_seq_nr);
     }
   };
 
-  /// @brief Bound socket file descriptor. None if no bind was performed.
-  std::optional<int> _sock_fd;
-  /// @brief Current sequence number of messages.
-  MessageIdType _seq_nr = 1;
-  /// @brief Map of sent messages that have not yet sent back an ACK.
-  std::unordered_map<MessageIdType, PendingMessage> _pending_for_ack;
-  std::mutex _pending_for_ack_mutex;
-  /// @brief A map of messages that have been delivered.
-  std::unordered_set<std::tuple<ProcessIdType, MessageIdType>, hash_delivered>
-      _delivered = {};
-  std::mutex _delivered_mutex;
-  /// @brief Flag indicating whether this link should do no more work.
-  std::atomic_bool _done = false;
-
-  /// @brief Prepares a message to be sent.
-  /// @return Encoded message with its real length.
-  template <typename... Data,
-            class = std::enable_if_t<are_equal<MessageData, Data...>::value>>
-  inline auto _prepare_message(const MessageIdType seq_nr,
-                               const bool is_ack,
-                               const std::optional<MessageData> metadata,
-                               Data... datas) const
-      -> std::tuple<std::array<uint8_t, MAX_MESSAGE_SIZE>, std::size_t>;
-
-  /// @brief Given a message from network decodes it to data. `data_buffer` will
-  /// contain pointers into `message`.
-  /// @return is_ack, seq_nr, process_id, metadata
-  static inline auto _decode_message(
-      const std::array<uint8_t, MAX_MESSAGE_SIZE>& message,
-      const size_t message_size,
-      std::vector<Slice<uint8_t>>& data_buffer)
-      -> std::tuple<bool, MessageIdType, ProcessIdType, Slice<std::uint8_t>>;
-};
+  /// @brief Datagrams collected to be sent with a single `sendmmsg`. Only
+  /// pointers are stored, the data has to outlive the call to `flush`.
+  struct Datagrams {
+    /// @brief Adds a datagram gathered from the header and body of a message.
+    auto push(const PendingMessage& message, const sockaddr_in* addr) -> void;
+
+    /// @brief Adds a datagram gathered from a header of its own, kept until
+    /// the flush, and the body of a message.
+    auto push(std::vector<std::uint8_t>&& header,
+              const PacketPool::Buffer& body,
+              const sockaddr_in* addr) -> void;
+
+    auto flush(Endpoint& endpoint, const std::string_view error_message)
+        -> void;
+
+   private:
+    std::vector<iovec> _iovecs;
+    std::vector<const sockaddr_in*> _addrs;
+    std::vector<mmsghdr> _headers;
+    std::vector<std::vector<std::uint8_t>> _owned_headers;
+  };
 
-template <typename... Data, class>
-inline auto PerfectLink::_prepare_message(
-    const MessageIdType seq_nr,
-    const bool is_ack,
-    const std::optional<MessageData> metadata,
-    Data... datas) const
-    -> std::tuple<std::array<uint8_t, MAX_MESSAGE_SIZE>, std::size_t> {
-  auto metadata_value = metadata.value_or(std::make_tuple(nullptr, 0));
-
-  const auto message_size = 1 + sizeof(MessageIdType) + sizeof(ProcessIdType) +
-                            std::get<1>(metadata_value) +
-                            sizeof(MessageSizeType) +
-                            (std::get<1>(datas) + ... + 0) +
-                            (sizeof...(Data) * sizeof(MessageSizeType));
-  if (message_size > MAX_MESSAGE_SIZE) {
-    throw std::runtime_error("Message is too large");
+  /// @brief An entry of the retransmission min-heap. Entries are not removed
+  /// when a message is acknowledged or rescheduled, they are skipped once they
+  /// are popped and no longer match the pending message.
+  struct RetransmitTimer {
+    RetransmitTimer(const Clock::time_point deadline,
+                    const std::uint64_t peer_key,
+                    const MessageIdType seq_nr)
+        : deadline(deadline), peer_key(peer_key), seq_nr(seq_nr) {}
+    Clock::time_point deadline;
+    std::uint64_t peer_key;
+    MessageIdType seq_nr;
+
+    friend auto operator<(RetransmitTimer const& left,
+                          RetransmitTimer const& right) -> bool {
+      return left.deadline < right.deadline;
+    }
+  };
+
+  /// @brief Buffers of the receiving side of a shard, only used by the thread
+  /// running its reactor.
+  struct Receiver {
+    Receiver();
+    std::vector<std::array<std::uint8_t, MAX_MESSAGE_SIZE>> messages;
+    std::array<sockaddr_in, RECV_BATCH_SIZE> sender_addrs;
+    std::array<iovec, RECV_BATCH_SIZE> iovecs;
+    std::array<mmsghdr, RECV_BATCH_SIZE> headers;
+    /// @brief One cumulative ACK per source that sent something in a received
+    /// batch, flushed together at the end of the batch.
+    std::array<std::array<std::uint8_t, ACK_MESSAGE_SIZE>, RECV_BATCH_SIZE>
+        acks;
+    std::array<iovec, RECV_BATCH_SIZE> ack_iovecs;
+    std::array<mmsghdr, RECV_BATCH_SIZE> ack_headers;
+    std::vector<ProcessIdType> to_ack;
+    std::vector<Slice<std::uint8_t>> data_buffer;
+    /// @brief `_address_key`s of the peers whose window was opened by ACKs
+    /// of a received batch, filled together at the end of the batch.
+    std::vector<std::uint64_t> opened;
+  };
+
+  /// @brief Sending state of the peers whose `_address_key` falls into this
+  /// shard, and the endpoint whose receiving thread takes care of their
+  /// retransmissions. Every shard has its own lock, so sends to and ACKs from
+  /// peers of different shards do not contend.
+  struct Shard {
+    /// @brief Bound endpoint. None if no bind was performed.
+    std::unique_ptr<Endpoint> endpoint;
+    std::mutex mutex;
+    /// @brief Buffers of pending messages. Guarded by `mutex`, declared before
+    /// `peers` so that it outlives their buffers.
+    PacketPool pool;
+    /// @brief Buffers of fragmented messages received at the endpoint. Only
+    /// used by its receiving thread.
+    PacketPool reassembly_pool;
+    std::unordered_map<std::uint64_t, Peer> peers;
+    /// @brief When the oldest non-empty outbox has to be flushed. None if all
+    /// outboxes are empty.
+    std::optional<Clock::time_point> outbox_deadline;
+    /// @brief Retransmission deadlines of all pending messages, min heap.
+    MinHeap<RetransmitTimer> retransmit_timers;
+    /// @brief The reactor serving the shard. None until it is served.
+    Reactor* reactor = nullptr;
+    /// @brief Expires at the earliest retransmission or outbox deadline.
+    Reactor::Timer timer = 0;
+    /// @brief Deadline the timer is armed with, max if it is not armed.
+    Clock::time_point armed = Clock::time_point::max();
+    std::unique_ptr<Receiver> receiver;
+  };
+
+  /// @brief Messages this link sent to its own address. They skip the
+  /// endpoint and are delivered by the reactor of the first shard once its
+  /// timer expires, without sequence numbers or ACKs.
+  struct Loopback {
+    std::mutex mutex;
+    /// @brief Buffers of the queued bodies. Guarded by `mutex`, declared
+    /// before the queues so that it outlives their buffers.
+    PacketPool pool;
+    /// @brief Encoded bodies waiting to be delivered. Guarded by `mutex`.
+    std::vector<PacketPool::Buffer> queued;
+    /// @brief Bodies being delivered, swapped with `queued`. Only used by the
+    /// delivering thread, kept to reuse its allocation.
+    std::vector<PacketPool::Buffer> delivering;
+  };
+
+  /// @brief Amount of sequence numbers above the watermark of a source that
+  /// can be delivered out of order.
+  static constexpr MessageIdType DELIVERED_WINDOW = 1024;
+  static_assert(DELIVERED_WINDOW >= SACK_WINDOW);
+
+  /// @brief A fragmented message of which only some fragments were received.
+  struct Reassembly {
+    PacketPool::Buffer body;
+    /// @brief Amount of received bytes of the body, the end of the furthest
+    /// fragment.
+    std::size_t size = 0;
+    FragmentIndexType count = 0;
+    FragmentIndexType missing = 0;
+  };
+
+  /// @brief Receiving state of a single source: which of its messages were
+  /// delivered and where to send its ACKs. Only accessed by the receiving
+  /// thread, so it needs no lock.
+  struct Source {
+    /// @brief All messages up to and including this one were delivered. It is
+    /// also the cumulative ACK of the source.
+    MessageIdType watermark = 0;
+    /// @brief Ring of delivered messages above the watermark. The message
+    /// `seq_nr` is stored at bit `seq_nr % DELIVERED_WINDOW`, which is valid
+    /// for `watermark < seq_nr <= watermark + DELIVERED_WINDOW`.
+    std::bitset<DELIVERED_WINDOW> above_watermark;
+    /// @brief Whether an ACK should be sent at the end of the current batch.
+    bool dirty = false;
+    sockaddr_in addr;
+    /// @brief Fragmented messages being received, by the sequence number of
+    /// their first fragment. A received fragment is delivered and acknowledged
+    /// like any other message, the message itself is delivered once all of
+    /// them arrived.
+    std::unordered_map<MessageIdType, Reassembly> reassemblies;
+
+    /// @brief Whether a message is too far ahead of the watermark to be
+    /// recorded. Such messages are dropped without an ACK, the sender will
+    /// retransmit them.
+    inline auto is_beyond_window(const MessageIdType seq_nr) const -> bool {
+      return seq_nr > watermark + DELIVERED_WINDOW;
+    }
+
+    /// @brief Whether a message within the window was delivered.
+    inline auto is_delivered(const MessageIdType seq_nr) const -> bool {
+      return seq_nr <= watermark ||
+             above_watermark[seq_nr % DELIVERED_WINDOW];
+    }
+
+    /// @brief Marks a message within the window as delivered and advances the
+    /// watermark over the contiguous delivered prefix.
+    auto mark_delivered(const MessageIdType seq_nr) -> void;
+
+    /// @brief Treats all messages below `seq_nr` as delivered, the ones above
+    /// it that were delivered stay so.
+    auto skip_to(const MessageIdType seq_nr) -> void;
+
+    /// @brief Bit j is set if `watermark + 1 + j` has been delivered.
+    auto sack() const -> SackType;
+  };
+
+  /// @brief Id of this process.
+  const ProcessIdType _id;
+  const LinkOptions _options;
+  const std::shared_ptr<Transport> _transport;
+
+  /// @brief Whether a bind was performed.
+  bool _is_bound = false;
+  /// @brief `_address_key` of the bound address, messages to it are looped
+  /// back.
+  std::uint64_t _self_key = 0;
+  Loopback _loopback;
+  /// @brief Receives the datagrams to the multicast group, served by the
+  /// reactor of the only shard. None if no group is configured.
+  std::unique_ptr<Endpoint> _group_endpoint;
+  /// @brief Destinations this link has sent to, sharded by `_address_key`.
+  /// There is one shard per receive shard.
+  std::vector<Shard> _shards;
+  /// @brief Receiving state of every source process, indexed by
+  /// `process_id - 1`. A source is only accessed by the receiving thread of the
+  /// endpoint its datagrams arrive at. Declared after `_shards`, so that its
+  /// reassembly buffers are released before their pools.
+  std::vector<Source> _sources;
+  /// @brief Hash table of the `SentState`s in the state file, probed
+  /// linearly from `_address_key % _sent_capacity`. Null without a state file.
+  SentState* _sent_states = nullptr;
+  std::size_t _sent_capacity = 0;
+  /// @brief The `AckedState` of every source in the state file. Null without
+  /// a state file.
+  AckedState* _acked_states = nullptr;
+  /// @brief Called for every delivered batch, set once the link is served.
+  ListenBatchCallback _callback;
+  bool _is_served = false;
+  /// @brief Guards `_reactors` and `_stopped`.
+  std::mutex _reactors_mutex;
+  /// @brief Reactors of the shards, created by `listen_batch`.
+  std::vector<std::unique_ptr<Reactor>> _reactors;
+  /// @brief Whether `stop` was called.
+  bool _stopped = false;
+
+  /// @brief Size of the body of a message with the given metadata and the
+  /// first `count` payloads.
+  static auto _body_size(const std::size_t metadata_size,
+                         const Payloads datas,
+                         const std::size_t count) -> std::size_t;
+
+  /// @brief Encodes a single length prefixed payload into `message`.
+  /// @return Amount of written bytes.
+  static auto _encode_data(std::uint8_t* message,
+                           const Slice<std::uint8_t> data) -> std::size_t;
+
+  /// @brief Encodes the body of a message with the first `count` payloads into
+  /// `body`, which has to hold at least `_body_size` bytes.
+  auto _encode_body(std::uint8_t* body,
+                    const Slice<std::uint8_t> metadata,
+                    const Payloads datas,
+                    const std::size_t count) const -> void;
+
+  /// @brief Given a body of a message decodes it to data. `data_buffer` will
+  /// contain pointers into `body`.
+  /// @return metadata. None if a length reaches past the body, the message
+  /// is then dropped.
+  static inline auto _decode_body(const std::uint8_t* body,
+                                  const std::size_t body_size,
+                                  std::vector<Slice<uint8_t>>& data_buffer)
+      -> std::optional<Slice<std::uint8_t>>;
+
+  /// @brief Splits an encoded body into fragments, buffers are taken from the
+  /// pool of the shard.
+  auto _fragment(Shard& shard, const PacketPool::Buffer& body) const
+      -> std::vector<PacketPool::Buffer>;
+
+  /// @brief Capacity of the body of a message of `count` fragments.
+  static inline auto _reassembly_size(const FragmentIndexType count)
+      -> std::size_t {
+    return std::min(count * FRAGMENT_SIZE, MAX_FRAGMENTED_SIZE);
   }
 
-  // message = [is_ack, ...seq_nr, ...process_id,
-  //            ...metadata_length, ...metadata,
-  //            ...[data_length, ...data]]
-  std::array<uint8_t, MAX_MESSAGE_SIZE> message;
-  message[0] = static_cast<uint8_t>(is_ack);
-  for (size_t i = 0; i < sizeof(MessageIdType); i++) {
-    message[i + 1] = (seq_nr >> (8 * i)) & 0xff;
+  /// @brief Whether a fragment received from the network fits into the
+  /// message it belongs to. Checked before it is delivered.
+  static auto _is_valid_fragment(const Source& source,
+                                 const MessageIdType seq_nr,
+                                 const std::uint8_t* fragment,
+                                 const std::size_t fragment_size) -> bool;
+
+  /// @brief Stores a newly received fragment of a source. The fragment has to
+  /// be valid, see `_is_valid_fragment`.
+  /// @return The body of the message once all its fragments were received.
+  auto _reassemble(Shard& shard,
+                   Source& source,
+                   const MessageIdType seq_nr,
+                   const std::uint8_t* fragment,
+                   const std::size_t fragment_size)
+      -> std::optional<PacketPool::Buffer>;
+
+  /// @brief Key identifying a peer by its address.
+  static inline auto _address_key(const sockaddr_in& addr) -> std::uint64_t {
+    return (static_cast<std::uint64_t>(addr.sin_addr.s_addr) << 16) |
+           addr.sin_port;
   }
-  message[1 + sizeof(MessageIdType)] = _id;
-  auto offset = 1 + sizeof(MessageIdType) + sizeof(ProcessIdType);
 
-  auto& [data, length] = metadata_value;
-  for (size_t i = 0; i < sizeof(MessageSizeType); i++) {
-    message[offset++] = (length >> (8 * i)) & 0xff;
+  static inline auto _address(const std::uint64_t peer_key) -> sockaddr_in {
+    return make_address(static_cast<in_addr_t>(peer_key >> 16),
+                        static_cast<in_port_t>(peer_key & 0xffff));
   }
-  std::memcpy(message.data() + offset, data, length);
-  offset += length;
-
-  if constexpr (sizeof...(Data) > 0) {
-    for (const auto& [data, length] : {datas...}) {
-      for (size_t i = 0; i < sizeof(MessageSizeType); i++) {
-        message[offset++] = (length >> (8 * i)) & 0xff;
-      }
-      std::memcpy(message.data() + offset, data, length);
-      offset += length;
-    }
+
+  /// @brief Shard of the peer with the given `_address_key`.
+  inline auto _shard(const std::uint64_t peer_key) -> Shard& {
+    return _shards[peer_key % _shards.size()];
   }
 
-  return {message, message_size};
-}
+  /// @brief The sending state of a destination, created on first use. A
+  /// destination a previous run sent to first gets a `RESTART_FLAG` message.
+  /// Has to be called with the lock of the shard held.
+  auto _peer(Shard& shard,
+             const std::uint64_t peer_key,
+             const sockaddr_in& addr) -> Peer&;
+
+  /// @brief The record of a destination in the state file, claiming a free
+  /// one if it has none. Null if the table is full.
+  auto _sent_state(const std::uint64_t peer_key) -> SentState*;
+
+  /// @brief Restores what a previous run of this link left in the state file
+  /// and announces the restart to its peers. Called once bound.
+  auto _restore() -> void;
+
+  /// @brief Retransmits all pending messages of the peer at `addr` right
+  /// away with a fresh RTO, its timeouts backed off while it was gone.
+  auto _expedite(const sockaddr_in& addr) -> void;
+
+  /// @brief Encodes an ACK of a source into `ack`, which has to hold
+  /// `ACK_MESSAGE_SIZE` bytes.
+  auto _encode_ack(std::uint8_t* ack,
+                   const MessageIdType watermark,
+                   const SackType sack) const -> void;
+
+  /// @brief Registers the endpoint and timer of a shard with a reactor.
+  auto _attach(Shard& shard, Reactor& reactor) -> void;
+
+  /// @brief Receives, delivers and acknowledges messages arriving at an
+  /// endpoint served by a shard, either its own or the one of the multicast
+  /// group.
+  auto _on_readable(Shard& shard, Endpoint& endpoint) -> void;
+
+  /// @brief Finds the entry of this link in the table of a datagram to the
+  /// multicast group.
+  /// @return Our seq_nr and the offset of the body. None if the datagram is
+  /// not meant for us.
+  auto _find_multicast_entry(const std::uint8_t* message,
+                             const std::size_t size) const
+      -> std::optional<std::tuple<MessageIdType, std::size_t>>;
+
+  /// @brief Flushes overdue outboxes and retransmits overdue messages of a
+  /// shard, then arms its timer for the next deadline.
+  auto _on_timer(Shard& shard) -> void;
+
+  /// @brief Queues a message to this link itself and makes sure the reactor
+  /// of the first shard wakes up to deliver it.
+  auto _loop_back(const Slice<std::uint8_t> metadata,
+                  const Payloads datas,
+                  const std::size_t count,
+                  const std::size_t body_size) -> void;
+
+  /// @brief Delivers the looped back messages, called by the reactor of the
+  /// first shard.
+  auto _deliver_looped_back(Shard& shard) -> void;
+
+  /// @brief Makes sure that the timer of a shard expires no later than the
+  /// deadline. Has to be called with the lock of the shard held.
+  auto _schedule(Shard& shard, const Clock::time_point deadline) -> void;
+
+  /// @brief Arms the timer of a shard for its earliest deadline. Has to be
+  /// called with the lock of the shard held.
+  auto _arm_next(Shard& shard) -> void;
+
+  /// @brief Drops pending messages of the peer at `addr` that are covered by a
+  /// cumulative ACK and its SACK bitmap.
+  /// @return Whether the window of the peer grew, its queued messages are
+  /// left for `_fill_opened`.
+  auto _handle_ack(const sockaddr_in& addr,
+                   const MessageIdType cumulative,
+                   const SackType sack) -> bool;
+
+  /// @brief Transmits what is queued for the peers whose window was opened by
+  /// ACKs. `keys` are their `_address_key`s, each at most once.
+  auto _fill_opened(const std::vector<std::uint64_t>& keys) -> void;
+
+  /// @brief Appends the first `count` payloads to the outbox of a peer. The
+  /// outbox is flushed first if they do not fit anymore.
+  auto _coalesce(Shard& shard,
+                 Peer& peer,
+                 const std::uint64_t peer_key,
+                 const Payloads datas,
+                 const std::size_t count,
+                 const Clock::time_point now,
+                 Datagrams& datagrams) -> void;
+
+  /// @brief Turns the outbox of a peer into a pending message.
+  auto _flush_outbox(Shard& shard,
+                     Peer& peer,
+                     const std::uint64_t peer_key,
+                     const Clock::time_point now,
+                     Datagrams& datagrams) -> void;
+
+  /// @brief Flushes all outboxes of a shard if the deadline of the oldest one
+  /// has passed.
+  auto _flush_overdue_outboxes(Shard& shard) -> void;
+
+  /// @brief Transmits the first message of a peer waiting for its window:
+  /// records it as sent and schedules its retransmission.
+  /// @return The transmitted message.
+  auto _transmit(Shard& shard,
+                 Peer& peer,
+                 const std::uint64_t peer_key,
+                 const Clock::time_point now) -> PendingMessage&;
+
+  /// @brief Transmits the next message of many peers, the same for all of
+  /// them, with a single datagram to the multicast group.
+  auto _multicast(Shard& shard,
+                  const std::vector<std::pair<std::uint64_t, Peer*>>& peers,
+                  const Clock::time_point now,
+                  Datagrams& datagrams) -> void;
+
+  /// @brief Transmits queued messages of many peers of a shard as long as
+  /// their windows allow, in rounds of one message per peer. With a multicast
+  /// group, peers whose next message is the same get it with a single
+  /// datagram to the group. `peers` is sorted and deduplicated.
+  auto _fill_windows(Shard& shard,
+                     std::vector<std::pair<std::uint64_t, Peer*>>& peers,
+                     const Clock::time_point now,
+                     Datagrams& datagrams) -> void;
+
+  /// @brief Transmits queued messages of a peer as long as its window allows.
+  auto _fill_window(Shard& shard,
+                    Peer& peer,
+                    const std::uint64_t peer_key,
+                    const Clock::time_point now,
+                    Datagrams& datagrams) -> void;
+
+  /// @brief Resends pending messages of a shard whose retransmission deadline
+  /// has passed and backs off the RTO of their peers.
+  auto _resend_overdue(Shard& shard) -> void;
+
+  /// @brief Sends all prepared datagrams, retrying with the rest of the batch
+  /// if `sendmmsg` sent only a part of it. Failed datagrams are skipped, they
+  /// will be resent if they were not ACKs.
+  static auto _send_all(Endpoint& endpoint,
+                        mmsghdr* headers,
+                        const std::size_t count,
+                        const std::string_view error_message) -> void;
+};
 
 template <typename... Data, class, class>
 auto PerfectLink::send(const in_addr_t host,
                        const in_port_t port,
                        const std::optional<MessageData> metadata,
                        Data... datas) -> void {
-  if (!_sock_fd.has_value()) {
-    throw std::runtime_error("Cannot send if not bound");
-  }
-  auto sock_fd = _sock_fd.value();
-
-  auto [message, message_size] =
-      _prepare_message(_seq_nr, false, metadata, datas...);
-
-  sockaddr_in addr;
-  std::memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = host;
-  addr.sin_port = port;
+  send_batch({make_address(host, port)}, metadata, datas...);
+}
 
-  {
-    std::unique_lock lock(_pending_for_ack_mutex);
-    _pending_for_ack.try_emplace(_seq_nr, addr, message, message_size);
-    _seq_nr += 1;
+template <typename... Data, class, class>
+auto PerfectLink::send_batch(const std::vector<sockaddr_in>& addrs,
+                             const std::optional<MessageData> metadata,
+                             Data... datas) -> void {
+  const std::array<Slice<std::uint8_t>, sizeof...(Data)> payloads = {
+      Slice<std::uint8_t>(std::get<0>(datas), std::get<1>(datas))...};
+  const Payloads all(payloads.data(), payloads.size());
+  const auto [metadata_data, metadata_size] =
+      metadata.value_or(std::make_tuple(nullptr, 0));
+
+  // a compile time known message is sent whole or not at all
+  if (packable(metadata_size, all) < payloads.size()) {
+    throw std::runtime_error("Message is too large");
   }
-
-  perror_check<ssize_t>(
-      [&, &message = message, &message_size = message_size]() noexcept {
-        return sendto(sock_fd, message.data(), message_size, MSG_NOSIGNAL,
-                      reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
-      },
-      [](auto res) noexcept { return res < 0 && errno != EPIPE; },
-      "failed to send message");
+  send_batch(addrs, Slice<std::uint8_t>(metadata_data, metadata_size), all);
 }
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// @brief A set of process ids, one bit per process. The first 64 ids are kept
+/// inline, so groups of up to 64 processes never allocate. Bits of larger ids
+/// are allocated once the first of them is inserted.
+class ProcessSet {
+ public:
+  /// @brief Adds a process, ids start at 1.
+  /// @return Whether it was not yet in the set.
+  inline auto insert(const std::size_t process_id) -> bool {
+    const auto index = process_id - 1;
+    auto& word = _word(index / WORD_BITS);
+    const auto bit = std::uint64_t(1) << (index % WORD_BITS);
+    if (word & bit) {
+      return false;
+    }
+    word |= bit;
+    _size += 1;
+    return true;
+  }
+
+  inline auto contains(const std::size_t process_id) const -> bool {
+    const auto index = process_id - 1;
+    const auto word_index = index / WORD_BITS;
+    if (word_index > _rest.size()) {
+      return false;
+    }
+    const auto word = word_index == 0 ? _first : _rest[word_index - 1];
+    return (word >> (index % WORD_BITS)) & 1;
+  }
+
+  /// @brief Amount of processes in the set.
+  inline auto size() const -> std::size_t { return _size; }
+
+ private:
+  static constexpr std::size_t WORD_BITS = 64;
+
+  inline auto _word(const std::size_t word_index) -> std::uint64_t& {
+    if (word_index == 0) {
+      return _first;
+    }
+    if (word_index > _rest.size()) {
+      _rest.resize(word_index, 0);
+    }
+    return _rest[word_index - 1];
+  }
+
+  /// @brief Bits of the ids 1 to 64.
+  std::uint64_t _first = 0;
+  /// @brief Bits of the ids from 65 on, 64 per word.
+  std::vector<std::uint64_t> _rest;
+  std::size_t _size = 0;
+};
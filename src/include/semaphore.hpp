@@ -1,18 +1,64 @@
 #pragma once
 
-#include <condition_variable>
-#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 
-struct Semaphore {
+/// @brief A counting semaphore handing out credits. As long as nobody has to
+/// wait, acquiring and releasing are a single atomic operation on the count.
+/// Threads lacking credits sleep on a futex of the count, and only then do
+/// releases enter the kernel to wake them.
+class Semaphore {
  public:
-  Semaphore(std::size_t count);
+  explicit Semaphore(const std::size_t count);
 
-  auto release() -> void;
+  Semaphore(const Semaphore&) = delete;
+  Semaphore& operator=(const Semaphore&) = delete;
 
-  auto acquire() -> void;
+  /// @brief Hands back credits, for example those of a whole batch at once.
+  /// Thread safe.
+  inline auto release(const std::size_t count = 1) -> void {
+    // pairs with the waiter announcing itself before reading the count: either
+    // it sees the new credits, or this sees the waiter
+    _count.fetch_add(static_cast<std::uint32_t>(count));
+    if (_waiters.load() > 0) {
+      _wake();
+    }
+  }
+
+  /// @brief Takes credits, waiting until enough of them are available. Thread
+  /// safe.
+  inline auto acquire(const std::size_t count = 1) -> void {
+    if (!try_acquire(count)) {
+      _wait(static_cast<std::uint32_t>(count));
+    }
+  }
+
+  /// @brief Takes credits if enough of them are available. Thread safe.
+  /// @return False if nothing was taken.
+  inline auto try_acquire(const std::size_t count = 1) -> bool {
+    const auto wanted = static_cast<std::uint32_t>(count);
+    auto available = _count.load(std::memory_order_relaxed);
+    while (available >= wanted) {
+      if (_count.compare_exchange_weak(available, available - wanted,
+                                       std::memory_order_acquire,
+                                       std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+    return false;
+  }
 
  private:
-  std::mutex _mutex;
-  std::condition_variable _cv;
-  std::size_t _count;
+  /// @brief Slow path of `acquire`, sleeps until enough credits are available.
+  auto _wait(const std::uint32_t wanted) -> void;
+
+  /// @brief Wakes all waiting threads, each of them may want a different
+  /// amount of credits.
+  auto _wake() -> void;
+
+  /// @brief Available credits, the futex waiters sleep on.
+  std::atomic<std::uint32_t> _count;
+  /// @brief Amount of threads in the slow path of `acquire`.
+  std::atomic<std::uint32_t> _waiters = 0;
 };
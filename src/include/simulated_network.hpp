@@ -0,0 +1,195 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "transport.hpp"
+
+/// @brief What every datagram of a `SimulatedNetwork` goes through.
+struct NetworkConditions {
+  /// @brief Probability that a datagram is lost.
+  double loss = 0;
+  /// @brief Time every datagram takes to arrive.
+  std::chrono::microseconds delay = std::chrono::microseconds(100);
+  /// @brief Upper bound of a uniformly distributed extra delay of every
+  /// datagram. Datagrams sent closer to each other than this can be reordered.
+  std::chrono::microseconds jitter = std::chrono::microseconds::zero();
+  /// @brief Seed of the fates of all datagrams.
+  std::uint64_t seed = 1;
+};
+
+/// @brief Endpoints of many links within a single process, exchanging
+/// datagrams on a virtual clock. Nothing waits for real: once every running
+/// reactor waits for events, time jumps to the next arrival or timer. A whole
+/// group of processes thus runs as fast as the CPU allows, no matter how long
+/// its delays and timeouts are. Threads that send without running a reactor,
+/// like the one proposing in an application, are assumed to take no time.
+///
+/// Every ordered pair of addresses has its own random generator, so the fate
+/// of the n-th datagram from one address to another only depends on the seed.
+/// Runs see the same losses and delays as long as every link sends its
+/// datagrams in the same order. A datagram to a multicast group is copied to
+/// every member, each copy with the fate of a datagram to the unicast
+/// endpoint of its member.
+class SimulatedNetwork : public Transport {
+ public:
+  /// @brief Counters of all datagrams so far. A datagram to a multicast group
+  /// is sent once, but lost and received once per member.
+  struct Stats {
+    std::uint64_t sent;
+    std::uint64_t lost;
+    /// @brief Datagrams to an address without an endpoint, or to a group
+    /// without members.
+    std::uint64_t undeliverable;
+    std::uint64_t received;
+  };
+
+  explicit SimulatedNetwork(const NetworkConditions conditions = {});
+
+  /// @brief All endpoints and reactors have to be destroyed first.
+  ~SimulatedNetwork() override = default;
+
+  SimulatedNetwork(const SimulatedNetwork&) = delete;
+  SimulatedNetwork& operator=(const SimulatedNetwork&) = delete;
+
+  /// @brief Thread safe.
+  auto open(const in_addr_t host, const in_port_t port, const bool shared)
+      -> std::unique_ptr<Endpoint> override;
+
+  /// @brief Thread safe.
+  auto open_group(const sockaddr_in& group, const sockaddr_in& member)
+      -> std::unique_ptr<Endpoint> override;
+
+  /// @brief Thread safe.
+  auto reactor() -> std::unique_ptr<Reactor> override;
+
+  /// @brief The virtual time, starting at the epoch of the clock.
+  inline auto now() const -> Clock::time_point override {
+    return Clock::time_point(Clock::duration(_now.load()));
+  }
+
+  /// @brief Thread safe.
+  auto stats() const -> Stats;
+
+ private:
+  class SimulatedEndpoint;
+  class SimulatedReactor;
+
+  /// @brief How long the last reactor to wait gives threads outside of the
+  /// network, for real, to send something before time jumps to a timer.
+  /// Without it they would see retransmissions fire long before they got to
+  /// run.
+  static constexpr std::chrono::microseconds IDLE_GRACE{100};
+
+  struct Datagram {
+    sockaddr_in from;
+    std::vector<std::uint8_t> data;
+  };
+
+  /// @brief A datagram on its way, ordered by arrival and then by sending
+  /// order.
+  using ArrivalKey = std::pair<Clock::time_point, std::uint64_t>;
+  struct InFlight {
+    sockaddr_in to;
+    Datagram datagram;
+    /// @brief For a copy of a datagram to a multicast group, the address key
+    /// of the unicast endpoint of the member it is for.
+    std::uint64_t member = 0;
+  };
+
+  static inline auto _address_key(const sockaddr_in& addr) -> std::uint64_t {
+    return (static_cast<std::uint64_t>(addr.sin_addr.s_addr) << 16) |
+           addr.sin_port;
+  }
+
+  auto _send(SimulatedEndpoint& endpoint, mmsghdr* headers, std::size_t count)
+      -> int;
+
+  auto _receive(SimulatedEndpoint& endpoint,
+                mmsghdr* headers,
+                const std::size_t count) -> int;
+
+  auto _close(SimulatedEndpoint& endpoint) -> void;
+
+  /// @brief Puts a datagram on its way, unless its fate is to be lost. Has to
+  /// be called with `_mutex` held.
+  auto _dispatch(const std::uint64_t from_key,
+                 const std::uint64_t to_key,
+                 const Clock::time_point sent_at,
+                 InFlight in_flight) -> void;
+
+  /// @brief The endpoint an arriving datagram goes to. None if there is no
+  /// such endpoint. Has to be called with `_mutex` held.
+  auto _recipient(const InFlight& in_flight) -> SimulatedEndpoint*;
+
+  auto _watch(SimulatedReactor& reactor,
+              SimulatedEndpoint& endpoint,
+              Reactor::Handler handler) -> void;
+
+  auto _add_timer(SimulatedReactor& reactor, Reactor::Handler handler)
+      -> Reactor::Timer;
+
+  auto _arm(SimulatedReactor& reactor,
+            const Reactor::Timer timer,
+            const Clock::time_point deadline) -> void;
+
+  auto _run(SimulatedReactor& reactor) -> void;
+
+  auto _stop(SimulatedReactor& reactor) -> void;
+
+  auto _destroy(SimulatedReactor& reactor) -> void;
+
+  /// @brief Whether a reactor has handlers to call. Has to be called with
+  /// `_mutex` held.
+  auto _is_ready(const SimulatedReactor& reactor) const -> bool;
+
+  /// @brief Moves the datagrams that arrived by now to their endpoints. Has
+  /// to be called with `_mutex` held.
+  auto _deliver_due() -> void;
+
+  /// @brief Lets a waiting reactor run, it counts as busy from now on. Has to
+  /// be called with `_mutex` held.
+  auto _wake(SimulatedReactor& reactor) -> void;
+
+  /// @brief Moves time to the next event once all reactors wait. Has to be
+  /// called with `_mutex` held by `lock`.
+  /// @return False if there is no event to move to.
+  auto _advance(std::unique_lock<std::mutex>& lock) -> bool;
+
+  const NetworkConditions _conditions;
+
+  mutable std::mutex _mutex;
+  /// @brief Wakes reactors that got events, and the waiting ones once
+  /// something was sent or armed.
+  std::condition_variable _cv;
+  /// @brief Virtual time since the epoch, written with `_mutex` held.
+  std::atomic<Clock::rep> _now = 0;
+
+  std::map<ArrivalKey, InFlight> _in_flight;
+  /// @brief Sending order of the next datagram.
+  std::uint64_t _order = 0;
+  /// @brief Open endpoints by their address key.
+  std::unordered_map<std::uint64_t, std::vector<SimulatedEndpoint*>> _bound;
+  /// @brief Endpoints of the members of multicast groups by the address key
+  /// of the group.
+  std::unordered_map<std::uint64_t, std::vector<SimulatedEndpoint*>> _groups;
+  std::vector<SimulatedReactor*> _reactors;
+  /// @brief Amount of running reactors that are not waiting for events. Time
+  /// only moves if it is zero.
+  std::size_t _busy = 0;
+  /// @brief Incremented on every send and arming, tells a grace period that
+  /// something happened.
+  std::uint64_t _generation = 0;
+  /// @brief Random generators by the address keys of sender and receiver.
+  std::map<std::pair<std::uint64_t, std::uint64_t>, std::mt19937_64> _fates;
+  Stats _stats{};
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+/// @brief A file mapped into memory that keeps the state of a process across
+/// restarts. Layers take named regions of records out of it and update them in
+/// place, so a record is current the moment it is written: a crashed process
+/// loses nothing it wrote, and the kernel writes the dirty pages back to the
+/// file in the background. A restarted process gets its regions back by name.
+/// Meant to be used by a single process at a time.
+class StateFile {
+ public:
+  /// @brief Maps the file, creating it if it does not exist.
+  explicit StateFile(const std::string& path);
+
+  /// @brief Unmaps and closes the file, the records stay in it.
+  ~StateFile();
+
+  StateFile(const StateFile&) = delete;
+  StateFile& operator=(const StateFile&) = delete;
+
+  /// @brief Whether the file holds the state of a previous run.
+  inline auto is_restored() const -> bool { return _is_restored; }
+
+  /// @brief Records of a region, restored from a previous run or constructed
+  /// fresh if the region is new. They stay valid as long as the file. Thread
+  /// safe.
+  /// @throws std::runtime_error If the region was stored with another amount
+  /// of records, the file then belongs to another configuration.
+  template <typename T>
+  auto records(const std::string_view name, const std::size_t count) -> T* {
+    static_assert(std::is_standard_layout_v<T>,
+                  "Records are laid out in the file as they are in memory");
+    const auto [data, created] = _region(name, sizeof(T) * count, alignof(T));
+    const auto records = reinterpret_cast<T*>(data);
+    if (created) {
+      for (std::size_t i = 0; i < count; i++) {
+        new (records + i) T();
+      }
+    }
+    return records;
+  }
+
+ private:
+  /// @brief Size of the mapping. The file is sparse, only pages that were
+  /// written take space.
+  static constexpr std::size_t CAPACITY = 16 << 20;
+  static constexpr std::size_t MAX_REGIONS = 16;
+  /// @brief Regions start at multiples of this, so that records of different
+  /// regions do not share cache lines.
+  static constexpr std::size_t REGION_ALIGNMENT = 64;
+  static constexpr std::uint64_t MAGIC = 0x31'54'41'54'53'5f'41'44;
+
+  struct Region {
+    char name[24];
+    std::uint64_t offset;
+    std::uint64_t size;
+  };
+
+  struct Header {
+    /// @brief Written last when the file is created.
+    std::uint64_t magic;
+    /// @brief Offset past the last region.
+    std::uint64_t end;
+    std::uint64_t region_count;
+    Region regions[MAX_REGIONS];
+  };
+
+  /// @return Start of the region and whether it was created.
+  auto _region(const std::string_view name,
+               const std::size_t size,
+               const std::size_t alignment) -> std::tuple<std::uint8_t*, bool>;
+
+  inline auto _header() -> Header& { return *reinterpret_cast<Header*>(_data); }
+
+  int _fd;
+  std::uint8_t* _data;
+  bool _is_restored;
+  std::mutex _mutex;
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+/// @brief Whether a host in network byte order is an IPv4 multicast group.
+inline auto is_multicast(const in_addr_t host) -> bool {
+  return (ntohl(host) & 0xf0000000) == 0xe0000000;
+}
+
+/// @brief A datagram endpoint bound to an address. Follows the conventions of
+/// `sendmmsg` and `recvmmsg`, so that a socket can be used as it is.
+class Endpoint {
+ public:
+  virtual ~Endpoint() = default;
+
+  /// @brief Sends datagrams, every header names its destination.
+  /// @return Amount of sent datagrams, or -1 with `errno` set.
+  virtual auto send(mmsghdr* headers, const std::size_t count) -> int = 0;
+
+  /// @brief Takes the datagrams that arrived so far without waiting. Fills in
+  /// the length and the sender address of every datagram.
+  /// @return Amount of received datagrams, or -1 with `errno` set. `EAGAIN` if
+  /// nothing arrived.
+  virtual auto receive(mmsghdr* headers, const std::size_t count) -> int = 0;
+
+  /// @brief File descriptor that is readable whenever datagrams arrived.
+  /// Negative if the endpoint has none.
+  virtual auto fd() const -> int { return -1; }
+};
+
+/// @brief An event loop calling handlers when endpoints have datagrams and
+/// when timers expire. A single thread runs it, but it can serve the
+/// endpoints of many links.
+class Reactor {
+ public:
+  using Clock = std::chrono::steady_clock;
+  using Handler = std::function<auto()->void>;
+  using Timer = std::size_t;
+
+  virtual ~Reactor() = default;
+
+  /// @brief Calls the handler whenever the endpoint has datagrams to receive,
+  /// until the handler took all of them. The endpoint has to come from the
+  /// transport of this reactor and outlive it. Has to be called before `run`.
+  virtual auto watch(Endpoint& endpoint, Handler on_readable) -> void = 0;
+
+  /// @brief Adds an unarmed timer. Has to be called before `run`.
+  virtual auto add_timer(Handler on_expiry) -> Timer = 0;
+
+  /// @brief Arms a timer to expire once at the deadline, replacing the previous
+  /// deadline. `Clock::time_point::max()` disarms it. Thread safe.
+  virtual auto arm(const Timer timer, const Clock::time_point deadline)
+      -> void = 0;
+
+  /// @brief Calls handlers until `stop`.
+  virtual auto run() -> void = 0;
+
+  /// @brief Makes `run` return once the handler running now finished. Thread
+  /// safe.
+  virtual auto stop() -> void = 0;
+};
+
+/// @brief Creates the endpoints of links and the reactors serving them, and
+/// tells their time.
+class Transport {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  virtual ~Transport() = default;
+
+  /// @brief Opens an endpoint bound to a host and port.
+  /// @param shared Whether more endpoints may be bound to the same address.
+  /// Datagrams are spread over them by the sender address.
+  virtual auto open(const in_addr_t host,
+                    const in_port_t port,
+                    const bool shared) -> std::unique_ptr<Endpoint> = 0;
+
+  /// @brief Opens an endpoint receiving the datagrams sent to a multicast
+  /// group. Every member has its own endpoint, to send to the group any
+  /// endpoint can be used.
+  /// @param member Address of the unicast endpoint of the member, it joins on
+  /// the interface of its host.
+  virtual auto open_group(const sockaddr_in& group, const sockaddr_in& member)
+      -> std::unique_ptr<Endpoint> = 0;
+
+  /// @brief Creates a reactor for endpoints of this transport.
+  virtual auto reactor() -> std::unique_ptr<Reactor> = 0;
+
+  /// @brief Current time as seen by the endpoints, all deadlines of a link are
+  /// relative to it. Thread safe.
+  virtual auto now() const -> Clock::time_point = 0;
+};
+
+/// @brief UDP sockets on the wall clock, served by an `EpollReactor`.
+class SocketTransport : public Transport {
+ public:
+  auto open(const in_addr_t host, const in_port_t port, const bool shared)
+      -> std::unique_ptr<Endpoint> override;
+
+  auto open_group(const sockaddr_in& group, const sockaddr_in& member)
+      -> std::unique_ptr<Endpoint> override;
+
+  auto reactor() -> std::unique_ptr<Reactor> override;
+
+  inline auto now() const -> Clock::time_point override {
+    return Clock::now();
+  }
+};
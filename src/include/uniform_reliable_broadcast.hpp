@@ -2,13 +2,18 @@
 
 #include <netinet/in.h>
 #include <array>
-#include <bitset>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include "best_effort_broadcast.hpp"
+#include "codec.hpp"
+#include "metrics.hpp"
 #include "perfect_link.hpp"
+#include "process_set.hpp"
 #include "semaphore.hpp"
 
 /// Enforces 4 properties for broadcast communication:
@@ -20,9 +25,28 @@
 ///    eventually deliver m
 class UniformReliableBroadcast {
  public:
+  /// @brief How a process tells the others it has seen a message.
+  enum class RelayMode : std::uint8_t {
+    /// @brief Every process relays the whole message to all processes on
+    /// first receipt.
+    Payload = 0,
+    /// @brief Only the author sends the message to all processes. Every
+    /// process then tells all others it has seen the message with a small
+    /// SEEN signal. A process learning about a message it does not have asks
+    /// the signaling process with a WANT signal, only then is the message sent
+    /// again. Signals carry no metadata, so the link coalesces them per peer if
+    /// `LinkOptions::coalesce_delay` is set. Only then is this mode a win:
+    /// without coalescing every signal takes a datagram of its own and an ACK,
+    /// more packets than relaying the payloads, and it is slower than
+    /// `Payload`. `da_bench --coalesce` compares both.
+    Signals = 1,
+  };
+
   UniformReliableBroadcast(
       const PerfectLink::ProcessIdType id,
-      const BestEffortBroadcast::AvailableProcesses processes);
+      const BestEffortBroadcast::AvailableProcesses processes,
+      const LinkOptions options = {},
+      const RelayMode relay_mode = RelayMode::Payload);
 
   using ListenCallback =
       std::function<auto(PerfectLink::ProcessIdType process_id,
@@ -35,8 +59,8 @@ class UniformReliableBroadcast {
   auto bind(const in_addr_t host, const in_port_t port) -> void;
 
   /// @brief Starts listening to incoming broadcast messages. Sends ACKs for new
-  /// messages. Receives ACKs and resends messages with missing ACKs. Thread
-  /// safe.
+  /// messages. Receives ACKs and resends messages with missing ACKs. Has to be
+  /// called by a single thread.
   /// @param callback Function that will be called when a message is delivered.
   auto listen(ListenCallback callback) -> void;
 
@@ -50,14 +74,26 @@ class UniformReliableBroadcast {
                 (sizeof...(Data) <= PerfectLink::MAX_MESSAGE_COUNT_IN_PACKET)>>
   auto broadcast(Data... datas) -> void;
 
+  /// @brief Broadcasts a runtime sized list of payloads to all processes. As
+  /// many packets as needed are broadcast, every one of them taking the
+  /// payloads that fit. Thread safe.
+  auto broadcast(const PerfectLink::Payloads datas) -> void;
+
   /// @brief Id of this process.
   inline auto id() const -> PerfectLink::ProcessIdType { return _link.id(); }
 
+  /// @brief Amount of messages whose acknowledgements are kept. A message is
+  /// forgotten once every process relayed it, so this stays bounded as long as
+  /// all processes are correct. Thread safe.
+  auto pending_entries() -> std::size_t;
+
   static constexpr PerfectLink::MessageIdType INITIAL_SEQ_NR = 1;
 
  private:
-  /// @brief Amount of in-flight broadcast messages of this process.
-  static constexpr std::size_t MAX_IN_FLIGHT = 1;
+  /// @brief Amount of in-flight broadcast messages of this process. The link
+  /// does flow control per peer, so this only bounds the memory of messages
+  /// queued in the link.
+  static constexpr std::size_t MAX_IN_FLIGHT = 16;
 
   /// @brief A broadcasted message is identified by its source process and a
   /// message ID for that process. Together they fit in a 64bit integer.
@@ -66,14 +102,109 @@ class UniformReliableBroadcast {
                 sizeof(PerfectLink::ProcessIdType) +
                     sizeof(PerfectLink::MessageIdType));
 
+  enum class SignalKind : std::uint8_t {
+    /// @brief The sender has the message.
+    Seen = 0,
+    /// @brief The sender does not have the message, the receiver should send
+    /// it.
+    Want = 1,
+  };
+
+  /// @brief Layout of an encoded signal: its kind and the message ID.
+  using Signal = codec::Layout<std::uint8_t, MessageIdType>;
+  static constexpr std::size_t SIGNAL_SIZE = Signal::SIZE;
+
+  /// @brief Payloads of a message kept to answer WANT signals. Shared, so that
+  /// it can be delivered without holding the lock.
+  using StoredDatas = std::vector<std::vector<std::uint8_t>>;
+
+  /// @brief State of a message in the `RelayMode::Signals` mode.
+  struct SignaledMessage {
+    /// @brief Processes that have the message.
+    ProcessSet seen;
+    /// @brief Null until the message itself arrived.
+    std::shared_ptr<const StoredDatas> datas;
+    bool delivered = false;
+  };
+
+  /// @brief Sequence numbers of an author that were delivered. Authors number
+  /// their messages densely, so this is a watermark and the ranges delivered
+  /// above it. In the `RelayMode::Signals` mode copies of a message can arrive
+  /// after its state was erased, this tells they are duplicates.
+  struct DeliveredRanges {
+    /// @brief All sequence numbers below were delivered.
+    PerfectLink::MessageIdType watermark = INITIAL_SEQ_NR;
+    /// @brief Delivered ranges above the watermark, from start to end.
+    std::map<PerfectLink::MessageIdType, PerfectLink::MessageIdType> above;
+
+    auto contains(const PerfectLink::MessageIdType seq_nr) const -> bool;
+
+    auto insert(const PerfectLink::MessageIdType start,
+                const PerfectLink::MessageIdType end) -> void;
+  };
+
+  /// @brief Splits a message ID into its author and sequence number.
+  static auto _decode_message_id(const MessageIdType message_id)
+      -> std::tuple<PerfectLink::ProcessIdType, PerfectLink::MessageIdType>;
+
+  /// @brief Whether the author of a message ID read from the network is a
+  /// member. Checked before any per-author state is touched, so that
+  /// `_delivered` can be indexed by the author of every message that got
+  /// through.
+  auto _has_member_author(const MessageIdType message_id) const -> bool;
+
+  /// @brief Handles a message in the `RelayMode::Signals` mode.
+  auto _handle_data(const PerfectLink::ProcessIdType process_id,
+                    const MessageIdType message_id,
+                    const std::vector<Slice<std::uint8_t>>& datas,
+                    ListenCallback& callback) -> void;
+
+  /// @brief Handles a SEEN or WANT signal.
+  auto _handle_signal(const PerfectLink::ProcessIdType process_id,
+                      const Slice<std::uint8_t> signal,
+                      ListenCallback& callback) -> void;
+
+  /// @brief Delivers all payloads of a message.
+  auto _deliver(const MessageIdType message_id,
+                const StoredDatas& datas,
+                ListenCallback& callback) -> void;
+
+  /// @brief Sends a signal to a single process, or to all if `process_id` is
+  /// none.
+  auto _signal(const SignalKind kind,
+               const MessageIdType message_id,
+               const std::optional<PerfectLink::ProcessIdType> process_id)
+      -> void;
+
+  /// @brief Records how long a message of this process took to reach a
+  /// majority. Has to be called with `_acknowledged_mutex` held.
+  auto _reached_majority(const MessageIdType message_id) -> void;
+
+  /// @brief Marks a message as delivered once a majority has seen it and it
+  /// arrived, erases its state once every process has seen it. Has to be
+  /// called with `_acknowledged_mutex` held, `message` is dangling afterwards.
+  /// @return The payloads to deliver, if the message became deliverable.
+  auto _settle(const MessageIdType message_id, SignaledMessage& message)
+      -> std::shared_ptr<const StoredDatas>;
+
+  const RelayMode _relay_mode;
   BestEffortBroadcast _link;
   /// @brief Messages that have been acknowledges. Acknowledgement is indicated
-  /// by a set bit in the bitset. If a map entry exists, then this message is
-  /// pending for delivery. Once enough acks are collected the message is
-  /// delivered. The actual message is not stored here. Together with an ack we
-  /// will receive the message, we can use that to deliver.
-  std::unordered_map<MessageIdType, std::bitset<PerfectLink::MAX_PROCESSES>>
-      _acknowledged;
+  /// by a process in the set. If a map entry exists, then this message is
+  /// pending for delivery or was not yet relayed by every process. Once enough
+  /// acks are collected the message is delivered, once all processes acked
+  /// the entry is erased. The actual message is not stored here. Together with
+  /// an ack we will receive the message, we can use that to deliver.
+  std::unordered_map<MessageIdType, ProcessSet> _acknowledged;
+  /// @brief Messages of the `RelayMode::Signals` mode that are pending for
+  /// delivery or were not yet seen by every process.
+  std::unordered_map<MessageIdType, SignaledMessage> _signaled;
+  /// @brief Delivered messages of every author in the `RelayMode::Signals`
+  /// mode, indexed by `process_id - 1`.
+  std::vector<DeliveredRanges> _delivered;
+  /// @brief When the in-flight messages of this process were broadcast.
+  std::unordered_map<MessageIdType, Metrics::Clock::time_point> _broadcast_at;
+  /// @brief Guards all of the receiving state.
   std::mutex _acknowledged_mutex;
 
   /// @brief Current sequence number of messages.
@@ -84,30 +215,13 @@ class UniformReliableBroadcast {
 
 template <typename... Data, class, class>
 auto UniformReliableBroadcast::broadcast(Data... datas) -> void {
-  MessageIdType message_id = 0;
-  std::array<std::uint8_t, sizeof(MessageIdType)> message_id_data;
-
-  for (size_t i = 0; i < sizeof(PerfectLink::ProcessIdType); i++) {
-    message_id |= static_cast<MessageIdType>(id() & (0xff << (8 * i)));
-    message_id_data[i] = static_cast<std::uint8_t>((id() >> (i * 8)) & 0xff);
-  }
-  for (size_t i = 0; i < sizeof(PerfectLink::MessageIdType); i++) {
-    message_id |= (_seq_nr & static_cast<MessageIdType>(0xff << (8 * i)))
-                  << (8 * sizeof(PerfectLink::ProcessIdType));
-    message_id_data[i + sizeof(PerfectLink::ProcessIdType)] =
-        (_seq_nr >> (i * 8)) & 0xff;
-  }
+  const std::array<Slice<std::uint8_t>, sizeof...(Data)> payloads = {
+      Slice<std::uint8_t>(std::get<0>(datas), std::get<1>(datas))...};
+  const PerfectLink::Payloads all(payloads.data(), payloads.size());
 
-  _send_semaphore.acquire();
-
-  {
-    std::lock_guard lock(_acknowledged_mutex);
-    // add map entry to indicate this message is pending
-    _acknowledged.try_emplace(message_id);
-    _seq_nr += static_cast<PerfectLink::MessageIdType>(sizeof...(Data));
+  // a compile time known message is sent whole or not at all
+  if (PerfectLink::packable(sizeof(MessageIdType), all) < payloads.size()) {
+    throw std::runtime_error("Message is too large");
   }
-
-  _link.broadcast(
-      std::make_tuple(message_id_data.data(), message_id_data.size()),
-      datas...);
+  broadcast(all);
 }
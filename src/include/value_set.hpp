@@ -0,0 +1,68 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <vector>
+
+/// @brief A set of values stored as a sorted vector without duplicates. Meant
+/// for small sets: union, difference and the subset check are linear merges
+/// over contiguous memory instead of hash table walks, and a set is a single
+/// allocation.
+/// @tparam T Totally ordered type of the values.
+template <typename T>
+class ValueSet {
+ public:
+  using const_iterator = typename std::vector<T>::const_iterator;
+
+  ValueSet() = default;
+
+  /// @brief Creates a set from arbitrary values, duplicates are dropped.
+  explicit ValueSet(std::vector<T> values) : _values(std::move(values)) {
+    if (!std::is_sorted(_values.begin(), _values.end())) {
+      std::sort(_values.begin(), _values.end());
+    }
+    _values.erase(std::unique(_values.begin(), _values.end()), _values.end());
+  }
+
+  inline auto size() const -> std::size_t { return _values.size(); }
+  inline auto empty() const -> bool { return _values.empty(); }
+  inline auto begin() const -> const_iterator { return _values.begin(); }
+  inline auto end() const -> const_iterator { return _values.end(); }
+  /// @brief The values in ascending order, `size` of them.
+  inline auto data() const -> const T* { return _values.data(); }
+
+  inline auto contains(const T& value) const -> bool {
+    return std::binary_search(_values.begin(), _values.end(), value);
+  }
+
+  /// @brief Whether every value of `other` is in this set.
+  inline auto includes(const ValueSet& other) const -> bool {
+    return std::includes(_values.begin(), _values.end(), other._values.begin(),
+                         other._values.end());
+  }
+
+  /// @brief Adds all values of `other` to this set.
+  auto unite(const ValueSet& other) -> void {
+    if (includes(other)) {
+      return;
+    }
+    std::vector<T> result;
+    result.reserve(_values.size() + other._values.size());
+    std::set_union(_values.begin(), _values.end(), other._values.begin(),
+                   other._values.end(), std::back_inserter(result));
+    _values = std::move(result);
+  }
+
+  /// @brief Values of this set that are not in `other`.
+  auto difference(const ValueSet& other) const -> ValueSet {
+    ValueSet result;
+    std::set_difference(_values.begin(), _values.end(), other._values.begin(),
+                        other._values.end(),
+                        std::back_inserter(result._values));
+    return result;
+  }
+
+ private:
+  std::vector<T> _values;
+};
@@ -1,10 +1,71 @@
 #include "best_effort_broadcast.hpp"
+#include <cstring>
+#include "codec.hpp"
 #include "perfect_link.hpp"
 
+static auto map_addresses(
+    const BestEffortBroadcast::AvailableProcesses& processes)
+    -> std::vector<sockaddr_in> {
+  std::vector<sockaddr_in> result;
+  result.reserve(processes.size());
+
+  for (const auto& [_, address] : processes) {
+    result.push_back(PerfectLink::make_address(address.host, address.port));
+  }
+
+  return result;
+}
+
 BestEffortBroadcast::BestEffortBroadcast(
     const PerfectLink::ProcessIdType id,
-    const BestEffortBroadcast::AvailableProcesses processes)
-    : _link(id), _processes(processes) {}
+    const BestEffortBroadcast::AvailableProcesses processes,
+    const LinkOptions options)
+    : _link(id, processes.size(), options),
+      _processes(processes),
+      _addresses(map_addresses(processes)),
+      _children(_make_children(id, processes, options.broadcast_fanout)) {}
+
+auto BestEffortBroadcast::_make_children(const PerfectLink::ProcessIdType id,
+                                         const AvailableProcesses& processes,
+                                         const std::size_t fanout)
+    -> std::vector<std::vector<sockaddr_in>> {
+  std::vector<std::vector<sockaddr_in>> children;
+  if (fanout == 0) {
+    return children;
+  }
+
+  // ids are dense, the position of a process in the tree of an origin is its
+  // distance from the origin
+  const auto count = processes.size();
+  children.resize(count);
+  for (std::size_t origin = 0; origin < count; origin++) {
+    const auto position = (id - 1 + count - origin) % count;
+    for (auto child = fanout * position + 1;
+         child <= fanout * position + fanout && child < count; child++) {
+      const auto child_id =
+          static_cast<PerfectLink::ProcessIdType>((origin + child) % count + 1);
+      const auto& address = processes.at(child_id);
+      children[origin].push_back(
+          PerfectLink::make_address(address.host, address.port));
+    }
+  }
+
+  // the origin delivers its own broadcast like everybody else
+  const auto& self = processes.at(id);
+  children[id - 1].push_back(PerfectLink::make_address(self.host, self.port));
+  return children;
+}
+
+auto BestEffortBroadcast::_with_origin(const PerfectLink::ProcessIdType origin,
+                                       const Slice<std::uint8_t> metadata)
+    -> std::vector<std::uint8_t> {
+  std::vector<std::uint8_t> prefixed(ORIGIN_SIZE + metadata.size());
+  codec::store_le(prefixed.data(), origin);
+  if (metadata.size() > 0) {
+    std::memcpy(prefixed.data() + ORIGIN_SIZE, &metadata[0], metadata.size());
+  }
+  return prefixed;
+}
 
 auto BestEffortBroadcast::bind(const in_addr_t host, const in_port_t port)
     -> void {
@@ -12,12 +73,90 @@ auto BestEffortBroadcast::bind(const in_addr_t host, const in_port_t port)
 }
 
 auto BestEffortBroadcast::listen(PerfectLink::ListenCallback callback) -> void {
-  _link.listen(callback);
+  listen_batch(
+      [&](auto process_id, [[maybe_unused]] auto& metadata, auto& datas) {
+        for (auto& data : datas) {
+          OwnedSlice owned = data;
+          callback(process_id, owned);
+        }
+      });
 }
 
 auto BestEffortBroadcast::listen_batch(
     PerfectLink::ListenBatchCallback callback) -> void {
-  _link.listen_batch(callback);
+  if (!_is_tree()) {
+    _link.listen_batch(callback);
+    return;
+  }
+
+  _link.listen_batch([&](auto process_id, auto& metadata, auto& datas) {
+    _receive(process_id, metadata, datas, callback);
+  });
+}
+
+auto BestEffortBroadcast::_receive(
+    const PerfectLink::ProcessIdType process_id,
+    OwnedSlice<std::uint8_t>& metadata,
+    std::vector<Slice<std::uint8_t>>& datas,
+    PerfectLink::ListenBatchCallback& callback) -> void {
+  if (metadata.size() < ORIGIN_SIZE) {
+    // sent to us alone without metadata
+    callback(process_id, metadata, datas);
+    return;
+  }
+
+  const auto origin =
+      codec::load_le<PerfectLink::ProcessIdType>(&metadata[0]);
+  // the metadata of the layer above may be empty, which `subslice` refuses
+  OwnedSlice<std::uint8_t> rest(&metadata[0] + ORIGIN_SIZE,
+                                metadata.size() - ORIGIN_SIZE);
+  if (origin == 0 || origin > _children.size()) {
+    callback(process_id, rest, datas);
+    return;
+  }
+
+  // the origin sent to its children itself
+  const auto& children = _children[origin - 1];
+  if (origin != id() && !children.empty()) {
+    // datas that arrived in a single packet might not fit into one again,
+    // such as coalesced ones, the rest goes in further packets
+    const PerfectLink::Payloads payloads(datas.data(), datas.size());
+    std::size_t relayed = 0;
+    do {
+      relayed += _link.send_batch(
+          children, metadata,
+          relayed == 0 ? payloads : payloads.subslice(relayed));
+    } while (relayed < payloads.size());
+  }
+  callback(origin, rest, datas);
+}
+
+auto BestEffortBroadcast::broadcast(const Slice<std::uint8_t> metadata,
+                                    const PerfectLink::Payloads datas)
+    -> std::size_t {
+  if (!_is_tree()) {
+    return _link.send_batch(_addresses, metadata, datas);
+  }
+
+  const auto prefixed = _with_origin(id(), metadata);
+  return _link.send_batch(
+      _children[id() - 1],
+      Slice<std::uint8_t>(prefixed.data(), prefixed.size()), datas);
+}
+
+auto BestEffortBroadcast::send(const in_addr_t host,
+                               const in_port_t port,
+                               const Slice<std::uint8_t> metadata,
+                               const PerfectLink::Payloads datas)
+    -> std::size_t {
+  if (!_is_tree() || metadata.size() == 0) {
+    return _link.send(host, port, metadata, datas);
+  }
+
+  const auto prefixed = _with_origin(0, metadata);
+  return _link.send(host, port,
+                    Slice<std::uint8_t>(prefixed.data(), prefixed.size()),
+                    datas);
 }
 
 auto BestEffortBroadcast::processes() const
@@ -0,0 +1,144 @@
+#include "epoll_reactor.hpp"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include "common.hpp"
+
+EpollReactor::EpollReactor()
+    : _epoll_fd(perror_check<int>(
+          []() noexcept { return epoll_create1(EPOLL_CLOEXEC); },
+          [](auto res) noexcept { return res < 0; }, "failed to create epoll",
+          true)),
+      _stop_fd(perror_check<int>(
+          []() noexcept { return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); },
+          [](auto res) noexcept { return res < 0; },
+          "failed to create eventfd", true)) {
+  // the stop event has no source, its data is out of range of `_sources`
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.u64 = std::numeric_limits<std::uint64_t>::max();
+  perror_check<int>(
+      [&]() noexcept {
+        return epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _stop_fd, &event);
+      },
+      [](auto res) noexcept { return res < 0; }, "failed to watch eventfd",
+      true);
+}
+
+EpollReactor::~EpollReactor() {
+  const auto close_fd = [](const int fd) {
+    perror_check<int>([&]() noexcept { return close(fd); },
+                      [](auto res) noexcept { return res < 0; },
+                      "failed to close reactor descriptor");
+  };
+  for (const auto& source : _sources) {
+    if (source.is_timer) {
+      close_fd(source.fd);
+    }
+  }
+  close_fd(_stop_fd);
+  close_fd(_epoll_fd);
+}
+
+auto EpollReactor::watch(Endpoint& endpoint, Handler on_readable) -> void {
+  if (endpoint.fd() < 0) {
+    throw std::runtime_error("Endpoint has no file descriptor to watch");
+  }
+  _add(endpoint.fd(), false, std::move(on_readable));
+}
+
+auto EpollReactor::add_timer(Handler on_expiry) -> Timer {
+  const auto fd = perror_check<int>(
+      []() noexcept {
+        return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      },
+      [](auto res) noexcept { return res < 0; }, "failed to create timerfd",
+      true);
+  return _add(fd, true, std::move(on_expiry));
+}
+
+auto EpollReactor::arm(const Timer timer, const Clock::time_point deadline)
+    -> void {
+  itimerspec spec{};
+  if (deadline != Clock::time_point::max()) {
+    const auto since_epoch =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            deadline.time_since_epoch())
+            .count();
+    // a zero value would disarm the timer instead of expiring it right away
+    const auto nanoseconds = std::max<std::int64_t>(since_epoch, 1);
+    spec.it_value.tv_sec = static_cast<time_t>(nanoseconds / 1'000'000'000);
+    spec.it_value.tv_nsec = static_cast<long>(nanoseconds % 1'000'000'000);
+  }
+  perror_check<int>(
+      [&]() noexcept {
+        return timerfd_settime(_sources[timer].fd, TFD_TIMER_ABSTIME, &spec,
+                               nullptr);
+      },
+      [](auto res) noexcept { return res < 0; }, "failed to arm timer", true);
+}
+
+auto EpollReactor::run() -> void {
+  std::array<epoll_event, MAX_EVENTS> events;
+  while (!_stopped) {
+    const auto ready = epoll_wait(_epoll_fd, events.data(),
+                                  static_cast<int>(events.size()), -1);
+    if (ready < 0 && errno == EINTR) {
+      // got interrupted, try again
+      continue;
+    }
+    if (ready < 0) {
+      perror("failed to wait for events");
+      continue;
+    }
+
+    for (std::size_t i = 0; i < static_cast<std::size_t>(ready); i++) {
+      const auto index = events[i].data.u64;
+      if (index >= _sources.size()) {
+        // stopped, the remaining events are not handled
+        return;
+      }
+      auto& source = _sources[index];
+      if (source.is_timer) {
+        // clears the expiration. Nothing to read if the timer was armed again
+        // meanwhile, the handler runs anyway and checks its deadlines itself
+        std::uint64_t expirations;
+        [[maybe_unused]] const auto res =
+            read(source.fd, &expirations, sizeof(expirations));
+      }
+      source.handler();
+    }
+  }
+}
+
+auto EpollReactor::stop() -> void {
+  _stopped = true;
+  const std::uint64_t one = 1;
+  perror_check<ssize_t>(
+      [&]() noexcept { return write(_stop_fd, &one, sizeof(one)); },
+      [](auto res) noexcept { return res < 0; }, "failed to stop reactor");
+}
+
+auto EpollReactor::_add(const int fd, const bool is_timer, Handler handler)
+    -> std::size_t {
+  const auto index = _sources.size();
+  _sources.push_back({fd, is_timer, std::move(handler)});
+
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.u64 = index;
+  perror_check<int>(
+      [&]() noexcept {
+        return epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+      },
+      [](auto res) noexcept { return res < 0; },
+      "failed to watch file descriptor", true);
+  return index;
+}
@@ -1,124 +1,225 @@
 #include "lattice_agreement.hpp"
 #include <array>
+#include <algorithm>
 #include <cassert>
+#include <limits>
+#include <stdexcept>
+#include "metrics.hpp"
 
 LatticeAgreement::LatticeAgreement(
     const PerfectLink::ProcessIdType id,
     const BestEffortBroadcast::AvailableProcesses processes,
     const std::size_t max_unique_values,
-    ListenCallback callback)
+    ListenCallback callback,
+    const LinkOptions options,
+    const std::size_t delivery_queue_capacity)
     : _max_unique_values(max_unique_values),
-      _link(id, processes),
-      _callback(callback) {}
+      _link(id, processes, options),
+      _callback(callback),
+      _watermarks(processes.size(), 0) {
+  for (auto& round : _rounds) {
+    round.store(NO_ROUND, std::memory_order_relaxed);
+  }
+  if (options.state != nullptr) {
+    _state = options.state->records<AgreementState>("agreement", 1);
+    if (options.state->is_restored()) {
+      // acceptor state of earlier agreements was lost
+      _acceptors_base = _state->acceptors_end.load(std::memory_order_relaxed);
+      _first_proposal_nr =
+          _state->max_proposal_nr.load(std::memory_order_relaxed) + 1;
+    }
+  }
+  if (delivery_queue_capacity > 0) {
+    _delivery.emplace(delivery_queue_capacity,
+                      [this](auto& set) { _callback(set); });
+  }
+}
 
 auto LatticeAgreement::bind(const in_addr_t host, const in_port_t port)
     -> void {
   _link.bind(host, port);
 }
 
-auto LatticeAgreement::propose(const std::vector<AgreementType>& values)
+auto LatticeAgreement::resume(const PerfectLink::MessageIdType delivered)
     -> void {
+  std::lock_guard<std::mutex> lock(_agreements_mutex);
+  _agreement_nr = delivered;
+  _next_delivery = delivered;
+  _acceptors_base = std::max(_acceptors_base, delivered);
+  _persisted.store(delivered, std::memory_order_relaxed);
+}
+
+auto LatticeAgreement::propose(const Slice<AgreementType> values) -> void {
   _send_semaphore.acquire();
 
   std::lock_guard<std::mutex> lock(_agreements_mutex);
 
-  auto& agreement = _agreements.try_emplace(_agreement_nr).first->second;
-  agreement.proposed_value.insert(values.begin(), values.end());
+  // the semaphore guarantees the previous agreement of this slot was delivered
+  auto& agreement = _agreements[_agreement_nr % MAX_IN_FLIGHT];
+  assert(!agreement.in_flight);
+  agreement = Agreement();
+  agreement.in_flight = true;
+  agreement.agreement_nr = _agreement_nr;
+  agreement.proposed_value = ValueSet<AgreementType>(values.to_owned());
+  agreement.proposal_nr = _first_proposal_nr;
+  agreement.first_proposal_nr = _first_proposal_nr;
+  _agreement_nr += 1;
+
+  // another process decided a set with all our values, we can decide it too
+  const auto acceptor = _acceptor(agreement.agreement_nr);
+  if (acceptor != nullptr && acceptor->decided.has_value() &&
+      acceptor->decided->includes(agreement.proposed_value)) {
+    agreement.proposed_value = *acceptor->decided;
+    _decide(agreement, false);
+    return;
+  }
 
   // we have the full set, no need to propose
   if (agreement.proposed_value.size() == _max_unique_values) {
     _decide(agreement);
   } else {
-    _broadcast_proposal(agreement, _agreement_nr);
+    _publish_round(agreement);
+    _broadcast_values(MessageKind::Proposal, agreement);
   }
-
-  _agreement_nr += 1;
 }
 
 auto LatticeAgreement::listen() -> void {
   _link.listen([&](auto process_id, auto& data) {
-    std::size_t offset = 0;
-
-    auto message_kind = static_cast<MessageKind>(data[offset++]);
-
-    PerfectLink::MessageIdType agreement_nr = 0;
-    for (size_t i = 0; i < sizeof(PerfectLink::MessageIdType); i++) {
-      agreement_nr |= static_cast<PerfectLink::MessageIdType>(data[offset++])
-                      << (8 * i);
-    }
-
-    ProposalNumberType proposal_nr = 0;
-    for (size_t i = 0; i < sizeof(ProposalNumberType); i++) {
-      proposal_nr |= static_cast<ProposalNumberType>(data[offset++]) << (8 * i);
+    // the link checks ids too, per-process state is indexed by them either way
+    if (!_link.is_member(process_id) || data.size() < MessageHeader::SIZE) {
+      // malformed, not one of ours
+      return;
     }
+    const auto [kind, agreement_nr, proposal_nr] =
+        MessageHeader::load(&data[0]);
+    const auto message_kind = static_cast<MessageKind>(kind);
+    // a message may end with its header, which `subslice` refuses
+    const OwnedSlice<std::uint8_t> values(&data[0] + MessageHeader::SIZE,
+                                          data.size() - MessageHeader::SIZE);
 
     switch (message_kind) {
       case MessageKind::Proposal:
-        _handle_proposal(process_id, agreement_nr, proposal_nr,
-                         data.subslice(offset));
+        _handle_proposal(process_id, agreement_nr, proposal_nr, values);
         break;
       case MessageKind::Ack:
-        _handle_ack(agreement_nr, proposal_nr);
+        // most responses come after a majority decided, drop them unlocked
+        if (_is_awaited(agreement_nr, proposal_nr)) {
+          _handle_ack(agreement_nr, proposal_nr);
+        }
         break;
       case MessageKind::Nack:
-        _handle_nack(agreement_nr, proposal_nr, data.subslice(offset));
+        if (_is_awaited(agreement_nr, proposal_nr)) {
+          _handle_nack(agreement_nr, proposal_nr, values);
+        }
+        break;
+      case MessageKind::Watermark:
+        // carries no proposal number and no values
+        if (proposal_nr == 0 && values.size() == 0) {
+          _handle_watermark(process_id, agreement_nr);
+        }
+        break;
+      case MessageKind::Decision:
+        _handle_decision(agreement_nr, std::nullopt, values);
+        break;
+      case MessageKind::DecisionResponse:
+        if (_is_awaited(agreement_nr, proposal_nr)) {
+          _handle_decision(agreement_nr, proposal_nr, values);
+        }
         break;
 
       default:
-        // poor man's std::unreachable();
-        assert(false);
+        // an unknown kind, dropped like other malformed messages
         break;
     }
   });
 }
 
+auto LatticeAgreement::_encode_values(const ValueSet<AgreementType>& values,
+                                      std::uint8_t* data,
+                                      const std::size_t capacity)
+    -> std::size_t {
+  return codec::encode_gaps(values.data(), values.size(), data, capacity);
+}
+
+auto LatticeAgreement::_decode_values(const OwnedSlice<std::uint8_t>& message)
+    -> std::optional<ValueSet<AgreementType>> {
+  // every value takes at least a byte
+  std::vector<AgreementType> values(message.size());
+  if (!values.empty()) {
+    const auto count =
+        codec::decode_gaps(&message[0], message.size(), values.data());
+    if (!count.has_value()) {
+      return std::nullopt;
+    }
+    values.resize(*count);
+  }
+  // values are sent sorted, so this does not sort again
+  return ValueSet<AgreementType>(std::move(values));
+}
+
+auto LatticeAgreement::_message_buffer(const std::size_t count)
+    -> std::vector<std::uint8_t>& {
+  // grows to the largest message of the thread and stays
+  static thread_local std::vector<std::uint8_t> buffer;
+  const auto size =
+      std::min(MessageHeader::SIZE + count * codec::MAX_VARINT_SIZE,
+               PerfectLink::MAX_FRAGMENTED_SIZE);
+  if (buffer.size() < size) {
+    buffer.resize(size);
+  }
+  return buffer;
+}
+
 auto LatticeAgreement::_handle_proposal(
     const PerfectLink::ProcessIdType process_id,
     const PerfectLink::MessageIdType agreement_nr,
     const ProposalNumberType proposal_nr,
     const OwnedSlice<std::uint8_t>& message) -> void {
-  std::array<std::uint8_t, PerfectLink::MAX_MESSAGE_SIZE> data;
-  std::size_t size = 0;
-  // if any of the values are outside of our current proposal, this
-  // becomes a nack
-  data[size++] = static_cast<std::uint8_t>(MessageKind::Ack);
-  for (size_t i = 0; i < sizeof(agreement_nr); i++) {
-    data[size++] = (agreement_nr >> (8 * i)) & 0xff;
-  }
-  for (size_t i = 0; i < sizeof(proposal_nr); i++) {
-    data[size++] = (proposal_nr >> (8 * i)) & 0xff;
+  const auto proposal = _decode_values(message);
+  if (!proposal.has_value()) {
+    // malformed, before it creates acceptor state
+    return;
   }
 
   std::lock_guard<std::mutex> lock(_agreements_mutex);
 
   // might be the first time we see this agreement
-  auto& agreement = _agreements.try_emplace(agreement_nr).first->second;
-
-  assert(message.size() / sizeof(AgreementType) * sizeof(AgreementType) ==
-         message.size());
-  // read proposal values
-  std::unordered_set<AgreementType> difference = agreement.accepted_value;
-  std::size_t offset = 0;
-  while (offset < message.size()) {
-    AgreementType value = 0;
-    for (size_t i = 0; i < sizeof(value); i++) {
-      value |= static_cast<AgreementType>(message[offset++]) << (8 * i);
-    }
-    difference.erase(value);
-    agreement.accepted_value.insert(value);
-  }
-
-  // we have values that the proposer does not, switch to sending a nack
-  if (!difference.empty()) {
-    data[0] = static_cast<std::uint8_t>(MessageKind::Nack);
-    // send only the difference
-    for (auto value : difference) {
-      for (size_t i = 0; i < sizeof(value); i++) {
-        data[size++] = (value >> (8 * i)) & 0xff;
-      }
+  auto acceptor = _acceptor(agreement_nr);
+  if (acceptor == nullptr) {
+    // a late retransmission, the proposer has decided already
+    return;
+  }
+
+  // if any of the values are outside of our current proposal, this
+  // becomes a nack
+  auto kind = MessageKind::Ack;
+  const ValueSet<AgreementType>* values = nullptr;
+  ValueSet<AgreementType> difference;
+  if (acceptor->decided.has_value() &&
+      acceptor->decided->includes(*proposal)) {
+    // the proposer can decide what was decided already, without more rounds
+    kind = MessageKind::DecisionResponse;
+    values = &*acceptor->decided;
+  } else {
+    difference = acceptor->accepted.difference(*proposal);
+    acceptor->accepted.unite(*proposal);
+
+    // we have values that the proposer does not, switch to sending a nack
+    if (!difference.empty()) {
+      kind = MessageKind::Nack;
+      // send only the difference
+      values = &difference;
     }
   }
 
+  auto& data = _message_buffer(values == nullptr ? 0 : values->size());
+  MessageHeader::store(data.data(), static_cast<std::uint8_t>(kind),
+                       agreement_nr, proposal_nr);
+  auto size = MessageHeader::SIZE;
+  if (values != nullptr) {
+    size += _encode_values(*values, data.data() + size, data.size() - size);
+  }
+
   // find who to send to a response
   auto& processes = _link.processes();
   auto target = processes.find(process_id);
@@ -133,57 +234,59 @@ auto LatticeAgreement::_handle_ack(
     const ProposalNumberType proposal_nr) -> void {
   std::lock_guard<std::mutex> lock(_agreements_mutex);
 
-  auto agreement_entry = _agreements.find(agreement_nr);
-  // got an ack, so we had to start this agreement already
-  assert(agreement_entry != _agreements.end());
-  auto& agreement = agreement_entry->second;
+  // got an ack, so we had to start this agreement already. It might have been
+  // delivered since
+  auto agreement = _in_flight(agreement_nr);
 
   // if has already decided or the proposal number does not match then we don't
-  // care about the nack
-  if (agreement.has_decided || agreement.proposal_nr != proposal_nr) {
+  // care about the ack
+  if (agreement == nullptr || agreement->has_decided ||
+      agreement->proposal_nr != proposal_nr) {
     return;
   }
 
-  agreement.ack_count++;
+  agreement->ack_count++;
 
   // check if we can decide immediately
-  if (2 * static_cast<std::size_t>(agreement.ack_count) >=
+  if (2 * static_cast<std::size_t>(agreement->ack_count) >=
       _link.processes().size()) {
-    _decide(agreement);
+    _decide(*agreement);
     return;
   }
 
-  _check_nacks(agreement, agreement_nr);
+  _check_nacks(*agreement);
 }
 
 auto LatticeAgreement::_handle_nack(
     const PerfectLink::MessageIdType agreement_nr,
     const ProposalNumberType proposal_nr,
     const OwnedSlice<std::uint8_t>& message) -> void {
+  const auto values = _decode_values(message);
+  if (!values.has_value()) {
+    return;
+  }
+
   std::lock_guard<std::mutex> lock(_agreements_mutex);
 
-  auto agreement_entry = _agreements.find(agreement_nr);
-  // got an nack, so we had to start this agreement already
-  assert(agreement_entry != _agreements.end());
-  auto& agreement = agreement_entry->second;
+  // got an nack, so we had to start this agreement already. It might have been
+  // delivered since
+  auto agreement = _in_flight(agreement_nr);
 
   // if has already decided or the proposal number does not match then we don't
   // care about the nack
-  if (agreement.has_decided || agreement.proposal_nr != proposal_nr) {
+  if (agreement == nullptr || agreement->has_decided ||
+      agreement->proposal_nr != proposal_nr) {
     return;
   }
 
-  assert(message.size() / sizeof(AgreementType) * sizeof(AgreementType) ==
-         message.size());
-  // read difference set values
-  std::size_t offset = 0;
-  while (offset < message.size()) {
-    AgreementType value = 0;
-    for (size_t i = 0; i < sizeof(value); i++) {
-      value |= static_cast<AgreementType>(message[offset++]) << (8 * i);
-    }
-    agreement.proposed_value.insert(value);
-  }
+  _count_nack(*agreement, *values);
+}
+
+auto LatticeAgreement::_count_nack(Agreement& agreement,
+                                   const ValueSet<AgreementType>& values)
+    -> void {
+  // add the difference set values
+  agreement.proposed_value.unite(values);
 
   agreement.nack_count++;
 
@@ -191,13 +294,114 @@ auto LatticeAgreement::_handle_nack(
   if (agreement.proposed_value.size() == _max_unique_values) {
     _decide(agreement);
   } else {
-    _check_nacks(agreement, agreement_nr);
+    _check_nacks(agreement);
   }
 }
 
-auto LatticeAgreement::_check_nacks(
-    Agreement& agreement,
-    const PerfectLink::MessageIdType agreement_nr) -> void {
+auto LatticeAgreement::_in_flight(const PerfectLink::MessageIdType agreement_nr)
+    -> Agreement* {
+  auto& agreement = _agreements[agreement_nr % MAX_IN_FLIGHT];
+  if (!agreement.in_flight || agreement.agreement_nr != agreement_nr) {
+    return nullptr;
+  }
+  return &agreement;
+}
+
+auto LatticeAgreement::_handle_decision(
+    const PerfectLink::MessageIdType agreement_nr,
+    const std::optional<ProposalNumberType> response_to,
+    const OwnedSlice<std::uint8_t>& message) -> void {
+  const auto decoded = _decode_values(message);
+  if (!decoded.has_value()) {
+    return;
+  }
+  const auto& decision = *decoded;
+
+  std::lock_guard<std::mutex> lock(_agreements_mutex);
+  _remember_decision(agreement_nr, decision);
+
+  auto agreement = _in_flight(agreement_nr);
+  if (agreement == nullptr || agreement->has_decided) {
+    return;
+  }
+  // a decided set is comparable with every other decision, so adopting it
+  // is safe as long as it includes all values we proposed
+  if (decision.includes(agreement->proposed_value)) {
+    agreement->proposed_value = decision;
+    _decide(*agreement, false);
+    return;
+  }
+  // NACKs of the round added values the decision lacks, the responder still
+  // has to count for the round
+  if (response_to.has_value() && *response_to == agreement->proposal_nr) {
+    _count_nack(*agreement, decision);
+  }
+}
+
+auto LatticeAgreement::_handle_watermark(
+    const PerfectLink::ProcessIdType process_id,
+    const PerfectLink::MessageIdType watermark) -> void {
+  // `listen` passes on messages of members only, which indexing by the id
+  // relies on
+  assert(_link.is_member(process_id));
+
+  std::lock_guard<std::mutex> lock(_agreements_mutex);
+
+  auto& known = _watermarks[process_id - 1];
+  known = std::max(known, watermark);
+
+  // the minimum includes our own watermark, so a process announcing more than
+  // it decided only frees state nobody but itself might need
+  auto stable = std::numeric_limits<PerfectLink::MessageIdType>::max();
+  for (const auto& [id, _] : _link.processes()) {
+    stable = std::min(stable, _watermarks[id - 1]);
+  }
+
+  // nobody will propose in these agreements anymore
+  for (; _acceptors_base < stable; _acceptors_base++) {
+    if (!_acceptors.empty()) {
+      _acceptors.pop_front();
+    }
+  }
+}
+
+auto LatticeAgreement::_acceptor(const PerfectLink::MessageIdType agreement_nr)
+    -> Acceptor* {
+  if (agreement_nr < _acceptors_base) {
+    return nullptr;
+  }
+  const auto index = static_cast<std::size_t>(agreement_nr - _acceptors_base);
+  if (_acceptors.size() <= index) {
+    _acceptors.resize(index + 1);
+    if (_state != nullptr &&
+        _state->acceptors_end.load(std::memory_order_relaxed) <=
+            agreement_nr) {
+      // before the acceptor can respond
+      _state->acceptors_end.store(agreement_nr + 1, std::memory_order_relaxed);
+    }
+  }
+  return &_acceptors[index];
+}
+
+auto LatticeAgreement::_remember_decision(
+    const PerfectLink::MessageIdType agreement_nr,
+    const ValueSet<AgreementType>& decision) -> void {
+  auto acceptor = _acceptor(agreement_nr);
+  if (acceptor == nullptr) {
+    return;
+  }
+  if (!acceptor->decided.has_value() ||
+      acceptor->decided->size() < decision.size()) {
+    acceptor->decided = decision;
+  }
+}
+
+auto LatticeAgreement::live_agreements() -> std::size_t {
+  std::lock_guard<std::mutex> lock(_agreements_mutex);
+  return _acceptors.size();
+}
+
+auto LatticeAgreement::_check_nacks(Agreement& agreement) -> void {
   if (2 * (static_cast<std::size_t>(agreement.ack_count) +
            static_cast<std::size_t>(agreement.nack_count)) >=
       _link.processes().size()) {
@@ -205,48 +409,92 @@ auto LatticeAgreement::_check_nacks(
     agreement.proposal_nr += 1;
     agreement.ack_count = 0;
     agreement.nack_count = 0;
-    _broadcast_proposal(agreement, agreement_nr);
+    _publish_round(agreement);
+    _broadcast_values(MessageKind::Proposal, agreement);
   }
 }
 
-auto LatticeAgreement::_broadcast_proposal(
-    Agreement& agreement,
-    PerfectLink::MessageIdType agreement_nr) -> void {
-  std::array<std::uint8_t, PerfectLink::MAX_MESSAGE_SIZE> data;
-  std::size_t size = 0;
+auto LatticeAgreement::_broadcast_values(const MessageKind kind,
+                                         const Agreement& agreement) -> void {
+  auto& data = _message_buffer(agreement.proposed_value.size());
+  MessageHeader::store(data.data(), static_cast<std::uint8_t>(kind),
+                       agreement.agreement_nr, agreement.proposal_nr);
+  auto size = MessageHeader::SIZE;
+  size += _encode_values(agreement.proposed_value, data.data() + size,
+                         data.size() - size);
 
-  data[size++] = static_cast<std::uint8_t>(MessageKind::Proposal);
+  _link.broadcast(std::nullopt, std::make_tuple(data.data(), size));
+}
 
-  for (size_t i = 0; i < sizeof(agreement_nr); i++) {
-    data[size++] = (agreement_nr >> (8 * i)) & 0xff;
+auto LatticeAgreement::delivery_stats() const
+    -> std::optional<DeliveryQueue<DecidedSet>::Stats> {
+  if (!_delivery.has_value()) {
+    return std::nullopt;
   }
+  return _delivery->stats();
+}
 
-  for (size_t i = 0; i < sizeof(agreement.proposal_nr); i++) {
-    data[size++] = (agreement.proposal_nr >> (8 * i)) & 0xff;
+auto LatticeAgreement::_decide(Agreement& agreement, const bool announce)
+    -> void {
+  agreement.has_decided = true;
+  _publish_round(agreement);
+  Metrics::increment(Metrics::Counter::Decisions);
+  const auto rounds = agreement.proposal_nr - agreement.first_proposal_nr + 1;
+  Metrics::record(Metrics::Histogram::LatticeRounds,
+                  static_cast<std::uint64_t>(rounds));
+  // proposals the decision includes are answered with it from now on
+  _remember_decision(agreement.agreement_nr, agreement.proposed_value);
+  if (announce && rounds >= ANNOUNCED_ROUNDS) {
+    // the others are likely still retrying, they stop once they learn a
+    // decision including their proposal
+    _broadcast_values(MessageKind::Decision, agreement);
   }
 
-  // make sure we can fit the message
-  assert(size + agreement.proposed_value.size() * sizeof(AgreementType) <
-         data.size());
+  _deliver_decided();
+}
+
+auto LatticeAgreement::_deliver_decided() -> void {
+  std::size_t delivered = 0;
+  while (true) {
+    auto agreement = _in_flight(_next_delivery);
+    if (agreement == nullptr || !agreement->has_decided) {
+      break;
+    }
+
+    if (_delivery.has_value()) {
+      // a decided agreement no longer reads its proposal, hand it over
+      _delivery->push(std::move(agreement->proposed_value));
+    } else {
+      _callback(agreement->proposed_value);
+    }
+
+    agreement->in_flight = false;
+    _next_delivery += 1;
+    delivered += 1;
 
-  for (auto& value : agreement.proposed_value) {
-    for (size_t i = 0; i < sizeof(value); i++) {
-      data[size++] = (value >> (8 * i)) & 0xff;
+    if (_next_delivery % WATERMARK_INTERVAL == 0) {
+      _broadcast_watermark();
     }
   }
 
-  _link.broadcast(std::nullopt, std::make_tuple(data.data(), size));
+  // hand back the slots of all delivered agreements at once
+  if (delivered > 0) {
+    _send_semaphore.release(delivered);
+  }
 }
 
-auto LatticeAgreement::_decide(Agreement& agreement) -> void {
-  _callback(agreement.proposed_value);
-  agreement.has_decided = true;
-  // if we decided the full set, we remember this set in accepted_value. Then,
-  // when a different process sends us their proposal, we can immediately give
-  // them the full set.
-  if (agreement.proposed_value.size() == _max_unique_values) {
-    agreement.accepted_value.insert(agreement.proposed_value.begin(),
-                                    agreement.proposed_value.end());
-  }
-  _send_semaphore.release();
+auto LatticeAgreement::_broadcast_watermark() -> void {
+  // a restarted process decides again what its callback did not store
+  const auto watermark =
+      _state != nullptr
+          ? std::min(_next_delivery, _persisted.load(std::memory_order_relaxed))
+          : _next_delivery;
+
+  std::array<std::uint8_t, MessageHeader::SIZE> data;
+  // no proposal number
+  MessageHeader::store(data.data(),
+                       static_cast<std::uint8_t>(MessageKind::Watermark),
+                       watermark, 0);
+
+  _link.broadcast(std::nullopt, std::make_tuple(data.data(), data.size()));
 }
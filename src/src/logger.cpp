@@ -0,0 +1,302 @@
+#include "logger.hpp"
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include "common.hpp"
+
+/// @brief Whether the current thread is appending a decided set. A signal
+/// handler running on it must not wait for the append to finish.
+static thread_local bool appending_here = false;
+
+Logger::Logger(const std::size_t buffer_capacity)
+    : _buffer_capacity(buffer_capacity), _text(new char[TEXT_BUFFER_SIZE]) {
+  for (auto& buffer : _buffers) {
+    buffer.records.reset(new ValueType[_buffer_capacity]);
+  }
+}
+
+Logger::~Logger() {
+  if (_flusher_thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closing = true;
+    }
+    _cv.notify_all();
+    _flusher_thread.join();
+  }
+
+  if (_fd >= 0) {
+    // the flusher is done, write what is left in order
+    const auto active = _active.load();
+    auto& older = _buffers[1 - active];
+    if (older.state == BufferState::Full) {
+      _write_records(older);
+    }
+    _write_records(_buffers[active]);
+    perror_check<int>([&]() noexcept { return close(_fd); },
+                      [](auto res) noexcept { return res < 0; },
+                      "failed to close output file");
+  }
+}
+
+auto Logger::open(const std::string& path,
+                  const bool append,
+                  WrittenCallback on_written) -> std::size_t {
+  _fd = perror_check<int>(
+      [&]() noexcept {
+        return ::open(path.c_str(),
+                      O_CREAT | O_CLOEXEC |
+                          (append ? O_RDWR | O_APPEND : O_WRONLY | O_TRUNC),
+                      0644);
+      },
+      [](auto res) noexcept { return res < 0; }, "failed to open output file",
+      true);
+  _on_written = std::move(on_written);
+  if (append) {
+    _written = _count_lines();
+  }
+
+  // the flusher inherits the mask, so a signal never interrupts a write
+  sigset_t all;
+  sigset_t previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &previous);
+  _flusher_thread = std::thread([this] { _flush_loop(); });
+  pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+  return _written;
+}
+
+auto Logger::_count_lines() -> std::size_t {
+  std::size_t lines = 0;
+  off_t size = 0;
+  // end of the last complete line
+  off_t complete = 0;
+  while (true) {
+    const auto res = perror_check<ssize_t>(
+        [&]() noexcept {
+          return pread(_fd, _text.get(), TEXT_BUFFER_SIZE, size);
+        },
+        [](auto res) noexcept { return res < 0 && errno != EINTR; },
+        "failed to read output file", true);
+    if (res < 0) {
+      continue;
+    }
+    if (res == 0) {
+      break;
+    }
+    for (ssize_t i = 0; i < res; i++) {
+      if (_text[static_cast<std::size_t>(i)] == '\n') {
+        lines += 1;
+        complete = size + i + 1;
+      }
+    }
+    size += res;
+  }
+
+  // the rest of a line that a crash cut short is decided again
+  if (complete != size) {
+    perror_check<int>([&]() noexcept { return ftruncate(_fd, complete); },
+                      [](auto res) noexcept { return res < 0; },
+                      "failed to truncate output file", true);
+  }
+  return lines;
+}
+
+auto Logger::decide(const LatticeAgreement::DecidedSet& set) -> void {
+  const auto record_size = set.size() + 1;
+  if (record_size > _buffer_capacity) {
+    throw std::runtime_error("Decided set is too large to log");
+  }
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  // pairs with the signal handler setting `_stopped` and checking
+  // `_appending` afterwards: either we see it stopped or it waits for us
+  appending_here = true;
+  _appending = true;
+  const auto finish = [&] {
+    _appending = false;
+    appending_here = false;
+  };
+  if (_stopped) {
+    finish();
+    return;
+  }
+
+  auto active = _active.load();
+  auto* buffer = &_buffers[active];
+  if (buffer->committed + record_size > _buffer_capacity) {
+    // wait until the flusher wrote the other buffer. Not appending meanwhile,
+    // so that a signal handler does not wait for us
+    auto& other = _buffers[1 - active];
+    while (other.state != BufferState::Filling) {
+      finish();
+      _cv.wait(lock);
+      appending_here = true;
+      _appending = true;
+      if (_stopped) {
+        finish();
+        return;
+      }
+    }
+
+    // hand the full buffer over to the flusher
+    buffer->state = BufferState::Full;
+    _active = 1 - active;
+    buffer = &other;
+    _cv.notify_all();
+  }
+
+  const auto committed = buffer->committed.load();
+  auto records = buffer->records.get() + committed;
+  *records++ = static_cast<ValueType>(set.size());
+  for (auto value : set) {
+    *records++ = value;
+  }
+  buffer->committed = committed + record_size;
+  finish();
+}
+
+auto Logger::flush_from_signal() -> void {
+  _stopped = true;
+  if (!appending_here) {
+    while (_appending) {
+      // another thread is in the middle of an append, it finishes shortly
+    }
+  }
+
+  // take over from the flusher once it finished its current write
+  auto expected = FlusherState::Idle;
+  while (!_flusher.compare_exchange_weak(expected, FlusherState::Stopped)) {
+    if (expected == FlusherState::Stopped) {
+      // already flushed
+      return;
+    }
+    expected = FlusherState::Idle;
+  }
+
+  if (_fd < 0) {
+    return;
+  }
+
+  // an interrupted append either did not yet hand its buffer over, then the
+  // other buffer is empty, or it did, then the other buffer is older
+  const auto active = _active.load();
+  auto& older = _buffers[1 - active];
+  if (older.state == BufferState::Full) {
+    _write_records(older);
+  }
+  _write_records(_buffers[active]);
+}
+
+auto Logger::_flush_loop() -> void {
+  while (true) {
+    Buffer* full = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cv.wait(lock, [&] {
+        for (auto& buffer : _buffers) {
+          if (buffer.state == BufferState::Full) {
+            full = &buffer;
+            return true;
+          }
+        }
+        return _closing.load();
+      });
+    }
+    if (full == nullptr) {
+      return;
+    }
+
+    auto expected = FlusherState::Idle;
+    if (!_flusher.compare_exchange_strong(expected, FlusherState::Busy)) {
+      // the signal handler writes everything
+      return;
+    }
+    _write_records(*full);
+    _flusher = FlusherState::Idle;
+
+    // wake a producer waiting for the buffer
+    { std::lock_guard<std::mutex> lock(_mutex); }
+    _cv.notify_all();
+  }
+}
+
+auto Logger::_write_records(Buffer& buffer) -> void {
+  const auto size = buffer.committed.load();
+  const auto records = buffer.records.get();
+
+  std::size_t written = 0;
+  for (std::size_t i = 0; i < size; written++) {
+    const auto length = records[i++];
+    for (std::size_t j = 0; j < length; j++) {
+      if (_text_size + MAX_VALUE_TEXT_SIZE > TEXT_BUFFER_SIZE) {
+        _write_text();
+      }
+      if (j != 0) {
+        _text[_text_size++] = ' ';
+      }
+      _text_size += _format(records[i++], _text.get() + _text_size);
+    }
+    if (_text_size + 1 > TEXT_BUFFER_SIZE) {
+      _write_text();
+    }
+    _text[_text_size++] = '\n';
+  }
+  _write_text();
+  _written += written;
+  if (_on_written) {
+    // only now are the sets in the file
+    _on_written(_written);
+  }
+
+  buffer.committed = 0;
+  buffer.state = BufferState::Filling;
+}
+
+auto Logger::_write_text() -> void {
+  std::size_t written = 0;
+  while (written < _text_size) {
+    const auto res = write(_fd, _text.get() + written, _text_size - written);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      // nothing sensible to do about a broken output, drop the text
+      break;
+    }
+    written += static_cast<std::size_t>(res);
+  }
+  _text_size = 0;
+}
+
+auto Logger::_format(ValueType value, char* text) -> std::size_t {
+  static constexpr char DIGIT_PAIRS[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233343"
+      "53637383940414243444546474849505152535455565758596061626364656667686970"
+      "71727374757677787980818283848586878889909192939495969798"
+      "99";
+
+  // digits are produced from the back, two at a time
+  std::array<char, MAX_VALUE_TEXT_SIZE> digits;
+  auto position = digits.size();
+  while (value >= 100) {
+    const auto pair = (value % 100) * 2;
+    value /= 100;
+    digits[--position] = DIGIT_PAIRS[pair + 1];
+    digits[--position] = DIGIT_PAIRS[pair];
+  }
+  if (value >= 10) {
+    digits[--position] = DIGIT_PAIRS[value * 2 + 1];
+    digits[--position] = DIGIT_PAIRS[value * 2];
+  } else {
+    digits[--position] = static_cast<char>('0' + value);
+  }
+
+  const auto length = digits.size() - position;
+  std::memcpy(text, digits.data() + position, length);
+  return length;
+}
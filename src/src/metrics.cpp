@@ -0,0 +1,231 @@
+#include "metrics.hpp"
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cmath>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+#include <string_view>
+#include "common.hpp"
+
+static constexpr std::array<std::string_view, Metrics::COUNTER_COUNT>
+    COUNTER_NAMES = {"link_sent", "link_retransmitted", "link_delivered",
+                     "urb_delivered", "decisions", "link_multicast"};
+
+/// @brief Names of the histograms and by how much their values are divided
+/// when dumped, durations are dumped in microseconds.
+static constexpr std::array<std::pair<std::string_view, std::uint64_t>,
+                            Metrics::HISTOGRAM_COUNT>
+    HISTOGRAM_NAMES = {{{"ack_rtt_us", 1000},
+                        {"urb_time_to_majority_us", 1000},
+                        {"lattice_rounds", 1}}};
+
+static constexpr std::array<std::pair<std::string_view, double>, 4> QUANTILES =
+    {{{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}}};
+
+auto Metrics::_register() -> ThreadSlot* {
+  const auto index = _registered.fetch_add(1);
+  if (index >= MAX_THREADS) {
+    return &_overflow_slot();
+  }
+  auto slot = new ThreadSlot(false);
+  _slots[index].store(slot, std::memory_order_release);
+  return slot;
+}
+
+auto Metrics::snapshot() -> Snapshot {
+  static_assert(std::tuple_size_v<decltype(COUNTER_NAMES)> == COUNTER_COUNT);
+
+  Snapshot result;
+  result.taken_at = Clock::now();
+  const auto sum_up = [&](const ThreadSlot& slot) {
+    for (std::size_t i = 0; i < COUNTER_COUNT; i++) {
+      result.counters[i] += slot.counters[i].load(std::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i < HISTOGRAM_COUNT; i++) {
+      auto& histogram = result.histograms[i];
+      const auto& buckets = slot.histograms[i];
+      for (std::size_t j = 0; j < BUCKETS; j++) {
+        const auto count = buckets.buckets[j].load(std::memory_order_relaxed);
+        histogram.buckets[j] += count;
+        histogram.count += count;
+      }
+      histogram.sum += buckets.sum.load(std::memory_order_relaxed);
+    }
+  };
+
+  const auto count = std::min(_registered.load(), MAX_THREADS);
+  for (std::size_t i = 0; i < count; i++) {
+    // a thread that is registering right now did not record anything yet
+    if (auto slot = _slots[i].load(std::memory_order_acquire)) {
+      sum_up(*slot);
+    }
+  }
+  if (_registered.load() > MAX_THREADS) {
+    sum_up(_overflow_slot());
+  }
+  return result;
+}
+
+auto Metrics::_overflow_slot() -> ThreadSlot& {
+  static ThreadSlot slot(true);
+  return slot;
+}
+
+auto Metrics::_bucket_max(const std::size_t bucket) -> std::uint64_t {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  const auto shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+  const auto sub_bucket = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+  const auto low = (static_cast<std::uint64_t>(SUB_BUCKETS + sub_bucket))
+                   << shift;
+  return low + ((static_cast<std::uint64_t>(1) << shift) - 1);
+}
+
+auto Metrics::HistogramSnapshot::quantile(const double q) const
+    -> std::uint64_t {
+  if (count == 0) {
+    return 0;
+  }
+  const auto rank = std::max<std::uint64_t>(
+      1, static_cast<std::uint64_t>(std::ceil(q * static_cast<double>(count))));
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return _bucket_max(i);
+    }
+  }
+  return _bucket_max(BUCKETS - 1);
+}
+
+auto Metrics::HistogramSnapshot::merge(const HistogramSnapshot& other)
+    -> void {
+  for (std::size_t i = 0; i < BUCKETS; i++) {
+    buckets[i] += other.buckets[i];
+  }
+  count += other.count;
+  sum += other.sum;
+}
+
+Metrics::Reporter::Reporter(
+    const std::optional<Clock::duration> interval,
+    std::vector<std::pair<std::string, Gauge>> gauges)
+    : _interval(interval),
+      _gauges(std::move(gauges)),
+      _thread([this] { _report(); }) {}
+
+Metrics::Reporter::~Reporter() {
+  _done = true;
+  _thread.join();
+}
+
+auto Metrics::Reporter::block_signal() -> void {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  perror_check<int>(
+      [&]() noexcept { return pthread_sigmask(SIG_BLOCK, &set, nullptr); },
+      [](auto res) noexcept { return res != 0; }, "block SIGUSR1", true);
+}
+
+auto Metrics::Reporter::_report() -> void {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+
+  auto next_dump = _interval.has_value()
+                       ? std::optional(Clock::now() + *_interval)
+                       : std::nullopt;
+  while (!_done) {
+    auto wait = Clock::duration(MAX_WAIT);
+    if (next_dump.has_value()) {
+      wait = std::clamp(*next_dump - Clock::now(), Clock::duration::zero(),
+                        wait);
+    }
+    const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(wait);
+    const timespec timeout = {
+        static_cast<time_t>(seconds.count()),
+        static_cast<long>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(wait - seconds)
+                .count())};
+
+    const auto signal = sigtimedwait(&set, nullptr, &timeout);
+    if (signal < 0 && errno != EAGAIN && errno != EINTR) {
+      perror("wait for SIGUSR1");
+      return;
+    }
+
+    const auto now = Clock::now();
+    const auto is_due = next_dump.has_value() && *next_dump <= now;
+    if (signal == SIGUSR1 || is_due) {
+      _dump(Metrics::snapshot());
+    }
+    if (is_due) {
+      next_dump = now + *_interval;
+    }
+  }
+}
+
+auto Metrics::Reporter::_dump(const Snapshot& snapshot) -> void {
+  const auto seconds = [](const Clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+  };
+
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(3);
+  out << "metrics uptime_s " << seconds(snapshot.taken_at - _started_at)
+      << '\n';
+
+  for (std::size_t i = 0; i < COUNTER_COUNT; i++) {
+    out << "counter " << COUNTER_NAMES[i] << ' ' << snapshot.counters[i];
+    if (_previous.has_value()) {
+      const auto elapsed = seconds(snapshot.taken_at - _previous->taken_at);
+      const auto delta = snapshot.counters[i] - _previous->counters[i];
+      out << " per_s "
+          << (elapsed > 0 ? static_cast<double>(delta) / elapsed : 0.0);
+    }
+    out << '\n';
+  }
+
+  for (std::size_t i = 0; i < HISTOGRAM_COUNT; i++) {
+    const auto& histogram = snapshot.histograms[i];
+    const auto [name, divisor] = HISTOGRAM_NAMES[i];
+    const auto scaled = [divisor = divisor](const std::uint64_t value) {
+      return static_cast<double>(value) / static_cast<double>(divisor);
+    };
+
+    out << "histogram " << name << " count " << histogram.count << " mean "
+        << (histogram.count > 0 ? scaled(histogram.sum) /
+                                      static_cast<double>(histogram.count)
+                                : 0.0);
+    for (const auto& [quantile_name, q] : QUANTILES) {
+      out << ' ' << quantile_name << ' ' << scaled(histogram.quantile(q));
+    }
+    out << " max " << scaled(histogram.quantile(1)) << '\n';
+  }
+
+  for (const auto& [name, gauge] : _gauges) {
+    out << "gauge " << name << ' ' << gauge() << '\n';
+  }
+  _previous = snapshot;
+
+  // a single write, so that dumps of concurrent writers do not interleave
+  const auto text = out.str();
+  std::size_t written = 0;
+  while (written < text.size()) {
+    const auto res = perror_check<ssize_t>(
+        [&]() noexcept {
+          return write(STDERR_FILENO, text.data() + written,
+                       text.size() - written);
+        },
+        [](auto res) noexcept { return res < 0; }, "failed to dump metrics");
+    if (res < 0) {
+      return;
+    }
+    written += static_cast<std::size_t>(res);
+  }
+}
@@ -0,0 +1,71 @@
+#include "packet_pool.hpp"
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+PacketPool::Buffer::~Buffer() {
+  if (_pool != nullptr) {
+    _pool->_release(_data, _size_class);
+  }
+}
+
+PacketPool::Buffer::Buffer(Buffer&& other) noexcept
+    : _pool(std::exchange(other._pool, nullptr)),
+      _data(std::exchange(other._data, nullptr)),
+      _size(std::exchange(other._size, 0)),
+      _size_class(other._size_class) {}
+
+auto PacketPool::Buffer::operator=(Buffer&& other) noexcept -> Buffer& {
+  if (this != &other) {
+    if (_pool != nullptr) {
+      _pool->_release(_data, _size_class);
+    }
+    _pool = std::exchange(other._pool, nullptr);
+    _data = std::exchange(other._data, nullptr);
+    _size = std::exchange(other._size, 0);
+    _size_class = other._size_class;
+  }
+  return *this;
+}
+
+auto PacketPool::Buffer::share() const -> Buffer {
+  assert(_pool != nullptr);
+  _ref_count(_data) += 1;
+  return Buffer(_pool, _data, _size, _size_class);
+}
+
+auto PacketPool::acquire(const std::size_t size) -> Buffer {
+  assert(size <= MAX_BUFFER_SIZE);
+
+  std::uint8_t size_class = 0;
+  while (SIZE_CLASSES[size_class] < size) {
+    size_class += 1;
+  }
+
+  auto& free = _free[size_class];
+  if (free.empty()) {
+    // carve a new slab into buffers of this class
+    const auto stride = BUFFER_HEADER_SIZE + SIZE_CLASSES[size_class];
+    const auto slab_size = std::max(SLAB_SIZE, stride);
+    auto& slab = _slabs.emplace_back(new std::uint8_t[slab_size]);
+    for (std::size_t offset = 0; offset + stride <= slab_size;
+         offset += stride) {
+      free.push_back(slab.get() + offset + BUFFER_HEADER_SIZE);
+    }
+  }
+
+  auto data = free.back();
+  free.pop_back();
+  _ref_count(data) = 1;
+  return Buffer(this, data, size, size_class);
+}
+
+auto PacketPool::_release(std::uint8_t* data, const std::uint8_t size_class)
+    -> void {
+  auto& ref_count = _ref_count(data);
+  assert(ref_count > 0);
+  ref_count -= 1;
+  if (ref_count == 0) {
+    _free[size_class].push_back(data);
+  }
+}
@@ -1,85 +1,477 @@
 #include "perfect_link.hpp"
-#include <unistd.h>
+#include <algorithm>
+#include <cassert>
+#include <thread>
 #include "common.hpp"
+#include "metrics.hpp"
 
-const auto& socket_bind = bind;
-
-PerfectLink::PerfectLink(const ProcessIdType id) : _id(id) {}
+PerfectLink::PerfectLink(const ProcessIdType id,
+                         const std::size_t processes,
+                         const LinkOptions options)
+    : _id(id),
+      _options(options),
+      _transport(options.transport != nullptr
+                     ? options.transport
+                     : std::make_shared<SocketTransport>()),
+      _shards(std::max<std::size_t>(options.receive_shards, 1)),
+      _sources(processes) {
+  if (processes > MAX_PROCESSES) {
+    throw std::runtime_error("Too many processes");
+  }
+  if (options.multicast_group.has_value() && _shards.size() > 1) {
+    // the source of a datagram to the group would not decide its shard
+    throw std::runtime_error("Multicast requires a single receive shard");
+  }
+  if (options.state != nullptr) {
+    // twice the members leaves the probe sequences short
+    _sent_capacity = 2 * processes;
+    _sent_states =
+        options.state->records<SentState>("link.sent", _sent_capacity);
+    _acked_states = options.state->records<AckedState>("link.acked", processes);
+  }
+}
 
 PerfectLink::~PerfectLink() {
-  if (_sock_fd.has_value()) {
-    perror_check<int>([this]() noexcept { return close(_sock_fd.value()); },
-                      [](auto res) noexcept { return res < 0; },
-                      "failed to close socket");
+  stop();
+  for (auto& shard : _shards) {
+    shard.endpoint.reset();
   }
-  _done = true;
+  _group_endpoint.reset();
 }
 
 auto PerfectLink::bind(const in_addr_t host, const in_port_t port) -> void {
-  if (_sock_fd.has_value()) {
+  if (_is_bound) {
     throw std::runtime_error("Cannot bind a link twice");
   }
 
-  int sock_fd = perror_check<int>(
-      []() noexcept { return socket(PF_INET, SOCK_DGRAM, 0); },
-      [](auto res) noexcept { return res < 0; }, "socket creation failure",
-      true);
-
-  sockaddr_in addr;
-  std::memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = host;
-  addr.sin_port = port;
-
-  perror_check<int>(
-      [&]() noexcept {
-        return socket_bind(sock_fd, reinterpret_cast<sockaddr*>(&addr),
-                           sizeof(addr));
-      },
-      [](auto res) noexcept { return res < 0; }, "failed to bind socket", true);
-
-  perror_check<int>(
-      [sock_fd]() noexcept {
-        return setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &RESEND_TIMEOUT,
-                          sizeof(RESEND_TIMEOUT));
-      },
-      [](auto res) noexcept { return res < 0; }, "failed to set socket timeout",
-      true);
-
-  _sock_fd = sock_fd;
-}
-
-inline auto PerfectLink::_decode_message(
-    const std::array<uint8_t, MAX_MESSAGE_SIZE>& message,
-    const size_t message_size,
-    std::vector<Slice<uint8_t>>& data_buffer)
-    -> std::tuple<bool, MessageIdType, ProcessIdType, Slice<std::uint8_t>> {
-  bool is_ack = static_cast<bool>(message[0]);
-  MessageIdType seq_nr = 0;
-  for (size_t i = 0; i < sizeof(MessageIdType); i++) {
-    seq_nr |= static_cast<MessageIdType>(message[i + 1]) << (8 * i);
-  }
-  ProcessIdType process_id = message[1 + sizeof(MessageIdType)];
-  auto offset = 1 + sizeof(MessageIdType) + sizeof(ProcessIdType);
-
-  size_t metadata_length = 0;
-  for (size_t i = 0; i < sizeof(MessageSizeType); i++) {
-    metadata_length |= static_cast<size_t>(message[offset++]) << (8 * i);
-  }
-  Slice<uint8_t> metadata(message.data() + offset, metadata_length);
+  for (auto& shard : _shards) {
+    shard.endpoint = _transport->open(host, port, _shards.size() > 1);
+  }
+  _self_key = _address_key(make_address(host, port));
+  if (_options.multicast_group.has_value()) {
+    _group_endpoint = _transport->open_group(*_options.multicast_group,
+                                             make_address(host, port));
+  }
+  _is_bound = true;
+
+  if (_options.state != nullptr && _options.state->is_restored()) {
+    _restore();
+  }
+}
+
+auto PerfectLink::_restore() -> void {
+  for (std::size_t i = 0; i < _sources.size(); i++) {
+    auto& acked = _acked_states[i];
+    const auto source_key = acked.source_key.load(std::memory_order_acquire);
+    if (source_key == 0) {
+      continue;
+    }
+    auto& source = _sources[i];
+    const auto& ack = acked.acks[acked.current.load(std::memory_order_acquire)];
+    source.watermark = ack.watermark;
+    for (MessageIdType j = 0; j < SACK_WINDOW; j++) {
+      source.above_watermark[(ack.watermark + 1 + j) % DELIVERED_WINDOW] =
+          (ack.sack >> j) & 1;
+    }
+    source.addr = _address(source_key);
+  }
+
+  // peers we sent to learn that the messages we did not transmit are gone
+  for (std::size_t i = 0; i < _sent_capacity; i++) {
+    const auto key = _sent_states[i].peer_key.load(std::memory_order_acquire);
+    if (key == 0 || key == _self_key) {
+      continue;
+    }
+    auto& shard = _shard(key);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    Datagrams datagrams;
+    _fill_window(shard, _peer(shard, key, _address(key)), key,
+                 _transport->now(), datagrams);
+    datagrams.flush(*shard.endpoint, "failed to send message");
+  }
+
+  // and sources that we delivered what they are still resending
+  std::vector<std::array<std::uint8_t, ACK_MESSAGE_SIZE>> acks(
+      _sources.size());
+  std::vector<iovec> iovecs(_sources.size());
+  std::vector<mmsghdr> headers;
+  for (std::size_t i = 0; i < _sources.size(); i++) {
+    if (_acked_states[i].source_key.load(std::memory_order_relaxed) == 0) {
+      continue;
+    }
+    auto& source = _sources[i];
+    _encode_ack(acks[i].data(), source.watermark, source.sack());
+    iovecs[i] = {acks[i].data(), ACK_MESSAGE_SIZE};
+    auto& header = headers.emplace_back();
+    std::memset(&header, 0, sizeof(header));
+    header.msg_hdr.msg_name = &source.addr;
+    header.msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    header.msg_hdr.msg_iov = &iovecs[i];
+    header.msg_hdr.msg_iovlen = 1;
+  }
+  _send_all(*_shards.front().endpoint, headers.data(), headers.size(),
+            "failed to send ack");
+}
+
+auto PerfectLink::_peer(Shard& shard,
+                        const std::uint64_t peer_key,
+                        const sockaddr_in& addr) -> Peer& {
+  auto [entry, inserted] =
+      shard.peers.try_emplace(peer_key, addr, _options.max_in_flight);
+  auto& peer = entry->second;
+  if (!inserted || _sent_states == nullptr) {
+    return peer;
+  }
+
+  peer.sent_state = _sent_state(peer_key);
+  if (peer.sent_state == nullptr) {
+    return peer;
+  }
+  const auto seq_nr = peer.sent_state->seq_nr.load(std::memory_order_relaxed);
+  if (seq_nr > peer.seq_nr) {
+    // a previous run transmitted the numbers below, the messages are lost
+    // with it
+    peer.seq_nr = seq_nr;
+    peer.transmit_seq_nr = seq_nr;
+    auto body = shard.pool.acquire(_body_size(0, Payloads(nullptr, 0), 0));
+    _encode_body(body.data(), Slice<std::uint8_t>(nullptr, 0),
+                 Payloads(nullptr, 0), 0);
+    peer.pending_for_ack.try_emplace(peer.seq_nr, peer.seq_nr, std::move(body),
+                                     RESTART_FLAG);
+    peer.seq_nr += 1;
+  }
+  return peer;
+}
+
+auto PerfectLink::_sent_state(const std::uint64_t peer_key) -> SentState* {
+  for (std::size_t probe = 0; probe < _sent_capacity; probe++) {
+    auto& state = _sent_states[(peer_key + probe) % _sent_capacity];
+    auto key = state.peer_key.load(std::memory_order_acquire);
+    // the shards claim slots concurrently
+    if (key == 0 &&
+        state.peer_key.compare_exchange_strong(key, peer_key,
+                                               std::memory_order_acq_rel)) {
+      return &state;
+    }
+    if (key == peer_key) {
+      return &state;
+    }
+  }
+  return nullptr;
+}
+
+auto PerfectLink::_expedite(const sockaddr_in& addr) -> void {
+  const auto key = _address_key(addr);
+  auto& shard = _shard(key);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  auto peer_entry = shard.peers.find(key);
+  if (peer_entry == shard.peers.end()) {
+    return;
+  }
+  auto& peer = peer_entry->second;
+  peer.srtt = Clock::duration::zero();
+  peer.rttvar = Clock::duration::zero();
+  peer.rto = INITIAL_RTO;
+
+  const auto now = _transport->now();
+  Datagrams datagrams;
+  std::size_t resent = 0;
+  for (auto& [seq_nr, pending] : peer.pending_for_ack) {
+    if (seq_nr >= peer.transmit_seq_nr) {
+      break;
+    }
+    pending.retransmitted = true;
+    pending.deadline = now + peer.rto;
+    shard.retransmit_timers.emplace(pending.deadline, key, seq_nr);
+    datagrams.push(pending, &peer.addr);
+    resent += 1;
+  }
+  if (resent == 0) {
+    return;
+  }
+  _schedule(shard, now + peer.rto);
+  Metrics::increment(Metrics::Counter::LinkRetransmitted, resent);
+  datagrams.flush(*shard.endpoint, "failed to resend message");
+}
+
+auto PerfectLink::_encode_ack(std::uint8_t* ack,
+                              const MessageIdType watermark,
+                              const SackType sack) const -> void {
+  // ack = [flags, ...watermark, | ...process_id, ...sack_length, ...sack]
+  Header::store(ack, ACK_FLAG, watermark);
+  auto offset = HEADER_SIZE;
+  codec::store_le(ack + offset, _id);
+  offset += sizeof(ProcessIdType);
+  codec::store_le(ack + offset, static_cast<MessageSizeType>(sizeof(sack)));
+  offset += sizeof(MessageSizeType);
+  codec::store_le(ack + offset, sack);
+  assert(offset + sizeof(sack) == ACK_MESSAGE_SIZE);
+}
+
+inline auto PerfectLink::_decode_body(const std::uint8_t* body,
+                                      const std::size_t body_size,
+                                      std::vector<Slice<uint8_t>>& data_buffer)
+    -> std::optional<Slice<std::uint8_t>> {
+  // the process id was already read by the caller
+  auto offset = sizeof(ProcessIdType);
+
+  // lengths come off the network, none may reach past the body
+  if (offset + sizeof(MessageSizeType) > body_size) {
+    return std::nullopt;
+  }
+  const auto metadata_length = codec::load_le<MessageSizeType>(body + offset);
+  offset += sizeof(MessageSizeType);
+  if (offset + metadata_length > body_size) {
+    return std::nullopt;
+  }
+  Slice<uint8_t> metadata(body + offset, metadata_length);
   offset += metadata_length;
 
   data_buffer.clear();
-  while (offset < message_size) {
-    size_t length = 0;
-    for (size_t i = 0; i < sizeof(MessageSizeType); i++) {
-      length |= static_cast<size_t>(message[offset++]) << (8 * i);
+  while (offset < body_size) {
+    if (offset + sizeof(MessageSizeType) > body_size) {
+      return std::nullopt;
     }
-    data_buffer.emplace_back(message.data() + offset, length);
+    const auto length = codec::load_le<MessageSizeType>(body + offset);
+    offset += sizeof(MessageSizeType);
+    if (offset + length > body_size) {
+      return std::nullopt;
+    }
+    data_buffer.emplace_back(body + offset, length);
     offset += length;
   }
 
-  return {is_ack, seq_nr, process_id, metadata};
+  return metadata;
+}
+
+auto PerfectLink::_body_size(const std::size_t metadata_size,
+                             const Payloads datas,
+                             const std::size_t count) -> std::size_t {
+  auto size = sizeof(ProcessIdType) + sizeof(MessageSizeType) + metadata_size;
+  for (std::size_t i = 0; i < count; i++) {
+    size += sizeof(MessageSizeType) + datas[i].size();
+  }
+  return size;
+}
+
+auto PerfectLink::_encode_body(std::uint8_t* body,
+                               const Slice<std::uint8_t> metadata,
+                               const Payloads datas,
+                               const std::size_t count) const -> void {
+  // message = [is_ack, ...seq_nr, | ...process_id,
+  //            ...metadata_length, ...metadata,
+  //            ...[data_length, ...data]]
+  codec::store_le(body, _id);
+  auto offset = sizeof(ProcessIdType);
+
+  offset += _encode_data(body + offset, metadata);
+  for (std::size_t i = 0; i < count; i++) {
+    offset += _encode_data(body + offset, datas[i]);
+  }
+}
+
+auto PerfectLink::_encode_data(std::uint8_t* message,
+                               const Slice<std::uint8_t> data) -> std::size_t {
+  codec::store_le(message, static_cast<MessageSizeType>(data.size()));
+  if (data.size() > 0) {
+    std::memcpy(message + sizeof(MessageSizeType), &data[0], data.size());
+  }
+  return sizeof(MessageSizeType) + data.size();
+}
+
+auto PerfectLink::packable(const std::size_t metadata_size,
+                           const Payloads datas) -> std::size_t {
+  auto size = HEADER_SIZE + _body_size(metadata_size, datas, 0);
+  std::size_t count = 0;
+  for (; count < datas.size(); count++) {
+    size += sizeof(MessageSizeType) + datas[count].size();
+    if (size > MAX_MESSAGE_SIZE) {
+      break;
+    }
+  }
+  // a payload too large for a datagram is sent alone, in fragments
+  if (count == 0 && datas.size() > 0) {
+    return 1;
+  }
+  return count;
+}
+
+auto PerfectLink::send(const in_addr_t host,
+                       const in_port_t port,
+                       const Slice<std::uint8_t> metadata,
+                       const Payloads datas) -> std::size_t {
+  return send_batch({make_address(host, port)}, metadata, datas);
+}
+
+auto PerfectLink::send_batch(const std::vector<sockaddr_in>& addrs,
+                             const Slice<std::uint8_t> metadata,
+                             const Payloads datas) -> std::size_t {
+  if (!_is_bound) {
+    throw std::runtime_error("Cannot send if not bound");
+  }
+
+  const auto count = packable(metadata.size(), datas);
+  const auto body_size = _body_size(metadata.size(), datas, count);
+  if (body_size > MAX_FRAGMENTED_SIZE) {
+    throw std::runtime_error("Message is too large");
+  }
+  const auto is_fragmented = HEADER_SIZE + body_size > MAX_MESSAGE_SIZE;
+
+  const auto coalesce = _options.coalesce_delay != Clock::duration::zero() &&
+                        metadata.size() == 0 && !is_fragmented;
+
+  // a copy to ourselves does not need to go through the network
+  const auto is_self = [&](const sockaddr_in& addr) {
+    return _address_key(addr) == _self_key;
+  };
+  if (std::any_of(addrs.begin(), addrs.end(), is_self)) {
+    _loop_back(metadata, datas, count, body_size);
+  }
+
+  for (auto& shard : _shards) {
+    const auto in_shard = [&](const sockaddr_in& addr) {
+      return !is_self(addr) && &_shard(_address_key(addr)) == &shard;
+    };
+    if (std::none_of(addrs.begin(), addrs.end(), in_shard)) {
+      continue;
+    }
+
+    Datagrams datagrams;
+    // transmitted to once the message was queued for all of them, so that
+    // a multicast group can take it to many at once
+    std::vector<std::pair<std::uint64_t, Peer*>> queued;
+
+    // the datagrams point into pending messages, so the lock is held until
+    // they are sent to prevent an ACK from freeing them
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    const auto now = _transport->now();
+
+    // encoded once per shard and referenced by the pending message of every
+    // destination in it
+    PacketPool::Buffer body;
+    std::vector<PacketPool::Buffer> fragments;
+    if (!coalesce) {
+      body = shard.pool.acquire(body_size);
+      _encode_body(body.data(), metadata, datas, count);
+    }
+    if (is_fragmented) {
+      fragments = _fragment(shard, body);
+    }
+
+    for (const auto& addr : addrs) {
+      if (!in_shard(addr)) {
+        continue;
+      }
+      const auto key = _address_key(addr);
+      auto& peer = _peer(shard, key, addr);
+      if (coalesce) {
+        _coalesce(shard, peer, key, datas, count, now, datagrams);
+      } else if (is_fragmented) {
+        // fragments take consecutive sequence numbers, so that the receiver
+        // can tell where the message starts
+        for (const auto& fragment : fragments) {
+          peer.pending_for_ack.try_emplace(peer.seq_nr, peer.seq_nr,
+                                           fragment.share(), FRAGMENT_FLAG);
+          peer.seq_nr += 1;
+        }
+        queued.emplace_back(key, &peer);
+      } else {
+        peer.pending_for_ack.try_emplace(peer.seq_nr, peer.seq_nr,
+                                         body.share());
+        peer.seq_nr += 1;
+        queued.emplace_back(key, &peer);
+      }
+    }
+    _fill_windows(shard, queued, now, datagrams);
+
+    // when coalescing, only full outboxes were flushed
+    datagrams.flush(*shard.endpoint, "failed to send message");
+  }
+
+  return count;
+}
+
+auto PerfectLink::_fragment(Shard& shard, const PacketPool::Buffer& body) const
+    -> std::vector<PacketPool::Buffer> {
+  const auto count = static_cast<FragmentIndexType>(
+      (body.size() + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE);
+  std::vector<PacketPool::Buffer> fragments;
+  fragments.reserve(count);
+
+  // fragment = [...process_id, ...index, ...count, ...chunk]
+  for (FragmentIndexType index = 0; index < count; index++) {
+    const auto position = static_cast<std::size_t>(index) * FRAGMENT_SIZE;
+    const auto chunk_size = std::min(FRAGMENT_SIZE, body.size() - position);
+    auto& fragment =
+        fragments.emplace_back(shard.pool.acquire(FRAGMENT_HEADER_SIZE +
+                                                  chunk_size));
+
+    FragmentHeader::store(fragment.data(), _id, index, count);
+    std::memcpy(fragment.data() + FRAGMENT_HEADER_SIZE,
+                body.data() + position, chunk_size);
+  }
+
+  return fragments;
+}
+
+auto PerfectLink::_is_valid_fragment(const Source& source,
+                                     const MessageIdType seq_nr,
+                                     const std::uint8_t* fragment,
+                                     const std::size_t fragment_size) -> bool {
+  // fragments arrive from the network, a malformed one must not write past
+  // the body it is reassembled into
+  if (fragment_size < FRAGMENT_HEADER_SIZE) {
+    return false;
+  }
+  const auto [_, index, count] = FragmentHeader::load(fragment);
+  if (index >= count || index >= seq_nr) {
+    return false;
+  }
+  const auto position = static_cast<std::size_t>(index) * FRAGMENT_SIZE;
+  const auto chunk_size = fragment_size - FRAGMENT_HEADER_SIZE;
+  if (chunk_size > FRAGMENT_SIZE ||
+      position + chunk_size > _reassembly_size(count)) {
+    return false;
+  }
+
+  // the other fragments of the message have to agree on its size
+  const auto entry = source.reassemblies.find(seq_nr - index);
+  return entry == source.reassemblies.end() || entry->second.count == count;
+}
+
+auto PerfectLink::_reassemble(Shard& shard,
+                              Source& source,
+                              const MessageIdType seq_nr,
+                              const std::uint8_t* fragment,
+                              const std::size_t fragment_size)
+    -> std::optional<PacketPool::Buffer> {
+  // checked by `_is_valid_fragment`, the process id was read by the caller
+  const auto [_, index, count] = FragmentHeader::load(fragment);
+
+  auto [entry, inserted] = source.reassemblies.try_emplace(seq_nr - index);
+  auto& reassembly = entry->second;
+  if (inserted) {
+    // the size of the last fragment is not known yet
+    reassembly.body =
+        shard.reassembly_pool.acquire(_reassembly_size(count));
+    reassembly.count = count;
+    reassembly.missing = count;
+  }
+
+  const auto position = static_cast<std::size_t>(index) * FRAGMENT_SIZE;
+  const auto chunk_size = fragment_size - FRAGMENT_HEADER_SIZE;
+  std::memcpy(reassembly.body.data() + position,
+              fragment + FRAGMENT_HEADER_SIZE, chunk_size);
+  reassembly.size = std::max(reassembly.size, position + chunk_size);
+  reassembly.missing -= 1;
+
+  if (reassembly.missing > 0) {
+    return std::nullopt;
+  }
+  auto body = std::move(reassembly.body);
+  body.truncate(reassembly.size);
+  source.reassemblies.erase(entry);
+  return body;
 }
 
 auto PerfectLink::listen(ListenCallback callback) -> void {
@@ -93,93 +485,849 @@ auto PerfectLink::listen(ListenCallback callback) -> void {
 }
 
 auto PerfectLink::listen_batch(ListenBatchCallback callback) -> void {
-  if (!_sock_fd.has_value()) {
+  if (!_is_bound) {
+    throw std::runtime_error("Cannot listen if not bound");
+  }
+  // shards of a served link are already dispatching to its callback
+  if (_is_served) {
+    throw std::runtime_error("Cannot listen twice");
+  }
+
+  // a stop before the reactors are created makes them return right away
+  {
+    std::lock_guard<std::mutex> guard(_reactors_mutex);
+    for (std::size_t i = 0; i < _shards.size(); i++) {
+      _reactors.push_back(_transport->reactor());
+      if (_stopped) {
+        _reactors.back()->stop();
+      }
+    }
+  }
+
+  _callback = std::move(callback);
+  _is_served = true;
+  for (std::size_t i = 0; i < _shards.size(); i++) {
+    _attach(_shards[i], *_reactors[i]);
+  }
+
+  // the calling thread runs the reactor of the first shard
+  std::vector<std::thread> workers;
+  for (std::size_t i = 1; i < _shards.size(); i++) {
+    workers.emplace_back([this, i] { _reactors[i]->run(); });
+  }
+  _reactors.front()->run();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+auto PerfectLink::serve(Reactor& reactor, ListenBatchCallback callback)
+    -> void {
+  if (!_is_bound) {
     throw std::runtime_error("Cannot listen if not bound");
   }
-  auto sock_fd = _sock_fd.value();
+  if (_is_served) {
+    throw std::runtime_error("Cannot listen twice");
+  }
 
-  std::array<uint8_t, MAX_MESSAGE_SIZE> message;
-  std::vector<Slice<std::uint8_t>> data_buffer;
+  _callback = std::move(callback);
+  _is_served = true;
+  for (auto& shard : _shards) {
+    _attach(shard, reactor);
+  }
+}
+
+auto PerfectLink::stop() -> void {
+  std::lock_guard<std::mutex> guard(_reactors_mutex);
+  _stopped = true;
+  for (auto& reactor : _reactors) {
+    reactor->stop();
+  }
+}
+
+PerfectLink::Receiver::Receiver() : messages(RECV_BATCH_SIZE) {
+  std::memset(headers.data(), 0, sizeof(headers));
+  for (std::size_t i = 0; i < RECV_BATCH_SIZE; i++) {
+    iovecs[i].iov_base = messages[i].data();
+    iovecs[i].iov_len = messages[i].size();
+    headers[i].msg_hdr.msg_iov = &iovecs[i];
+    headers[i].msg_hdr.msg_iovlen = 1;
+    headers[i].msg_hdr.msg_name = &sender_addrs[i];
+  }
+
+  std::memset(ack_headers.data(), 0, sizeof(ack_headers));
+  for (std::size_t i = 0; i < RECV_BATCH_SIZE; i++) {
+    ack_iovecs[i].iov_base = acks[i].data();
+    ack_headers[i].msg_hdr.msg_iov = &ack_iovecs[i];
+    ack_headers[i].msg_hdr.msg_iovlen = 1;
+    ack_headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+  }
+  to_ack.reserve(RECV_BATCH_SIZE);
   data_buffer.reserve(MAX_MESSAGE_COUNT_IN_PACKET);
+}
 
-  sockaddr_in sender_addr;
-  std::memset(&sender_addr, 0, sizeof(sender_addr));
-  socklen_t sender_addr_len = sizeof(sender_addr);
+auto PerfectLink::_attach(Shard& shard, Reactor& reactor) -> void {
+  shard.receiver = std::make_unique<Receiver>();
+  reactor.watch(*shard.endpoint,
+                [this, &shard] { _on_readable(shard, *shard.endpoint); });
+  if (_group_endpoint != nullptr) {
+    // there is a single shard, its sources are the ones of the group
+    reactor.watch(*_group_endpoint,
+                  [this, &shard] { _on_readable(shard, *_group_endpoint); });
+  }
+  const auto timer = reactor.add_timer([this, &shard] { _on_timer(shard); });
 
-  while (true) {
-    // wait for a message
-    auto message_size =
-        recvfrom(sock_fd, message.data(), message.size(), MSG_WAITALL,
-                 reinterpret_cast<sockaddr*>(&sender_addr), &sender_addr_len);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  shard.reactor = &reactor;
+  shard.timer = timer;
+  // messages sent before the link was served already have deadlines
+  _arm_next(shard);
+}
 
-    if (_done) {
-      return;
+auto PerfectLink::_on_readable(Shard& shard, Endpoint& endpoint) -> void {
+  auto& [messages, sender_addrs, iovecs, headers, acks, ack_iovecs,
+         ack_headers, to_ack, data_buffer, opened] = *shard.receiver;
+  auto& callback = _callback;
+
+  // readiness is level triggered, what is left is received after the other
+  // events of the reactor
+  for (std::size_t batch = 0; batch < MAX_BATCHES_PER_EVENT; batch++) {
+    for (auto& header : headers) {
+      header.msg_hdr.msg_namelen = sizeof(sockaddr_in);
     }
 
-    if (message_size < 0 && errno == EINTR) {
+    const auto received = endpoint.receive(headers.data(), RECV_BATCH_SIZE);
+
+    if (received < 0 && errno == EINTR) {
       // got interrupted, try again
       continue;
     }
 
-    if (message_size < 0 && errno == EAGAIN) {
-      // TODO: consider scoping resends to a single process
-      // TODO: doing awful lot of resends
-      // timed out, resend messages without ACKs
-      std::lock_guard<std::mutex> guard(_pending_for_ack_mutex);
-      for (auto& [seq_nr, pending] : _pending_for_ack) {
-        perror_check<ssize_t>(
-            [&, &seq_nr = seq_nr, &pending = pending]() noexcept {
-              return sendto(sock_fd, pending.message.data(),
-                            pending.message_size, 0,
-                            reinterpret_cast<const sockaddr*>(&pending.addr),
-                            sizeof(pending.addr));
-            },
-            [](auto res) noexcept { return res < 0; },
-            "failed to resend message");
-      }
-      continue;
+    if (received < 0 && errno == EAGAIN) {
+      // took everything that arrived
+      return;
     }
 
-    if (message_size < 0) {
+    if (received < 0) {
       perror("failed to receive message");
-      continue;
+      return;
     }
 
-    auto [is_ack, seq_nr, process_id, metadata] = _decode_message(
-        message, static_cast<size_t>(message_size), data_buffer);
+    for (std::size_t i = 0; i < static_cast<std::size_t>(received); i++) {
+      if (headers[i].msg_len < HEADER_SIZE) {
+        // not one of ours
+        continue;
+      }
+      const auto message = messages[i].data();
+      auto body = message + HEADER_SIZE;
+      auto body_size = headers[i].msg_len - HEADER_SIZE;
+      auto [flags, seq_nr] = Header::load(message);
 
-    if (is_ack) {
-      // mark a sent message as being acknowledged, we will no longer be
-      // sending it
-      {
-        std::lock_guard<std::mutex> guard(_pending_for_ack_mutex);
-        _pending_for_ack.erase(seq_nr);
+      if (flags & MULTICAST_FLAG) {
+        // the group takes the message to many peers, each with its own seq_nr
+        const auto entry = _find_multicast_entry(message, headers[i].msg_len);
+        if (!entry.has_value()) {
+          continue;
+        }
+        const auto [own_seq_nr, body_offset] = *entry;
+        seq_nr = own_seq_nr;
+        body = message + body_offset;
+        body_size = headers[i].msg_len - body_offset;
+      }
+
+      if (flags & ACK_FLAG) {
+        // the seq_nr of an ACK is cumulative, metadata holds the SACK bitmap
+        const auto metadata = _decode_body(body, body_size, data_buffer);
+        if (!metadata.has_value()) {
+          continue;
+        }
+        const auto sack = metadata->size() >= sizeof(SackType)
+                              ? codec::load_le<SackType>(&(*metadata)[0])
+                              : 0;
+        if (_handle_ack(sender_addrs[i], seq_nr, sack)) {
+          const auto key = _address_key(sender_addrs[i]);
+          if (std::find(opened.begin(), opened.end(), key) == opened.end()) {
+            opened.push_back(key);
+          }
+        }
+        continue;
       }
-    } else {
-      // we received a potentially new message
-      _delivered_mutex.lock();
-      auto has_not_been_delivered =
-          _delivered.emplace(process_id, seq_nr).second;
-      _delivered_mutex.unlock();
 
-      if (has_not_been_delivered) {
+      // both messages and fragments start with the process id
+      if (body_size < sizeof(ProcessIdType)) {
+        continue;
+      }
+      const auto process_id = codec::load_le<ProcessIdType>(body);
+      if (!is_member(process_id)) {
+        // not a member, nothing to deliver or acknowledge
+        continue;
+      }
+      auto& source = _sources[process_id - 1];
+      const auto is_new =
+          source.is_beyond_window(seq_nr) || !source.is_delivered(seq_nr);
+      if (flags & RESTART_FLAG) {
+        // the sender restarted, it no longer has the messages below and
+        // missed what we sent while it was gone
+        if (is_new) {
+          source.skip_to(seq_nr);
+          source.mark_delivered(seq_nr);
+          _expedite(sender_addrs[i]);
+        }
+      } else if (source.is_beyond_window(seq_nr)) {
+        continue;
+      } else if (is_new && (flags & FRAGMENT_FLAG)) {
+        if (!_is_valid_fragment(source, seq_nr, body, body_size)) {
+          // malformed, neither delivered nor acknowledged
+          continue;
+        }
+        source.mark_delivered(seq_nr);
+        Metrics::increment(Metrics::Counter::LinkDelivered);
+        auto whole = _reassemble(shard, source, seq_nr, body, body_size);
+        if (whole.has_value()) {
+          // its fragments were acknowledged already, a malformed body is
+          // dropped as a whole
+          const auto metadata =
+              _decode_body(whole->data(), whole->size(), data_buffer);
+          if (metadata.has_value()) {
+            OwnedSlice m = *metadata;
+            callback(process_id, m, data_buffer);
+          }
+        }
+      } else if (is_new) {
+        const auto metadata = _decode_body(body, body_size, data_buffer);
+        if (!metadata.has_value()) {
+          continue;
+        }
         // we have not yet delivered the message, do it now
-        OwnedSlice m = metadata;
+        source.mark_delivered(seq_nr);
+        Metrics::increment(Metrics::Counter::LinkDelivered);
+        OwnedSlice m = *metadata;
         callback(process_id, m, data_buffer);
       }
 
-      // send an ACK
-      auto [ack_message, ack_message_size] =
-          _prepare_message(seq_nr, true, std::nullopt);
-      perror_check<ssize_t>(
-          [&, &ack_message = ack_message,
-           &ack_message_size = ack_message_size]() noexcept {
-            return sendto(
-                sock_fd, ack_message.data(), ack_message_size, MSG_NOSIGNAL,
-                reinterpret_cast<sockaddr*>(&sender_addr), sender_addr_len);
-          },
-          [](auto res) noexcept { return res < 0 && errno != EPIPE; },
-          "failed to send ack");
+      // acknowledge at the end of the batch, also for duplicates since the
+      // sender might have missed our previous ACK
+      if (!source.dirty) {
+        source.dirty = true;
+        to_ack.push_back(process_id);
+      }
+      source.addr = sender_addrs[i];
+    }
+
+    for (std::size_t i = 0; i < to_ack.size(); i++) {
+      auto& source = _sources[to_ack[i] - 1];
+      source.dirty = false;
+
+      const auto sack = source.sack();
+      if (_acked_states != nullptr) {
+        // a source is only acknowledged by the shard it hashes to, the ACK is
+        // stored into the slot a restart does not read
+        auto& acked = _acked_states[to_ack[i] - 1];
+        const auto next = 1 - acked.current.load(std::memory_order_relaxed);
+        acked.acks[next] = {source.watermark, sack};
+        acked.current.store(next, std::memory_order_release);
+        acked.source_key.store(_address_key(source.addr),
+                               std::memory_order_release);
+      }
+      _encode_ack(acks[i].data(), source.watermark, sack);
+      ack_iovecs[i].iov_len = ACK_MESSAGE_SIZE;
+      ack_headers[i].msg_hdr.msg_name = &source.addr;
+    }
+
+    // ACKs always leave from our own address, the sender knows us by it
+    _send_all(*shard.endpoint, ack_headers.data(), to_ack.size(),
+              "failed to send ack");
+    to_ack.clear();
+
+    // windows opened by the ACKs of the batch are filled together, so that
+    // the same message of many peers goes out once
+    if (!opened.empty()) {
+      _fill_opened(opened);
+      opened.clear();
+    }
+
+    if (static_cast<std::size_t>(received) < RECV_BATCH_SIZE) {
+      return;
+    }
+  }
+}
+
+auto PerfectLink::_find_multicast_entry(const std::uint8_t* message,
+                                        const std::size_t size) const
+    -> std::optional<std::tuple<MessageIdType, std::size_t>> {
+  // datagram = [flags, ...entry_count,
+  //             ...[...address_key, ...seq_nr], | ...body]
+  if (size < MULTICAST_HEADER_SIZE) {
+    return std::nullopt;
+  }
+  const auto [_, entry_count] = MulticastHeader::load(message);
+  const auto body_offset =
+      MULTICAST_HEADER_SIZE + entry_count * MULTICAST_ENTRY_SIZE;
+  if (body_offset > size) {
+    return std::nullopt;
+  }
+
+  for (std::size_t entry = 0; entry < entry_count; entry++) {
+    const auto data =
+        message + MULTICAST_HEADER_SIZE + entry * MULTICAST_ENTRY_SIZE;
+    if (codec::load_le<std::uint64_t, ADDRESS_KEY_SIZE>(data) != _self_key) {
+      continue;
+    }
+    const auto seq_nr =
+        codec::load_le<MessageIdType>(data + ADDRESS_KEY_SIZE);
+    return std::make_tuple(seq_nr, body_offset);
+  }
+  return std::nullopt;
+}
+
+auto PerfectLink::_on_timer(Shard& shard) -> void {
+  {
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    // the timer expired, it is armed again once the overdue work is done
+    shard.armed = Clock::time_point::max();
+  }
+  if (&shard == &_shards.front()) {
+    _deliver_looped_back(shard);
+  }
+  _flush_overdue_outboxes(shard);
+  _resend_overdue(shard);
+
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  _arm_next(shard);
+}
+
+auto PerfectLink::_loop_back(const Slice<std::uint8_t> metadata,
+                             const Payloads datas,
+                             const std::size_t count,
+                             const std::size_t body_size) -> void {
+  bool was_empty;
+  {
+    std::lock_guard<std::mutex> guard(_loopback.mutex);
+    auto body = _loopback.pool.acquire(body_size);
+    _encode_body(body.data(), metadata, datas, count);
+    was_empty = _loopback.queued.empty();
+    _loopback.queued.push_back(std::move(body));
+  }
+
+  // whoever queued the first message wakes the reactor, it takes all of them
+  if (was_empty) {
+    auto& shard = _shards.front();
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    _schedule(shard, _transport->now());
+  }
+}
+
+auto PerfectLink::_deliver_looped_back(Shard& shard) -> void {
+  auto& delivering = _loopback.delivering;
+  {
+    std::lock_guard<std::mutex> guard(_loopback.mutex);
+    std::swap(_loopback.queued, delivering);
+  }
+  if (delivering.empty()) {
+    return;
+  }
+
+  // the callback may send to ourselves again, so no lock is held
+  auto& data_buffer = shard.receiver->data_buffer;
+  for (const auto& body : delivering) {
+    // encoded by this link, so always well formed
+    if (const auto decoded =
+            _decode_body(body.data(), body.size(), data_buffer)) {
+      OwnedSlice metadata = *decoded;
+      _callback(_id, metadata, data_buffer);
+    }
+  }
+  Metrics::increment(Metrics::Counter::LinkDelivered, delivering.size());
+
+  // the buffers go back to the pool under its lock
+  std::lock_guard<std::mutex> guard(_loopback.mutex);
+  delivering.clear();
+}
+
+auto PerfectLink::_schedule(Shard& shard, const Clock::time_point deadline)
+    -> void {
+  if (shard.reactor != nullptr && deadline < shard.armed) {
+    shard.armed = deadline;
+    shard.reactor->arm(shard.timer, deadline);
+  }
+}
+
+auto PerfectLink::_arm_next(Shard& shard) -> void {
+  auto next = Clock::time_point::max();
+  if (!shard.retransmit_timers.empty()) {
+    next = std::max(shard.retransmit_timers.top().deadline,
+                    _transport->now() + TIMER_SLACK);
+  }
+  if (shard.outbox_deadline.has_value()) {
+    next = std::min(next, shard.outbox_deadline.value());
+  }
+  if (&shard == &_shards.front()) {
+    // messages looped back before the link was served or by the callback
+    std::lock_guard<std::mutex> guard(_loopback.mutex);
+    if (!_loopback.queued.empty()) {
+      next = _transport->now();
+    }
+  }
+  _schedule(shard, next);
+}
+
+auto PerfectLink::Source::mark_delivered(const MessageIdType seq_nr) -> void {
+  above_watermark[seq_nr % DELIVERED_WINDOW] = true;
+
+  // advance the watermark over the contiguous delivered prefix, freeing ring
+  // slots for messages further ahead
+  while (above_watermark[(watermark + 1) % DELIVERED_WINDOW]) {
+    watermark += 1;
+    above_watermark[watermark % DELIVERED_WINDOW] = false;
+  }
+}
+
+auto PerfectLink::Source::skip_to(const MessageIdType seq_nr) -> void {
+  if (seq_nr <= watermark + 1) {
+    return;
+  }
+  const auto end = std::min(seq_nr - 1, watermark + DELIVERED_WINDOW);
+  for (auto skipped = watermark + 1; skipped <= end; skipped++) {
+    above_watermark[skipped % DELIVERED_WINDOW] = false;
+  }
+  watermark = seq_nr - 1;
+  for (auto entry = reassemblies.begin(); entry != reassemblies.end();) {
+    entry = entry->first < seq_nr ? reassemblies.erase(entry) : ++entry;
+  }
+
+  // messages right above were delivered before
+  while (above_watermark[(watermark + 1) % DELIVERED_WINDOW]) {
+    watermark += 1;
+    above_watermark[watermark % DELIVERED_WINDOW] = false;
+  }
+}
+
+auto PerfectLink::Source::sack() const -> SackType {
+  SackType sack = 0;
+  for (MessageIdType j = 0; j < SACK_WINDOW; j++) {
+    if (above_watermark[(watermark + 1 + j) % DELIVERED_WINDOW]) {
+      sack |= static_cast<SackType>(1) << j;
+    }
+  }
+  return sack;
+}
+
+auto PerfectLink::_handle_ack(const sockaddr_in& addr,
+                              const MessageIdType cumulative,
+                              const SackType sack) -> bool {
+  const auto key = _address_key(addr);
+  auto& shard = _shard(key);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  auto peer_entry = shard.peers.find(key);
+  if (peer_entry == shard.peers.end()) {
+    return false;
+  }
+  auto& peer = peer_entry->second;
+  auto& pending = peer.pending_for_ack;
+  const auto pending_count = pending.size();
+
+  // the newest acknowledged message that was sent only once gives an RTT
+  // sample
+  std::optional<Clock::time_point> sent_at;
+  const auto sample = [&](const auto entry) {
+    if (!entry->second.retransmitted &&
+        (!sent_at.has_value() || *sent_at < entry->second.sent_at)) {
+      sent_at = entry->second.sent_at;
+    }
+  };
+
+  // mark sent messages as being acknowledged, we will no longer be sending them
+  const auto end = pending.upper_bound(cumulative);
+  for (auto entry = pending.begin(); entry != end; entry++) {
+    sample(entry);
+  }
+  pending.erase(pending.begin(), end);
+  for (MessageIdType j = 0; j < SACK_WINDOW; j++) {
+    if ((sack >> j) & 1) {
+      if (auto entry = pending.find(cumulative + 1 + j);
+          entry != pending.end()) {
+        sample(entry);
+        pending.erase(entry);
+      }
+    }
+  }
+
+  const auto now = _transport->now();
+  if (sent_at.has_value()) {
+    peer.sample_rtt(now - *sent_at);
+    Metrics::record(Metrics::Histogram::AckRtt, now - *sent_at);
+  }
+
+  // acknowledged messages opened the window
+  if (pending.size() == pending_count) {
+    return false;
+  }
+  peer.grow_window(pending_count - pending.size());
+  return true;
+}
+
+auto PerfectLink::_fill_opened(const std::vector<std::uint64_t>& keys)
+    -> void {
+  // ACKs arrive at the endpoint of the shard their sender hashes to, which
+  // is not necessarily the shard of the peer
+  std::vector<std::pair<std::uint64_t, Peer*>> peers;
+  for (auto& shard : _shards) {
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    peers.clear();
+    for (const auto key : keys) {
+      if (&_shard(key) != &shard) {
+        continue;
+      }
+      if (auto entry = shard.peers.find(key); entry != shard.peers.end()) {
+        peers.emplace_back(key, &entry->second);
+      }
+    }
+    if (peers.empty()) {
+      continue;
+    }
+
+    Datagrams datagrams;
+    _fill_windows(shard, peers, _transport->now(), datagrams);
+    datagrams.flush(*shard.endpoint, "failed to send message");
+  }
+}
+
+auto PerfectLink::_coalesce(Shard& shard,
+                            Peer& peer,
+                            const std::uint64_t peer_key,
+                            const Payloads datas,
+                            const std::size_t count,
+                            const Clock::time_point now,
+                            Datagrams& datagrams) -> void {
+  const auto payloads_size =
+      _body_size(0, datas, count) - _body_size(0, datas, 0);
+  if (peer.outbox_size > 0 &&
+      HEADER_SIZE + peer.outbox_size + payloads_size > MAX_MESSAGE_SIZE) {
+    _flush_outbox(shard, peer, peer_key, now, datagrams);
+  }
+
+  if (peer.outbox_size == 0) {
+    // start a body without metadata
+    peer.outbox = shard.pool.acquire(MAX_MESSAGE_SIZE - HEADER_SIZE);
+    _encode_body(peer.outbox.data(), Slice<std::uint8_t>(nullptr, 0), datas,
+                 0);
+    peer.outbox_size = _body_size(0, datas, 0);
+    if (!shard.outbox_deadline.has_value()) {
+      shard.outbox_deadline = now + _options.coalesce_delay;
+      _schedule(shard, shard.outbox_deadline.value());
     }
   }
+
+  for (std::size_t i = 0; i < count; i++) {
+    peer.outbox_size +=
+        _encode_data(peer.outbox.data() + peer.outbox_size, datas[i]);
+  }
+}
+
+auto PerfectLink::_flush_outbox(Shard& shard,
+                                Peer& peer,
+                                const std::uint64_t peer_key,
+                                const Clock::time_point now,
+                                Datagrams& datagrams) -> void {
+  peer.outbox.truncate(peer.outbox_size);
+  peer.pending_for_ack.try_emplace(peer.seq_nr, peer.seq_nr,
+                                   std::move(peer.outbox));
+  peer.outbox_size = 0;
+  peer.seq_nr += 1;
+  _fill_window(shard, peer, peer_key, now, datagrams);
+}
+
+auto PerfectLink::_flush_overdue_outboxes(Shard& shard) -> void {
+  if (_options.coalesce_delay == Clock::duration::zero()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  const auto now = _transport->now();
+  if (!shard.outbox_deadline.has_value() ||
+      shard.outbox_deadline.value() > now) {
+    return;
+  }
+
+  // flushing the younger outboxes early keeps a single deadline to track
+  Datagrams datagrams;
+  for (auto& [key, peer] : shard.peers) {
+    if (peer.outbox_size > 0) {
+      _flush_outbox(shard, peer, key, now, datagrams);
+    }
+  }
+  shard.outbox_deadline.reset();
+
+  datagrams.flush(*shard.endpoint, "failed to send message");
+}
+
+auto PerfectLink::_transmit(Shard& shard,
+                            Peer& peer,
+                            const std::uint64_t peer_key,
+                            const Clock::time_point now) -> PendingMessage& {
+  auto& pending = peer.pending_for_ack.at(peer.transmit_seq_nr);
+  pending.sent_at = now;
+  pending.deadline = now + peer.rto;
+  shard.retransmit_timers.emplace(pending.deadline, peer_key,
+                                  peer.transmit_seq_nr);
+  peer.transmit_seq_nr += 1;
+  if (peer.sent_state != nullptr) {
+    // stored before the message leaves, a restart never reuses the number
+    peer.sent_state->seq_nr.store(peer.transmit_seq_nr,
+                                  std::memory_order_relaxed);
+  }
+  return pending;
+}
+
+auto PerfectLink::_multicast(
+    Shard& shard,
+    const std::vector<std::pair<std::uint64_t, Peer*>>& peers,
+    const Clock::time_point now,
+    Datagrams& datagrams) -> void {
+  const auto& [_, first] = peers.front();
+  const auto& message = first->pending_for_ack.at(first->transmit_seq_nr);
+
+  // a fragment keeps its flag, the table takes the place of the seq_nr
+  std::vector<std::uint8_t> table(MULTICAST_HEADER_SIZE +
+                                  peers.size() * MULTICAST_ENTRY_SIZE);
+  const auto flags =
+      static_cast<std::uint8_t>(MULTICAST_FLAG | message.header[0]);
+  MulticastHeader::store(table.data(), flags,
+                         static_cast<ProcessIdType>(peers.size()));
+
+  auto entry = table.data() + MULTICAST_HEADER_SIZE;
+  for (const auto& [key, peer] : peers) {
+    const auto seq_nr = peer->transmit_seq_nr;
+    _transmit(shard, *peer, key, now);
+    _schedule(shard, now + peer->rto);
+    codec::store_le<std::uint64_t, ADDRESS_KEY_SIZE>(entry, key);
+    codec::store_le(entry + ADDRESS_KEY_SIZE, seq_nr);
+    entry += MULTICAST_ENTRY_SIZE;
+  }
+
+  datagrams.push(std::move(table), message.body, &*_options.multicast_group);
+  Metrics::increment(Metrics::Counter::LinkSent, peers.size());
+  Metrics::increment(Metrics::Counter::LinkMulticast);
+}
+
+auto PerfectLink::_fill_windows(
+    Shard& shard,
+    std::vector<std::pair<std::uint64_t, Peer*>>& peers,
+    const Clock::time_point now,
+    Datagrams& datagrams) -> void {
+  if (_group_endpoint == nullptr || peers.size() < 2) {
+    for (auto& [key, peer] : peers) {
+      _fill_window(shard, *peer, key, now, datagrams);
+    }
+    return;
+  }
+
+  // a peer that is given a message many times gets all of them in a round
+  std::sort(peers.begin(), peers.end());
+  peers.erase(std::unique(peers.begin(), peers.end()), peers.end());
+
+  // peers by the body of their next message, which is shared by all peers of
+  // a `send_batch`
+  std::vector<std::pair<const std::uint8_t*,
+                        std::vector<std::pair<std::uint64_t, Peer*>>>>
+      next;
+  while (true) {
+    next.clear();
+    for (auto& [key, peer] : peers) {
+      if (peer->transmit_seq_nr == peer->seq_nr ||
+          peer->in_flight() >= peer->window) {
+        continue;
+      }
+      const auto body =
+          peer->pending_for_ack.at(peer->transmit_seq_nr).body.data();
+      auto group = std::find_if(next.begin(), next.end(), [&](auto& entry) {
+        return entry.first == body;
+      });
+      if (group == next.end()) {
+        group = next.insert(next.end(), {body, {}});
+      }
+      group->second.emplace_back(key, peer);
+    }
+    if (next.empty()) {
+      return;
+    }
+
+    for (auto& [_, group] : next) {
+      const auto& [__, first] = group.front();
+      const auto body_size =
+          first->pending_for_ack.at(first->transmit_seq_nr).body.size();
+      if (group.size() > 1 &&
+          MULTICAST_HEADER_SIZE + group.size() * MULTICAST_ENTRY_SIZE +
+                  body_size <=
+              MAX_MESSAGE_SIZE) {
+        _multicast(shard, group, now, datagrams);
+        continue;
+      }
+      for (auto& [key, peer] : group) {
+        datagrams.push(_transmit(shard, *peer, key, now), &peer->addr);
+        _schedule(shard, now + peer->rto);
+      }
+      Metrics::increment(Metrics::Counter::LinkSent, group.size());
+    }
+  }
+}
+
+auto PerfectLink::_fill_window(Shard& shard,
+                               Peer& peer,
+                               const std::uint64_t peer_key,
+                               const Clock::time_point now,
+                               Datagrams& datagrams) -> void {
+  std::uint64_t sent = 0;
+  while (peer.transmit_seq_nr != peer.seq_nr &&
+         peer.in_flight() < peer.window) {
+    datagrams.push(_transmit(shard, peer, peer_key, now), &peer.addr);
+    sent += 1;
+  }
+  if (sent > 0) {
+    // the first of them expires first
+    _schedule(shard, now + peer.rto);
+    Metrics::increment(Metrics::Counter::LinkSent, sent);
+  }
+}
+
+auto PerfectLink::Peer::sample_rtt(const Clock::duration rtt) -> void {
+  if (srtt == Clock::duration::zero()) {
+    srtt = rtt;
+    rttvar = rtt / 2;
+  } else {
+    const auto error = srtt > rtt ? srtt - rtt : rtt - srtt;
+    rttvar = (3 * rttvar + error) / 4;
+    srtt = (7 * srtt + rtt) / 8;
+  }
+  rto = std::clamp(srtt + 4 * rttvar, MIN_RTO, MAX_RTO);
+}
+
+auto PerfectLink::Peer::grow_window(const std::size_t acked) -> void {
+  if (window < window_threshold) {
+    // slow start, grow by one for every ACKed message
+    window = static_cast<std::uint16_t>(
+        std::min<std::size_t>(window + acked, window_threshold));
+    return;
+  }
+
+  // congestion avoidance, grow by one for every full window ACKed
+  window_acked = static_cast<std::uint16_t>(
+      std::min<std::size_t>(window_acked + acked, max_window));
+  if (window_acked >= window) {
+    window_acked = 0;
+    window = std::min<std::uint16_t>(window + 1, max_window);
+  }
+}
+
+auto PerfectLink::Peer::shrink_window() -> void {
+  window = std::max<std::uint16_t>(window / 2, 1);
+  window_threshold = window;
+  window_acked = 0;
+}
+
+auto PerfectLink::_resend_overdue(Shard& shard) -> void {
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  const auto now = _transport->now();
+  auto& timers = shard.retransmit_timers;
+
+  // collect overdue messages, skipping timers of messages that were already
+  // acknowledged or rescheduled
+  std::vector<std::tuple<Peer*, MessageIdType, PendingMessage*>> overdue;
+  while (!timers.empty() && timers.top().deadline <= now) {
+    const auto timer = timers.top();
+    timers.pop();
+
+    auto peer_entry = shard.peers.find(timer.peer_key);
+    if (peer_entry == shard.peers.end()) {
+      continue;
+    }
+    auto& peer = peer_entry->second;
+    auto pending_entry = peer.pending_for_ack.find(timer.seq_nr);
+    if (pending_entry == peer.pending_for_ack.end() ||
+        pending_entry->second.deadline != timer.deadline) {
+      continue;
+    }
+    overdue.emplace_back(&peer, timer.seq_nr, &pending_entry->second);
+  }
+
+  if (overdue.empty()) {
+    return;
+  }
+
+  // back off every peer that timed out once, no matter how many of its
+  // messages are overdue
+  std::unordered_set<Peer*> backed_off;
+  for (auto& [peer, _, __] : overdue) {
+    if (backed_off.insert(peer).second) {
+      peer->rto = std::min(2 * peer->rto, MAX_RTO);
+      peer->shrink_window();
+    }
+  }
+
+  Metrics::increment(Metrics::Counter::LinkRetransmitted, overdue.size());
+
+  Datagrams datagrams;
+  for (auto& [peer, seq_nr, pending] : overdue) {
+    pending->retransmitted = true;
+    pending->deadline = now + peer->rto;
+    timers.emplace(pending->deadline, _address_key(peer->addr), seq_nr);
+    datagrams.push(*pending, &peer->addr);
+  }
+
+  datagrams.flush(*shard.endpoint, "failed to resend message");
+}
+
+auto PerfectLink::Datagrams::push(const PendingMessage& message,
+                                  const sockaddr_in* addr) -> void {
+  _iovecs.push_back({const_cast<std::uint8_t*>(message.header.data()),
+                     message.header.size()});
+  _iovecs.push_back({const_cast<std::uint8_t*>(message.body.data()),
+                     message.body.size()});
+  _addrs.push_back(addr);
+}
+
+auto PerfectLink::Datagrams::push(std::vector<std::uint8_t>&& header,
+                                  const PacketPool::Buffer& body,
+                                  const sockaddr_in* addr) -> void {
+  // moving the vector keeps its data where it is
+  const auto& owned = _owned_headers.emplace_back(std::move(header));
+  _iovecs.push_back({const_cast<std::uint8_t*>(owned.data()), owned.size()});
+  _iovecs.push_back({const_cast<std::uint8_t*>(body.data()), body.size()});
+  _addrs.push_back(addr);
+}
+
+auto PerfectLink::Datagrams::flush(Endpoint& endpoint,
+                                   const std::string_view error_message)
+    -> void {
+  _headers.resize(_addrs.size());
+  for (std::size_t i = 0; i < _addrs.size(); i++) {
+    std::memset(&_headers[i], 0, sizeof(_headers[i]));
+    _headers[i].msg_hdr.msg_name = const_cast<sockaddr_in*>(_addrs[i]);
+    _headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    // header and body of a message
+    _headers[i].msg_hdr.msg_iov = &_iovecs[2 * i];
+    _headers[i].msg_hdr.msg_iovlen = 2;
+  }
+
+  _send_all(endpoint, _headers.data(), _headers.size(), error_message);
+  _iovecs.clear();
+  _addrs.clear();
+  _owned_headers.clear();
+}
+
+auto PerfectLink::_send_all(Endpoint& endpoint,
+                            mmsghdr* headers,
+                            const std::size_t count,
+                            const std::string_view error_message) -> void {
+  std::size_t sent = 0;
+  while (sent < count) {
+    auto res = perror_check<int>(
+        [&]() noexcept {
+          return endpoint.send(headers + sent, count - sent);
+        },
+        [](auto res) noexcept { return res < 0 && errno != EPIPE; },
+        error_message);
+    // on failure skip the datagram that could not be sent
+    sent += res > 0 ? static_cast<std::size_t>(res) : 1;
+  }
 }
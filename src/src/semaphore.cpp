@@ -1,15 +1,44 @@
 #include "semaphore.hpp"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
 
-Semaphore::Semaphore(std::size_t count) : _count(count) {}
+static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t) &&
+                  std::atomic<std::uint32_t>::is_always_lock_free,
+              "the count has to be usable as a futex");
 
-auto Semaphore::release() -> void {
-  std::lock_guard<decltype(_mutex)> lock(_mutex);
-  _count += 1;
-  _cv.notify_one();
+Semaphore::Semaphore(const std::size_t count)
+    : _count(static_cast<std::uint32_t>(count)) {}
+
+auto Semaphore::_wait(const std::uint32_t wanted) -> void {
+  _waiters.fetch_add(1);
+  while (true) {
+    auto available = _count.load();
+    while (available >= wanted) {
+      if (_count.compare_exchange_weak(available, available - wanted)) {
+        _waiters.fetch_sub(1);
+        return;
+      }
+    }
+
+    // the kernel only lets us sleep if the count did not change since
+    const auto res =
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&_count),
+                FUTEX_WAIT_PRIVATE, available, nullptr, nullptr, 0);
+    if (res < 0 && errno != EAGAIN && errno != EINTR) {
+      perror("failed to wait on futex");
+    }
+  }
 }
 
-auto Semaphore::acquire() -> void {
-  std::unique_lock<decltype(_mutex)> lock(_mutex);
-  _cv.wait(lock, [this]() { return _count > 0; });
-  _count -= 1;
+auto Semaphore::_wake() -> void {
+  const auto res =
+      syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&_count),
+              FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+  if (res < 0) {
+    perror("failed to wake futex waiters");
+  }
 }
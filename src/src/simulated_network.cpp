@@ -0,0 +1,469 @@
+#include "simulated_network.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+
+/// @brief An endpoint of a `SimulatedNetwork`, all its state is guarded by the
+/// mutex of the network.
+class SimulatedNetwork::SimulatedEndpoint : public Endpoint {
+ public:
+  SimulatedEndpoint(SimulatedNetwork& network,
+                    const sockaddr_in addr,
+                    const std::optional<sockaddr_in> member = std::nullopt)
+      : network(network), addr(addr), member(member) {}
+
+  ~SimulatedEndpoint() override { network._close(*this); }
+
+  SimulatedEndpoint(const SimulatedEndpoint&) = delete;
+  SimulatedEndpoint& operator=(const SimulatedEndpoint&) = delete;
+
+  auto send(mmsghdr* headers, const std::size_t count) -> int override {
+    return network._send(*this, headers, count);
+  }
+
+  auto receive(mmsghdr* headers, const std::size_t count) -> int override {
+    return network._receive(*this, headers, count);
+  }
+
+  SimulatedNetwork& network;
+  const sockaddr_in addr;
+  /// @brief For an endpoint of a multicast group, the unicast endpoint of the
+  /// member it receives for.
+  const std::optional<sockaddr_in> member;
+  /// @brief Datagrams that arrived and were not yet received.
+  std::deque<Datagram> arrived;
+  /// @brief The reactor watching this endpoint, if any.
+  SimulatedReactor* reactor = nullptr;
+};
+
+/// @brief A reactor of a `SimulatedNetwork`, all its state is guarded by the
+/// mutex of the network.
+class SimulatedNetwork::SimulatedReactor : public Reactor {
+ public:
+  explicit SimulatedReactor(SimulatedNetwork& network) : network(network) {}
+
+  ~SimulatedReactor() override { network._destroy(*this); }
+
+  SimulatedReactor(const SimulatedReactor&) = delete;
+  SimulatedReactor& operator=(const SimulatedReactor&) = delete;
+
+  auto watch(Endpoint& endpoint, Handler on_readable) -> void override {
+    network._watch(*this, static_cast<SimulatedEndpoint&>(endpoint),
+                   std::move(on_readable));
+  }
+
+  auto add_timer(Handler on_expiry) -> Timer override {
+    return network._add_timer(*this, std::move(on_expiry));
+  }
+
+  auto arm(const Timer timer, const Clock::time_point deadline)
+      -> void override {
+    network._arm(*this, timer, deadline);
+  }
+
+  auto run() -> void override { network._run(*this); }
+
+  auto stop() -> void override { network._stop(*this); }
+
+  struct TimerEntry {
+    Clock::time_point deadline;
+    Handler handler;
+  };
+
+  SimulatedNetwork& network;
+  std::vector<std::pair<SimulatedEndpoint*, Handler>> watched;
+  std::vector<TimerEntry> timers;
+  /// @brief Whether its thread waits for events.
+  bool waiting = false;
+  /// @brief Whether its thread runs, see `_busy`.
+  bool busy = false;
+  bool stopped = false;
+};
+
+SimulatedNetwork::SimulatedNetwork(const NetworkConditions conditions)
+    : _conditions(conditions) {}
+
+auto SimulatedNetwork::open(const in_addr_t host,
+                            const in_port_t port,
+                            const bool shared) -> std::unique_ptr<Endpoint> {
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = host;
+  addr.sin_port = port;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto& group = _bound[_address_key(addr)];
+  if (!group.empty() && !shared) {
+    throw std::runtime_error("Address is already bound");
+  }
+  auto endpoint = std::make_unique<SimulatedEndpoint>(*this, addr);
+  group.push_back(endpoint.get());
+  return endpoint;
+}
+
+auto SimulatedNetwork::open_group(const sockaddr_in& group,
+                                  const sockaddr_in& member)
+    -> std::unique_ptr<Endpoint> {
+  if (!is_multicast(group.sin_addr.s_addr)) {
+    throw std::runtime_error("Address is not a multicast group");
+  }
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto endpoint = std::make_unique<SimulatedEndpoint>(*this, group, member);
+  _groups[_address_key(group)].push_back(endpoint.get());
+  return endpoint;
+}
+
+auto SimulatedNetwork::reactor() -> std::unique_ptr<Reactor> {
+  auto reactor = std::make_unique<SimulatedReactor>(*this);
+  std::lock_guard<std::mutex> lock(_mutex);
+  _reactors.push_back(reactor.get());
+  return reactor;
+}
+
+auto SimulatedNetwork::stats() const -> Stats {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _stats;
+}
+
+auto SimulatedNetwork::_send(SimulatedEndpoint& endpoint,
+                             mmsghdr* headers,
+                             const std::size_t count) -> int {
+  std::lock_guard<std::mutex> lock(_mutex);
+  const auto from_key = _address_key(endpoint.addr);
+  const auto sent_at = now();
+
+  for (std::size_t i = 0; i < count; i++) {
+    auto& header = headers[i].msg_hdr;
+    const auto to = *static_cast<const sockaddr_in*>(header.msg_name);
+
+    Datagram datagram{endpoint.addr, {}};
+    for (std::size_t j = 0; j < header.msg_iovlen; j++) {
+      const auto base =
+          static_cast<const std::uint8_t*>(header.msg_iov[j].iov_base);
+      datagram.data.insert(datagram.data.end(), base,
+                           base + header.msg_iov[j].iov_len);
+    }
+    headers[i].msg_len = static_cast<unsigned int>(datagram.data.size());
+    _stats.sent += 1;
+
+    if (!is_multicast(to.sin_addr.s_addr)) {
+      _dispatch(from_key, _address_key(to), sent_at,
+                InFlight{to, std::move(datagram)});
+      continue;
+    }
+    const auto group = _groups.find(_address_key(to));
+    if (group == _groups.end() || group->second.empty()) {
+      _stats.undeliverable += 1;
+      continue;
+    }
+    for (const auto member : group->second) {
+      const auto member_key = _address_key(*member->member);
+      _dispatch(from_key, member_key, sent_at,
+                InFlight{to, datagram, member_key});
+    }
+  }
+
+  _generation += 1;
+  _deliver_due();
+  if (_busy == 0) {
+    // the waiting reactors have a new event to move to
+    _cv.notify_all();
+  }
+  return static_cast<int>(count);
+}
+
+auto SimulatedNetwork::_receive(SimulatedEndpoint& endpoint,
+                                mmsghdr* headers,
+                                const std::size_t count) -> int {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (endpoint.arrived.empty()) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  const auto received = std::min(count, endpoint.arrived.size());
+  for (std::size_t i = 0; i < received; i++) {
+    auto& datagram = endpoint.arrived.front();
+    auto& header = headers[i].msg_hdr;
+
+    // like a socket, a datagram too large for the buffers is truncated
+    std::size_t copied = 0;
+    for (std::size_t j = 0; j < header.msg_iovlen; j++) {
+      const auto size = std::min(header.msg_iov[j].iov_len,
+                                 datagram.data.size() - copied);
+      std::memcpy(header.msg_iov[j].iov_base, datagram.data.data() + copied,
+                  size);
+      copied += size;
+    }
+    headers[i].msg_len = static_cast<unsigned int>(copied);
+
+    if (header.msg_name != nullptr) {
+      std::memcpy(header.msg_name, &datagram.from,
+                  std::min<std::size_t>(header.msg_namelen,
+                                        sizeof(datagram.from)));
+      header.msg_namelen = sizeof(datagram.from);
+    }
+    endpoint.arrived.pop_front();
+  }
+  _stats.received += received;
+  return static_cast<int>(received);
+}
+
+auto SimulatedNetwork::_close(SimulatedEndpoint& endpoint) -> void {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto& endpoints = endpoint.member.has_value() ? _groups : _bound;
+  auto& group = endpoints[_address_key(endpoint.addr)];
+  group.erase(std::find(group.begin(), group.end(), &endpoint));
+  if (endpoint.reactor != nullptr) {
+    auto& watched = endpoint.reactor->watched;
+    watched.erase(std::find_if(
+        watched.begin(), watched.end(),
+        [&](const auto& entry) { return entry.first == &endpoint; }));
+  }
+}
+
+auto SimulatedNetwork::_dispatch(const std::uint64_t from_key,
+                                 const std::uint64_t to_key,
+                                 const Clock::time_point sent_at,
+                                 InFlight in_flight) -> void {
+  // every datagram takes the same draws, so that a loss does not change the
+  // fates of the ones after it
+  auto fate = _fates.find({from_key, to_key});
+  if (fate == _fates.end()) {
+    std::seed_seq seed{_conditions.seed, from_key, to_key};
+    fate = _fates.emplace(std::make_pair(from_key, to_key),
+                          std::mt19937_64(seed))
+               .first;
+  }
+  const auto is_lost =
+      std::uniform_real_distribution<double>(0, 1)(fate->second) <
+      _conditions.loss;
+  const auto jitter = std::uniform_int_distribution<std::int64_t>(
+      0, _conditions.jitter.count())(fate->second);
+  if (is_lost) {
+    _stats.lost += 1;
+    return;
+  }
+
+  const auto arrival =
+      sent_at + _conditions.delay + std::chrono::microseconds(jitter);
+  _in_flight.emplace(ArrivalKey(arrival, _order++), std::move(in_flight));
+}
+
+auto SimulatedNetwork::_recipient(const InFlight& in_flight)
+    -> SimulatedEndpoint* {
+  const auto to_key = _address_key(in_flight.to);
+  if (is_multicast(in_flight.to.sin_addr.s_addr)) {
+    // the member might have left the group meanwhile
+    const auto group = _groups.find(to_key);
+    if (group == _groups.end()) {
+      return nullptr;
+    }
+    const auto member = std::find_if(
+        group->second.begin(), group->second.end(), [&](const auto endpoint) {
+          return _address_key(*endpoint->member) == in_flight.member;
+        });
+    return member != group->second.end() ? *member : nullptr;
+  }
+
+  const auto group = _bound.find(to_key);
+  if (group == _bound.end() || group->second.empty()) {
+    return nullptr;
+  }
+  // like `SO_REUSEPORT`, all datagrams of a sender go to the same endpoint
+  auto& endpoints = group->second;
+  return endpoints[_address_key(in_flight.datagram.from) % endpoints.size()];
+}
+
+auto SimulatedNetwork::_watch(SimulatedReactor& reactor,
+                              SimulatedEndpoint& endpoint,
+                              Reactor::Handler handler) -> void {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (endpoint.reactor != nullptr) {
+    throw std::runtime_error("Endpoint is already watched");
+  }
+  endpoint.reactor = &reactor;
+  reactor.watched.emplace_back(&endpoint, std::move(handler));
+}
+
+auto SimulatedNetwork::_add_timer(SimulatedReactor& reactor,
+                                  Reactor::Handler handler) -> Reactor::Timer {
+  std::lock_guard<std::mutex> lock(_mutex);
+  reactor.timers.push_back({Clock::time_point::max(), std::move(handler)});
+  return reactor.timers.size() - 1;
+}
+
+auto SimulatedNetwork::_arm(SimulatedReactor& reactor,
+                            const Reactor::Timer timer,
+                            const Clock::time_point deadline) -> void {
+  std::lock_guard<std::mutex> lock(_mutex);
+  reactor.timers[timer].deadline = deadline;
+  _generation += 1;
+  if (deadline <= now()) {
+    _wake(reactor);
+  }
+  // the waiting reactors might have an earlier event to move to
+  _cv.notify_all();
+}
+
+auto SimulatedNetwork::_run(SimulatedReactor& reactor) -> void {
+  std::unique_lock<std::mutex> lock(_mutex);
+  reactor.busy = true;
+  _busy += 1;
+
+  std::vector<Reactor::Handler*> due;
+  while (!reactor.stopped) {
+    due.clear();
+    for (auto& [endpoint, handler] : reactor.watched) {
+      if (!endpoint->arrived.empty()) {
+        due.push_back(&handler);
+      }
+    }
+    for (auto& timer : reactor.timers) {
+      if (timer.deadline <= now()) {
+        timer.deadline = Clock::time_point::max();
+        due.push_back(&timer.handler);
+      }
+    }
+
+    if (!due.empty()) {
+      // handlers are only added before running, so the pointers stay valid
+      lock.unlock();
+      for (auto handler : due) {
+        (*handler)();
+      }
+      lock.lock();
+      continue;
+    }
+
+    reactor.busy = false;
+    _busy -= 1;
+    reactor.waiting = true;
+    while (!_is_ready(reactor)) {
+      if (_busy > 0 || !_advance(lock)) {
+        _cv.wait(lock);
+      }
+    }
+    reactor.waiting = false;
+    if (!reactor.busy) {
+      reactor.busy = true;
+      _busy += 1;
+    }
+  }
+
+  reactor.busy = false;
+  _busy -= 1;
+  // the others might be waiting for this one to be idle
+  _cv.notify_all();
+}
+
+auto SimulatedNetwork::_stop(SimulatedReactor& reactor) -> void {
+  std::lock_guard<std::mutex> lock(_mutex);
+  reactor.stopped = true;
+  _wake(reactor);
+  _cv.notify_all();
+}
+
+auto SimulatedNetwork::_destroy(SimulatedReactor& reactor) -> void {
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (auto& [endpoint, _] : reactor.watched) {
+    endpoint->reactor = nullptr;
+  }
+  _reactors.erase(std::find(_reactors.begin(), _reactors.end(), &reactor));
+}
+
+auto SimulatedNetwork::_is_ready(const SimulatedReactor& reactor) const
+    -> bool {
+  if (reactor.stopped) {
+    return true;
+  }
+  for (const auto& [endpoint, _] : reactor.watched) {
+    if (!endpoint->arrived.empty()) {
+      return true;
+    }
+  }
+  const auto current = now();
+  for (const auto& timer : reactor.timers) {
+    if (timer.deadline <= current) {
+      return true;
+    }
+  }
+  return false;
+}
+
+auto SimulatedNetwork::_deliver_due() -> void {
+  const auto current = now();
+  bool delivered = false;
+  while (!_in_flight.empty() && _in_flight.begin()->first.first <= current) {
+    auto node = _in_flight.extract(_in_flight.begin());
+    auto& in_flight = node.mapped();
+
+    const auto endpoint = _recipient(in_flight);
+    if (endpoint == nullptr) {
+      _stats.undeliverable += 1;
+      continue;
+    }
+    endpoint->arrived.push_back(std::move(in_flight.datagram));
+    if (endpoint->reactor != nullptr) {
+      _wake(*endpoint->reactor);
+    }
+    delivered = true;
+  }
+  if (delivered) {
+    _cv.notify_all();
+  }
+}
+
+auto SimulatedNetwork::_wake(SimulatedReactor& reactor) -> void {
+  if (reactor.waiting && !reactor.busy) {
+    reactor.busy = true;
+    _busy += 1;
+  }
+}
+
+auto SimulatedNetwork::_advance(std::unique_lock<std::mutex>& lock) -> bool {
+  auto next = Clock::time_point::max();
+  if (!_in_flight.empty()) {
+    next = _in_flight.begin()->first.first;
+  }
+  auto is_timer = false;
+  for (const auto reactor : _reactors) {
+    if (!reactor->waiting) {
+      continue;
+    }
+    for (const auto& timer : reactor->timers) {
+      if (timer.deadline < next) {
+        next = timer.deadline;
+        is_timer = true;
+      }
+    }
+  }
+  if (next == Clock::time_point::max()) {
+    return false;
+  }
+
+  if (is_timer) {
+    const auto generation = _generation;
+    _cv.wait_for(lock, IDLE_GRACE);
+    if (_generation != generation || _busy > 0) {
+      // something happened meanwhile, the next event might have changed
+      return true;
+    }
+  }
+
+  if (next > now()) {
+    _now = next.time_since_epoch().count();
+  }
+  _deliver_due();
+  for (const auto reactor : _reactors) {
+    if (_is_ready(*reactor)) {
+      _wake(*reactor);
+    }
+  }
+  _cv.notify_all();
+  return true;
+}
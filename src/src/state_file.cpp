@@ -0,0 +1,99 @@
+#include "state_file.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "common.hpp"
+
+StateFile::StateFile(const std::string& path)
+    : _fd(perror_check<int>(
+          [&]() noexcept {
+            return ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+          },
+          [](auto res) noexcept { return res < 0; },
+          "failed to open state file", true)) {
+  struct stat status;
+  perror_check<int>([&]() noexcept { return fstat(_fd, &status); },
+                    [](auto res) noexcept { return res < 0; },
+                    "failed to stat state file", true);
+  if (static_cast<std::size_t>(status.st_size) != CAPACITY) {
+    // new or not ours, start over from zeros
+    const auto truncate = [&](const off_t size) {
+      perror_check<int>([&]() noexcept { return ftruncate(_fd, size); },
+                        [](auto res) noexcept { return res < 0; },
+                        "failed to size state file", true);
+    };
+    truncate(0);
+    truncate(static_cast<off_t>(CAPACITY));
+  }
+
+  _data = static_cast<std::uint8_t*>(perror_check<void*>(
+      [&]() noexcept {
+        return mmap(nullptr, CAPACITY, PROT_READ | PROT_WRITE, MAP_SHARED, _fd,
+                    0);
+      },
+      [](auto res) noexcept { return res == MAP_FAILED; },
+      "failed to map state file", true));
+
+  auto& header = _header();
+  _is_restored = header.magic == MAGIC;
+  if (!_is_restored) {
+    std::memset(&header, 0, sizeof(header));
+    header.end = sizeof(Header);
+    header.magic = MAGIC;
+  }
+}
+
+StateFile::~StateFile() {
+  perror_check<int>([&]() noexcept { return munmap(_data, CAPACITY); },
+                    [](auto res) noexcept { return res < 0; },
+                    "failed to unmap state file");
+  perror_check<int>([&]() noexcept { return close(_fd); },
+                    [](auto res) noexcept { return res < 0; },
+                    "failed to close state file");
+}
+
+auto StateFile::_region(const std::string_view name,
+                        const std::size_t size,
+                        const std::size_t alignment)
+    -> std::tuple<std::uint8_t*, bool> {
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto& header = _header();
+
+  if (name.size() >= sizeof(Region::name)) {
+    throw std::runtime_error("State region name is too long");
+  }
+  for (std::size_t i = 0; i < header.region_count; i++) {
+    auto& region = header.regions[i];
+    if (name != region.name) {
+      continue;
+    }
+    if (region.size != size) {
+      throw std::runtime_error(
+          "State file was written with another configuration");
+    }
+    return {_data + region.offset, false};
+  }
+
+  if (header.region_count == MAX_REGIONS) {
+    throw std::runtime_error("Too many state regions");
+  }
+  const auto align = std::max(alignment, REGION_ALIGNMENT);
+  const auto offset = (header.end + align - 1) / align * align;
+  if (offset + size > CAPACITY) {
+    throw std::runtime_error("State regions do not fit into the state file");
+  }
+
+  // the file was zero there, the caller constructs the records
+  auto& region = header.regions[header.region_count];
+  std::memcpy(region.name, name.data(), name.size());
+  region.name[name.size()] = '\0';
+  region.offset = offset;
+  region.size = size;
+  header.end = offset + size;
+  header.region_count += 1;
+  return {_data + offset, true};
+}
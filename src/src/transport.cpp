@@ -0,0 +1,132 @@
+#include "transport.hpp"
+#include <unistd.h>
+#include <cstring>
+#include "common.hpp"
+#include "epoll_reactor.hpp"
+
+const auto& socket_bind = bind;
+
+/// @brief A bound UDP socket, closed once the endpoint is destroyed.
+class SocketEndpoint : public Endpoint {
+ public:
+  explicit SocketEndpoint(const int sock_fd) : _sock_fd(sock_fd) {}
+
+  ~SocketEndpoint() override {
+    perror_check<int>([&]() noexcept { return close(_sock_fd); },
+                      [](auto res) noexcept { return res < 0; },
+                      "failed to close socket");
+  }
+
+  SocketEndpoint(const SocketEndpoint&) = delete;
+  SocketEndpoint& operator=(const SocketEndpoint&) = delete;
+
+  auto send(mmsghdr* headers, const std::size_t count) -> int override {
+    return sendmmsg(_sock_fd, headers, static_cast<unsigned int>(count),
+                    MSG_NOSIGNAL);
+  }
+
+  auto receive(mmsghdr* headers, const std::size_t count) -> int override {
+    return recvmmsg(_sock_fd, headers, static_cast<unsigned int>(count),
+                    MSG_DONTWAIT, nullptr);
+  }
+
+  inline auto fd() const -> int override { return _sock_fd; }
+
+ private:
+  const int _sock_fd;
+};
+
+auto SocketTransport::open(const in_addr_t host,
+                           const in_port_t port,
+                           const bool shared) -> std::unique_ptr<Endpoint> {
+  int sock_fd = perror_check<int>(
+      []() noexcept { return socket(PF_INET, SOCK_DGRAM, 0); },
+      [](auto res) noexcept { return res < 0; }, "socket creation failure",
+      true);
+
+  if (shared) {
+    // all sockets bind the same port, the kernel balances between them
+    const int enable = 1;
+    perror_check<int>(
+        [&]() noexcept {
+          return setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &enable,
+                            sizeof(enable));
+        },
+        [](auto res) noexcept { return res < 0; },
+        "failed to set socket port reuse", true);
+  }
+
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = host;
+  addr.sin_port = port;
+
+  perror_check<int>(
+      [&]() noexcept {
+        return socket_bind(sock_fd, reinterpret_cast<sockaddr*>(&addr),
+                           sizeof(addr));
+      },
+      [](auto res) noexcept { return res < 0; }, "failed to bind socket", true);
+
+  if (host != INADDR_ANY) {
+    // datagrams to a multicast group leave through the interface of the host,
+    // so that it is their source like for any other datagram
+    in_addr interface;
+    interface.s_addr = host;
+    perror_check<int>(
+        [&]() noexcept {
+          return setsockopt(sock_fd, IPPROTO_IP, IP_MULTICAST_IF, &interface,
+                            sizeof(interface));
+        },
+        [](auto res) noexcept { return res < 0; },
+        "failed to set multicast interface", true);
+  }
+
+  return std::make_unique<SocketEndpoint>(sock_fd);
+}
+
+auto SocketTransport::open_group(const sockaddr_in& group,
+                                 const sockaddr_in& member)
+    -> std::unique_ptr<Endpoint> {
+  int sock_fd = perror_check<int>(
+      []() noexcept { return socket(PF_INET, SOCK_DGRAM, 0); },
+      [](auto res) noexcept { return res < 0; }, "socket creation failure",
+      true);
+
+  // every member on the host binds the group, each gets its own copy
+  const int enable = 1;
+  perror_check<int>(
+      [&]() noexcept {
+        return setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &enable,
+                          sizeof(enable));
+      },
+      [](auto res) noexcept { return res < 0; },
+      "failed to set socket address reuse", true);
+
+  // bound to the group address, so that no datagrams of other groups on the
+  // same port arrive
+  perror_check<int>(
+      [&]() noexcept {
+        return socket_bind(sock_fd, reinterpret_cast<const sockaddr*>(&group),
+                           sizeof(group));
+      },
+      [](auto res) noexcept { return res < 0; }, "failed to bind socket", true);
+
+  ip_mreq membership;
+  membership.imr_multiaddr = group.sin_addr;
+  membership.imr_interface = member.sin_addr;
+  perror_check<int>(
+      [&]() noexcept {
+        return setsockopt(sock_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership,
+                          sizeof(membership));
+      },
+      [](auto res) noexcept { return res < 0; },
+      "failed to join multicast group", true);
+
+  return std::make_unique<SocketEndpoint>(sock_fd);
+}
+
+auto SocketTransport::reactor() -> std::unique_ptr<Reactor> {
+  return std::make_unique<EpollReactor>();
+}
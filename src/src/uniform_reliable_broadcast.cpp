@@ -1,11 +1,17 @@
 #include "uniform_reliable_broadcast.hpp"
 #include <cassert>
 #include <limits>
+#include "codec.hpp"
+#include "metrics.hpp"
 
 UniformReliableBroadcast::UniformReliableBroadcast(
     const PerfectLink::ProcessIdType id,
-    const BestEffortBroadcast::AvailableProcesses processes)
-    : _link(id, processes) {}
+    const BestEffortBroadcast::AvailableProcesses processes,
+    const LinkOptions options,
+    const RelayMode relay_mode)
+    : _relay_mode(relay_mode),
+      _link(id, processes, options),
+      _delivered(processes.size()) {}
 
 auto UniformReliableBroadcast::bind(const in_addr_t host, const in_port_t port)
     -> void {
@@ -14,9 +20,26 @@ auto UniformReliableBroadcast::bind(const in_addr_t host, const in_port_t port)
 
 auto UniformReliableBroadcast::listen(ListenCallback callback) -> void {
   _link.listen_batch([&](auto process_id, auto& metadata, auto& datas) {
-    MessageIdType message_id = 0;
-    for (size_t i = 0; i < sizeof(MessageIdType); i++) {
-      message_id |= static_cast<MessageIdType>(metadata[i]) << (8 * i);
+    if (_relay_mode == RelayMode::Signals && metadata.size() == 0) {
+      // signals are sent without metadata, possibly coalesced
+      for (const auto& signal : datas) {
+        _handle_signal(process_id, signal, callback);
+      }
+      return;
+    }
+
+    if (metadata.size() < sizeof(MessageIdType)) {
+      // malformed, not one of ours
+      return;
+    }
+    const auto message_id = codec::load_le<MessageIdType>(&metadata[0]);
+    if (!_has_member_author(message_id)) {
+      return;
+    }
+
+    if (_relay_mode == RelayMode::Signals) {
+      _handle_data(process_id, message_id, datas, callback);
+      return;
     }
 
     // mark that process_id has received this message
@@ -26,26 +49,27 @@ auto UniformReliableBroadcast::listen(ListenCallback callback) -> void {
     const auto& [iter, should_broadcast] =
         _acknowledged.try_emplace(message_id);
     auto& acks = iter->second;
-    bool had_acked = acks[process_id - 1];
-    acks[process_id - 1] = true;
+    const bool had_acked = !acks.insert(process_id);
 
     // check if majority has acked, if so, we can deliver. We don't need to keep
     // track of a delivered structure: the moment where we reach majority will
     // happen only once due to the no duplication property.
+    const auto ack_count = acks.size();
     auto should_deliver =
-        !had_acked && acks.count() == (_link.processes().size() / 2 + 1);
+        !had_acked && ack_count == (_link.processes().size() / 2 + 1);
+    if (should_deliver) {
+      _reached_majority(message_id);
+    }
+    // every process relays a message once, once all of them did (including us)
+    // no copy of it can arrive anymore
+    if (ack_count == _link.processes().size()) {
+      _acknowledged.erase(iter);
+    }
     _acknowledged_mutex.unlock();
 
     if (should_deliver) {
       // extract original process author id and seq_nr
-      PerfectLink::ProcessIdType author_id =
-          static_cast<PerfectLink::ProcessIdType>(
-              message_id &
-              static_cast<MessageIdType>(
-                  std::numeric_limits<PerfectLink::ProcessIdType>::max()));
-      PerfectLink::MessageIdType seq_nr =
-          static_cast<PerfectLink::MessageIdType>(
-              (message_id >> (8 * sizeof(PerfectLink::ProcessIdType))));
+      auto [author_id, seq_nr] = _decode_message_id(message_id);
       // if we are delivering our own broadcast, inform semaphore
       if (author_id == id()) {
         _send_semaphore.release();
@@ -55,62 +79,293 @@ auto UniformReliableBroadcast::listen(ListenCallback callback) -> void {
         callback(author_id, seq_nr, owned);
         seq_nr += 1;
       }
+      Metrics::increment(Metrics::Counter::UrbDelivered, datas.size());
     }
 
     assert(("should not need to broadcast when delivering",
             !should_deliver or !should_broadcast));
 
     if (should_broadcast) {
-      // paying for the stupid decision of compile-time known datas amount...
-      switch (datas.size()) {
-        static_assert(PerfectLink::MAX_MESSAGE_COUNT_IN_PACKET == 8);
-        case 0:
-          _link.broadcast(metadata.unsafe_raw());
-          break;
-        case 1:
-          _link.broadcast(metadata.unsafe_raw(), datas[0].unsafe_raw());
-          break;
-        case 2:
-          _link.broadcast(metadata.unsafe_raw(), datas[0].unsafe_raw(),
-                          datas[1].unsafe_raw());
-          break;
-        case 3:
-          _link.broadcast(metadata.unsafe_raw(), datas[0].unsafe_raw(),
-                          datas[1].unsafe_raw(), datas[2].unsafe_raw());
-          break;
-        case 4:
-          _link.broadcast(metadata.unsafe_raw(), datas[0].unsafe_raw(),
-                          datas[1].unsafe_raw(), datas[2].unsafe_raw(),
-                          datas[3].unsafe_raw());
-          break;
-        case 5:
-          _link.broadcast(metadata.unsafe_raw(), datas[0].unsafe_raw(),
-                          datas[1].unsafe_raw(), datas[2].unsafe_raw(),
-                          datas[3].unsafe_raw(), datas[4].unsafe_raw());
-          break;
-        case 6:
-          _link.broadcast(metadata.unsafe_raw(), datas[0].unsafe_raw(),
-                          datas[1].unsafe_raw(), datas[2].unsafe_raw(),
-                          datas[3].unsafe_raw(), datas[4].unsafe_raw(),
-                          datas[5].unsafe_raw());
-          break;
-        case 7:
-          _link.broadcast(metadata.unsafe_raw(), datas[0].unsafe_raw(),
-                          datas[1].unsafe_raw(), datas[2].unsafe_raw(),
-                          datas[3].unsafe_raw(), datas[4].unsafe_raw(),
-                          datas[5].unsafe_raw(), datas[6].unsafe_raw());
-          break;
-        case 8:
-          _link.broadcast(metadata.unsafe_raw(), datas[0].unsafe_raw(),
-                          datas[1].unsafe_raw(), datas[2].unsafe_raw(),
-                          datas[3].unsafe_raw(), datas[4].unsafe_raw(),
-                          datas[5].unsafe_raw(), datas[6].unsafe_raw(),
-                          datas[7].unsafe_raw());
-          break;
-        default:
-          // poor man's std::unreachable();
-          assert(false);
-      }
+      // the datas arrived in a single packet, so they fit in one again
+      [[maybe_unused]] const auto sent = _link.broadcast(
+          metadata, PerfectLink::Payloads(datas.data(), datas.size()));
+      assert(sent == datas.size());
     }
   });
 }
+
+auto UniformReliableBroadcast::_decode_message_id(
+    const MessageIdType message_id)
+    -> std::tuple<PerfectLink::ProcessIdType, PerfectLink::MessageIdType> {
+  const auto author_id = static_cast<PerfectLink::ProcessIdType>(
+      message_id &
+      static_cast<MessageIdType>(
+          std::numeric_limits<PerfectLink::ProcessIdType>::max()));
+  const auto seq_nr = static_cast<PerfectLink::MessageIdType>(
+      (message_id >> (8 * sizeof(PerfectLink::ProcessIdType))));
+  return {author_id, seq_nr};
+}
+
+auto UniformReliableBroadcast::_has_member_author(
+    const MessageIdType message_id) const -> bool {
+  return _link.is_member(std::get<0>(_decode_message_id(message_id)));
+}
+
+auto UniformReliableBroadcast::_handle_data(
+    const PerfectLink::ProcessIdType process_id,
+    const MessageIdType message_id,
+    const std::vector<Slice<std::uint8_t>>& datas,
+    ListenCallback& callback) -> void {
+  const auto [author_id, seq_nr] = _decode_message_id(message_id);
+  bool is_first = false;
+  std::shared_ptr<const StoredDatas> to_deliver;
+  {
+    std::lock_guard lock(_acknowledged_mutex);
+    auto entry = _signaled.find(message_id);
+    if (entry == _signaled.end()) {
+      if (_delivered[author_id - 1].contains(seq_nr)) {
+        // a late copy of a message every process has seen
+        return;
+      }
+      entry = _signaled.try_emplace(message_id).first;
+    }
+
+    // whoever sends the message has it
+    auto& message = entry->second;
+    message.seen.insert(process_id);
+    if (message.datas == nullptr) {
+      is_first = true;
+      auto stored = std::make_shared<StoredDatas>();
+      stored->reserve(datas.size());
+      for (const auto& data : datas) {
+        stored->push_back(data.to_owned());
+      }
+      message.datas = std::move(stored);
+    }
+    to_deliver = _settle(message_id, message);
+  }
+
+  // everyone learns that the author has the message from the message itself
+  if (is_first && author_id != id()) {
+    _signal(SignalKind::Seen, message_id, std::nullopt);
+  }
+  if (to_deliver != nullptr) {
+    _deliver(message_id, *to_deliver, callback);
+  }
+}
+
+auto UniformReliableBroadcast::_handle_signal(
+    const PerfectLink::ProcessIdType process_id,
+    const Slice<std::uint8_t> signal,
+    ListenCallback& callback) -> void {
+  if (signal.size() != SIGNAL_SIZE) {
+    // malformed, not one of ours
+    return;
+  }
+  const auto [signal_kind, message_id] = Signal::load(&signal[0]);
+  const auto kind = static_cast<SignalKind>(signal_kind);
+  if (!_has_member_author(message_id)) {
+    return;
+  }
+
+  switch (kind) {
+    case SignalKind::Seen: {
+      bool is_missing = false;
+      std::shared_ptr<const StoredDatas> to_deliver;
+      {
+        std::lock_guard lock(_acknowledged_mutex);
+        auto entry = _signaled.find(message_id);
+        if (entry == _signaled.end()) {
+          const auto [author_id, seq_nr] = _decode_message_id(message_id);
+          if (_delivered[author_id - 1].contains(seq_nr)) {
+            // we learned the sender has the message from a copy it sent us
+            return;
+          }
+          entry = _signaled.try_emplace(message_id).first;
+        }
+        auto& message = entry->second;
+        message.seen.insert(process_id);
+        is_missing = message.datas == nullptr;
+        to_deliver = _settle(message_id, message);
+      }
+
+      // the author might have crashed before sending us the message, ask the
+      // process that has it
+      if (is_missing) {
+        _signal(SignalKind::Want, message_id, process_id);
+      }
+      if (to_deliver != nullptr) {
+        _deliver(message_id, *to_deliver, callback);
+      }
+      break;
+    }
+
+    case SignalKind::Want: {
+      std::shared_ptr<const StoredDatas> stored;
+      {
+        std::lock_guard lock(_acknowledged_mutex);
+        // if the state was erased, the asking process has the message by now
+        auto entry = _signaled.find(message_id);
+        if (entry == _signaled.end() || entry->second.datas == nullptr) {
+          return;
+        }
+        stored = entry->second.datas;
+      }
+
+      std::array<std::uint8_t, sizeof(MessageIdType)> message_id_data;
+      codec::store_le(message_id_data.data(), message_id);
+      std::vector<Slice<std::uint8_t>> datas;
+      datas.reserve(stored->size());
+      for (const auto& data : *stored) {
+        datas.emplace_back(data.data(), data.size());
+      }
+
+      const auto& address = _link.processes().at(process_id);
+      // the datas arrived in a single packet, so they fit in one again
+      [[maybe_unused]] const auto sent = _link.send(
+          address.host, address.port,
+          Slice<std::uint8_t>(message_id_data.data(), message_id_data.size()),
+          PerfectLink::Payloads(datas.data(), datas.size()));
+      assert(sent == datas.size());
+      break;
+    }
+
+    default:
+      // an unknown kind, dropped like other malformed signals
+      break;
+  }
+}
+
+auto UniformReliableBroadcast::_settle(const MessageIdType message_id,
+                                       SignaledMessage& message)
+    -> std::shared_ptr<const StoredDatas> {
+  std::shared_ptr<const StoredDatas> to_deliver;
+  const auto seen_count = message.seen.size();
+  if (!message.delivered && message.datas != nullptr &&
+      seen_count > _link.processes().size() / 2) {
+    message.delivered = true;
+    to_deliver = message.datas;
+    _reached_majority(message_id);
+    const auto [author_id, seq_nr] = _decode_message_id(message_id);
+    _delivered[author_id - 1].insert(
+        seq_nr,
+        seq_nr + static_cast<PerfectLink::MessageIdType>(to_deliver->size()));
+  }
+
+  // nobody will ask for the message anymore
+  if (message.delivered && seen_count == _link.processes().size()) {
+    _signaled.erase(message_id);
+  }
+  return to_deliver;
+}
+
+auto UniformReliableBroadcast::_deliver(const MessageIdType message_id,
+                                        const StoredDatas& datas,
+                                        ListenCallback& callback) -> void {
+  auto [author_id, seq_nr] = _decode_message_id(message_id);
+  // if we are delivering our own broadcast, inform semaphore
+  if (author_id == id()) {
+    _send_semaphore.release();
+  }
+  for (const auto& data : datas) {
+    OwnedSlice<std::uint8_t> owned(data.data(), data.size());
+    callback(author_id, seq_nr, owned);
+    seq_nr += 1;
+  }
+  Metrics::increment(Metrics::Counter::UrbDelivered, datas.size());
+}
+
+auto UniformReliableBroadcast::_reached_majority(const MessageIdType message_id)
+    -> void {
+  const auto entry = _broadcast_at.find(message_id);
+  if (entry == _broadcast_at.end()) {
+    return;
+  }
+  Metrics::record(Metrics::Histogram::UrbTimeToMajority,
+                  Metrics::Clock::now() - entry->second);
+  _broadcast_at.erase(entry);
+}
+
+auto UniformReliableBroadcast::_signal(
+    const SignalKind kind,
+    const MessageIdType message_id,
+    const std::optional<PerfectLink::ProcessIdType> process_id) -> void {
+  std::array<std::uint8_t, SIGNAL_SIZE> data;
+  Signal::store(data.data(), static_cast<std::uint8_t>(kind), message_id);
+
+  if (process_id.has_value()) {
+    const auto& address = _link.processes().at(*process_id);
+    _link.send(address.host, address.port, std::nullopt,
+               std::make_tuple(data.data(), data.size()));
+  } else {
+    _link.broadcast(std::nullopt, std::make_tuple(data.data(), data.size()));
+  }
+}
+
+auto UniformReliableBroadcast::DeliveredRanges::contains(
+    const PerfectLink::MessageIdType seq_nr) const -> bool {
+  if (seq_nr < watermark) {
+    return true;
+  }
+  auto range = above.upper_bound(seq_nr);
+  if (range == above.begin()) {
+    return false;
+  }
+  range--;
+  return seq_nr < range->second;
+}
+
+auto UniformReliableBroadcast::DeliveredRanges::insert(
+    const PerfectLink::MessageIdType start,
+    const PerfectLink::MessageIdType end) -> void {
+  above.emplace(start, end);
+  // advance the watermark over the contiguous delivered prefix
+  while (!above.empty() && above.begin()->first == watermark) {
+    watermark = above.begin()->second;
+    above.erase(above.begin());
+  }
+}
+
+auto UniformReliableBroadcast::pending_entries() -> std::size_t {
+  std::lock_guard lock(_acknowledged_mutex);
+  return _acknowledged.size() + _signaled.size();
+}
+
+auto UniformReliableBroadcast::broadcast(const PerfectLink::Payloads datas)
+    -> void {
+  std::size_t offset = 0;
+  do {
+    const auto rest = offset == 0 ? datas : datas.subslice(offset);
+    const auto count = PerfectLink::packable(sizeof(MessageIdType), rest);
+    if (count == 0 && rest.size() > 0) {
+      throw std::runtime_error("Message is too large");
+    }
+
+    _send_semaphore.acquire();
+
+    MessageIdType message_id = 0;
+    std::array<std::uint8_t, sizeof(MessageIdType)> message_id_data;
+    {
+      std::lock_guard lock(_acknowledged_mutex);
+      // the unused high bytes are zero, so that every copy decodes to
+      // message_id
+      message_id = id() | (static_cast<MessageIdType>(_seq_nr)
+                           << (8 * sizeof(PerfectLink::ProcessIdType)));
+      codec::store_le(message_id_data.data(), message_id);
+
+      // add map entry to indicate this message is pending. With signals, our
+      // own copy of the message creates the entry
+      if (_relay_mode == RelayMode::Payload) {
+        _acknowledged.try_emplace(message_id);
+      }
+      _broadcast_at.emplace(message_id, Metrics::Clock::now());
+      _seq_nr += static_cast<PerfectLink::MessageIdType>(count);
+    }
+
+    [[maybe_unused]] const auto sent = _link.broadcast(
+        Slice<std::uint8_t>(message_id_data.data(), message_id_data.size()),
+        rest);
+    assert(sent == count);
+    offset += count;
+  } while (offset < datas.size());
+}
@@ -0,0 +1,73 @@
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <vector>
+#include "codec.hpp"
+
+namespace {
+
+auto failures = 0;
+
+auto check(const bool condition, const char* what) -> void {
+  if (!condition) {
+    std::fprintf(stderr, "FAILED: %s\n", what);
+    failures += 1;
+  }
+}
+
+auto decode(const std::vector<std::uint8_t>& data)
+    -> std::optional<std::vector<std::uint32_t>> {
+  // every value takes at least a byte
+  std::vector<std::uint32_t> values(data.size());
+  const auto count =
+      codec::decode_gaps(data.data(), data.size(), values.data());
+  if (!count.has_value()) {
+    return std::nullopt;
+  }
+  values.resize(*count);
+  return values;
+}
+
+auto test_round_trip() -> void {
+  std::vector<std::uint32_t> values;
+  // dense runs take the word path, the rest single varints
+  for (std::uint32_t value = 0; value < 20; value++) {
+    values.push_back(value);
+  }
+  values.push_back(1000);
+  values.push_back(1u << 20);
+  values.push_back(0xffffffff);
+
+  std::vector<std::uint8_t> data(5 * values.size());
+  data.resize(codec::encode_gaps(values.data(), values.size(), data.data(),
+                                 data.size()));
+  check(decode(data) == values, "encoded values decode to themselves");
+}
+
+auto test_truncated() -> void {
+  check(!decode({0x80}).has_value(), "a lone continuation byte fails");
+  check(!decode({0x05, 0xff, 0xff}).has_value(),
+        "a varint cut after its second byte fails");
+  const std::vector<std::uint8_t> word_then_cut{1, 1, 1, 1, 1, 1, 1, 1, 0x80};
+  check(!decode(word_then_cut).has_value(),
+        "a varint cut after a word of gaps fails");
+}
+
+auto test_overlong() -> void {
+  check(!decode({0xff, 0xff, 0xff, 0xff, 0xff, 0x01}).has_value(),
+        "a varint of six bytes fails");
+  check(!decode({0xff, 0xff, 0xff, 0xff, 0x10}).has_value(),
+        "a varint above 32 bits fails");
+  check(decode({0xff, 0xff, 0xff, 0xff, 0x0f}) ==
+            std::vector<std::uint32_t>{0xffffffff},
+        "the largest 32 bit varint decodes");
+}
+
+}  // namespace
+
+auto main() -> int {
+  test_round_trip();
+  test_truncated();
+  test_overlong();
+  return failures == 0 ? 0 : 1;
+}